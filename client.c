@@ -1,5 +1,9 @@
 #include "include/types.h"
 #include "include/command_parser.h"
+#include "include/checksum.h"
+#include "include/delta.h"
+#include "include/channel.h"
+#include "include/net.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -12,23 +16,38 @@
 #include <semaphore.h>
 #include <sys/mman.h>
 #include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
 
 void check_usage(int argc, char *argv[]);
-int check_connection_res(connection_response_t *response);
+int check_connection_res(connection_reply_t *response);
 int open_client_fifo(char *client_fifo_name, int mode);
 int parse_server_pid(char *str);
 int parse_connection_type(char *str);
+priority_t parse_priority(int argc, char *argv[]);
 void create_client_fifo(char *client_fifo_name);
 int connect_server_fifo(char *server_fifo_name);
+int connect_server_socket(pid_t server_pid);
+int read_connection_reply(int sock_fd, connection_reply_t *reply);
 sem_t *create_client_connection_sem();
 void set_signal_handlers();
-void bibo_client(int client_pid, int server_fd, connection_type_t connection_type, sem_t *client_connection_sem,
-                 connection_response_t *response, char *client_fifo_name_read, char *client_fifo_name_write);
+void bibo_client(int client_pid, int server_fd, int is_socket, connection_type_t connection_type, priority_t priority,
+                 sem_t *client_connection_sem, connection_reply_t *response, char *client_fifo_name_read,
+                 char *client_fifo_name_write);
 
-void send_connection_req(int client_pid, int server_fd, connection_type_t connection_type);
-connection_response_t *create_res_shm();
+void send_connection_req(int client_pid, int server_fd, int is_socket, connection_type_t connection_type,
+                         priority_t priority);
+connection_reply_t *create_res_shm();
 void disable_terminal();
 void enable_terminal();
+void prepare_download(command_t *command);
+int prepare_upload(command_t *command);
+void delta_upload(command_t *command, channel_t *channel);
+void send_edits(command_t *command, channel_t *channel);
+int send_delta_op(delta_op_t *op, void *ctx);
+int follow_file(channel_t *channel);
+int wait_input(channel_t *channel);
 
 struct termios orig_termios;
 volatile sig_atomic_t signal_received = 0;
@@ -45,23 +64,44 @@ int main(int argc, char *argv[])
     char server_fifo_name[SERVER_FIFO_NAME_LEN], client_fifo_name_write[CLIENT_WRITE_FIFO_NAME_LEN], client_fifo_name_read[CLIENT_READ_FIFO_NAME_LEN];
     pid_t server_pid, client_pid;
     connection_type_t connection_type;
-    sem_t *client_connection_sem;
-    connection_response_t *response;
+    priority_t priority;
+    sem_t *client_connection_sem = NULL;
+    connection_reply_t *response = NULL;
+    int is_socket;
 
     check_usage(argc, argv);
-    server_pid = parse_server_pid(argv[2]);
     connection_type = parse_connection_type(argv[1]);
+    priority = parse_priority(argc, argv);
     client_pid = getpid();
+    // host:port reaches a server listening for TCP clients, on this host or another
+    if (strchr(argv[2], ':') != NULL)
+    {
+        if ((server_fd = tcp_connect(argv[2])) == -1)
+        {
+            perror("Error while connecting to server");
+            exit(EXIT_FAILURE);
+        }
+        set_signal_handlers();
+        bibo_client(client_pid, server_fd, 1, connection_type, priority, NULL, NULL, NULL, NULL);
+        return 0;
+    }
+    server_pid = parse_server_pid(argv[2]);
     snprintf(client_fifo_name_write, CLIENT_WRITE_FIFO_NAME_LEN, CLIENT_WRITE_FIFO_TEMPLATE, (long)client_pid);
     snprintf(client_fifo_name_read, CLIENT_READ_FIFO_NAME_LEN, CLIENT_READ_FIFO_TEMPLATE, (long)client_pid);
     snprintf(server_fifo_name, SERVER_FIFO_NAME_LEN, SERVER_FIFO_TEMPLATE, (long)server_pid);
-    create_client_fifo(client_fifo_name_write);
-    create_client_fifo(client_fifo_name_read);
-    client_connection_sem = create_client_connection_sem();
-    response = create_res_shm();
-    server_fd = connect_server_fifo(server_fifo_name);
+    // Prefer the socket, older servers only listen on the FIFO
+    server_fd = connect_server_socket(server_pid);
+    is_socket = server_fd != -1;
+    if (!is_socket)
+    {
+        create_client_fifo(client_fifo_name_write);
+        create_client_fifo(client_fifo_name_read);
+        client_connection_sem = create_client_connection_sem();
+        response = create_res_shm();
+        server_fd = connect_server_fifo(server_fifo_name);
+    }
     set_signal_handlers();
-    bibo_client(client_pid, server_fd, connection_type, client_connection_sem, response,
+    bibo_client(client_pid, server_fd, is_socket, connection_type, priority, client_connection_sem, response,
                 client_fifo_name_read, client_fifo_name_write);
     return 0;
 }
@@ -74,31 +114,58 @@ void set_signal_handlers()
     sigaction(SIGQUIT, &sa_clean, NULL);
 }
 
-void bibo_client(int client_pid, int server_fd, connection_type_t connection_type, sem_t *client_connection_sem,
-                 connection_response_t *response, char *client_fifo_name_read, char *client_fifo_name_write)
+void bibo_client(int client_pid, int server_fd, int is_socket, connection_type_t connection_type, priority_t priority,
+                 sem_t *client_connection_sem, connection_reply_t *response, char *client_fifo_name_read,
+                 char *client_fifo_name_write)
 {
     int client_fd_write, client_fd_read, flag;
-    send_connection_req(client_pid, server_fd, connection_type);
-    sem_wait(client_connection_sem);
-    flag = check_connection_res(response);
-    disable_terminal();
-    sem_wait(client_connection_sem);
-    enable_terminal();
-    if ((client_fd_read = open(client_fifo_name_read, O_RDONLY)) == -1)
-    {
-        perror("Error while opening read fifo");
-        exit(EXIT_FAILURE);
+    connection_reply_t reply;
+    send_connection_req(client_pid, server_fd, is_socket, connection_type, priority);
+    if (is_socket)
+    {
+        // The admission result comes back on the socket, a second reply follows a wait in the queue
+        if (read_connection_reply(server_fd, &reply) == -1)
+            exit(EXIT_SUCCESS);
+        flag = check_connection_res(&reply);
+        if (flag == 1)
+        {
+            disable_terminal();
+            int status = read_connection_reply(server_fd, &reply);
+            enable_terminal();
+            if (status == -1)
+                exit(EXIT_SUCCESS);
+        }
+        response = &reply;
+        client_fd_read = server_fd;
+        client_fd_write = server_fd;
     }
-    if ((client_fd_write = open(client_fifo_name_write, O_WRONLY)) == -1)
+    else
     {
-        perror("Error whlie opening write fifo");
-        exit(EXIT_FAILURE);
+        sem_wait(client_connection_sem);
+        flag = check_connection_res(response);
+        disable_terminal();
+        sem_wait(client_connection_sem);
+        enable_terminal();
+        if ((client_fd_read = open(client_fifo_name_read, O_RDONLY)) == -1)
+        {
+            perror("Error while opening read fifo");
+            exit(EXIT_FAILURE);
+        }
+        if ((client_fd_write = open(client_fifo_name_write, O_WRONLY)) == -1)
+        {
+            perror("Error whlie opening write fifo");
+            exit(EXIT_FAILURE);
+        }
     }
     if (flag == 1)
     {
         printf(">> Connection established:\n");
         fflush(stdout);
     }
+    channel_t channel;
+    channel_init(&channel, client_fd_read, client_fd_write, client_connection_sem, 0, response->compression);
+    // Nothing may sit in a stdio buffer while the prompt polls stdin
+    setvbuf(stdin, NULL, _IONBF, 0);
     while (1)
     {
         printf("\n> ");
@@ -106,7 +173,7 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
 
         char command_str[MAX_COMMAND_LENGTH];
         command_t command;
-        if (fgets(command_str, sizeof(command_str), stdin) == NULL)
+        if (wait_input(&channel) == -1 || fgets(command_str, sizeof(command_str), stdin) == NULL)
         {
             if (errno == EINTR)
             {
@@ -123,14 +190,28 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
         else
         {
             command_str[strcspn(command_str, "\n")] = '\0';
-            if (parse_command(command_str, &command) == -1)
+            if (parse_command(command_str, &command) == -1 || !is_valid_command(&command))
             {
                 printf("Invalid command\n");
                 fflush(stdout);
                 continue;
             }
         }
-        if (write(client_fd_write, &command, sizeof(command)) == -1)
+        if (command.type == DOWNLOAD)
+            prepare_download(&command);
+        else if ((command.type == UPLOAD || command.type == DELTA_UPLOAD) && prepare_upload(&command) == -1)
+        {
+            printf("No file to upload");
+            fflush(stdout);
+            continue;
+        }
+        else if (command.type == BATCH_WRITE && access(command.string, R_OK) == -1)
+        {
+            printf("No file of edits to send");
+            fflush(stdout);
+            continue;
+        }
+        if (channel_write(&channel, &command, sizeof(command)) == -1)
         {
             if (errno == EINTR)
             {
@@ -158,21 +239,39 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
             exit(EXIT_SUCCESS);
         }
 
+        else if (command.type == READF && command.follow)
+        {
+            if (follow_file(&channel) == -1)
+            {
+                perror("read");
+                exit(EXIT_FAILURE);
+            }
+            continue;
+        }
         else if (command.type == DOWNLOAD)
         {
-            // Prepare the file for writing
-            char file_path[MAX_FILENAME_LENGTH];
-            int is_file_exist;
-            sprintf(file_path, "%s", command.file);
-            read(client_fd_read, &is_file_exist, sizeof(is_file_exist));
-            if (!is_file_exist)
+            // The handshake already went out with the command, see prepare_download()
+            transfer_info_t info;
+            if (channel_read(&channel, &info, sizeof(info)) == -1)
+            {
+                perror("Error reading download status");
+                exit(EXIT_FAILURE);
+            }
+            if (info.status != TRANSFER_OK)
             {
                 printf("There is no such a file to download\n");
                 continue;
             }
 
-            int file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-            if (file_fd == -1)
+            int file_fd;
+            if (info.offset > 0)
+            {
+                file_fd = open(command.file, O_RDWR);
+                printf("Resuming download at byte %lld of %lld\n", info.offset, info.size);
+            }
+            else
+                file_fd = open(command.file, O_RDWR | O_CREAT | O_TRUNC, 0777);
+            if (file_fd == -1 || ftruncate(file_fd, info.offset) == -1 || lseek(file_fd, info.offset, SEEK_SET) == -1)
             {
                 perror("Error opening file for writing");
                 continue;
@@ -180,14 +279,14 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
 
             response_t response;
             long int total_read = 0;
+            int is_corrupt = 0, is_failed = 0;
+            uint32_t file_crc = info.offset > 0 ? crc32c_file_range(file_fd, 0, info.offset) : 0;
             response.is_complete = 0;
 
             // Receive and write the response to the file in chunks
             while (!response.is_complete)
             {
-                sem_wait(client_connection_sem);
-                ssize_t bytes_read = read(client_fd_read, &response, sizeof(response));
-                if (bytes_read == -1)
+                if (channel_recv(&channel, &response) == -1)
                 {
                     if (errno == EINTR)
                     {
@@ -197,94 +296,151 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
                         close(client_fd_write);
                         exit(EXIT_SUCCESS);
                     }
-
                     perror("Error reading response");
-                    continue;
+                    // A frame that failed its checksum was read whole, the stream is still in step
+                    if (errno == EBADMSG)
+                    {
+                        is_corrupt = 1;
+                        continue;
+                    }
+                    is_failed = 1;
+                    break;
                 }
-                printf("%d bytes downloaded..\n", strlen(response.content));
-                total_read += strlen(response.content);
-                ssize_t bytes_written = write(file_fd, response.content, strlen(response.content));
+                printf("%d bytes downloaded..\n", response.length);
+                total_read += response.length;
+                file_crc = crc32c(file_crc, response.content, response.length);
+                ssize_t bytes_written = write(file_fd, response.content, response.length);
                 if (bytes_written == -1)
                 {
                     perror("Error writing to file");
                     break;
                 }
-
-                // Reset the buffer
-                memset(response.content, 0, sizeof(response.content));
             }
 
-            // Close the file
+            // The server follows the last chunk with the checksum of the whole file
+            long long expected_size = info.size;
+            if (is_failed || channel_read(&channel, &info, sizeof(info)) == -1)
+            {
+                close(file_fd);
+                unlink(command.file);
+                printf("Download of %s failed, the server closed the connection\n", command.file);
+                exit(EXIT_FAILURE);
+            }
             close(file_fd);
-            printf("File downloaded successfully. (%ld bytes)\n", total_read);
+            if (is_corrupt || info.checksum != file_crc || info.offset + total_read != expected_size)
+            {
+                printf("Download of %s failed its checksum, please try again\n", command.file);
+                unlink(command.file);
+            }
+            else
+                printf("File downloaded successfully. (%ld bytes, crc32c %08x)\n", total_read, file_crc);
 
             fflush(stdout);
             continue;
         }
+        else if (command.type == BATCH_WRITE)
+            // The server answers like any other command once it has every edit
+            send_edits(&command, &channel);
+        else if (command.type == DELTA_UPLOAD)
+        {
+            delta_upload(&command, &channel);
+            fflush(stdout);
+            continue;
+        }
         else if (command.type == UPLOAD)
         {
-            // Open the file for reading
-            int is_file_exist = 0;
-            int file_fd = open(command.file, O_RDONLY);
-            if (file_fd == -1)
+            transfer_info_t info;
+            channel_read(&channel, &info, sizeof(info));
+            if (info.status == TRANSFER_EXISTS)
             {
-                printf("No file to upload");
-                fflush(stdout);
+                printf("\nFile already exist!\n");
                 continue;
             }
-            char file_sem_name[FILE_SEM_NAME_LEN];
-            snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command.file);
-            sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
-            if (sem_file == SEM_FAILED)
+            if (info.status != TRANSFER_OK)
             {
-                perror("sem_open");
-                exit(EXIT_FAILURE);
+                printf("Upload failed, please try again\n");
+                continue;
             }
-            sem_wait(sem_file);
-            read(client_fd_read, &is_file_exist, sizeof(is_file_exist));
-            if (is_file_exist == 1)
+
+            // Resume from the server's part file if its last window matches ours
+            int file_fd = open(command.file, O_RDONLY);
+            struct stat st;
+            if (file_fd == -1 || fstat(file_fd, &st) == -1)
             {
-                printf("\nFile already exist!\n");
+                perror("Error opening file to upload");
+                if (file_fd != -1)
+                    close(file_fd);
+                // Leaves the server's part file as it is for a later try
+                info.size = info.offset;
+                channel_write(&channel, &info, sizeof(info));
+                response_t response;
+                memset(&response, 0, sizeof(response));
+                response.is_exit = 1;
+                channel_send(&channel, &response);
                 continue;
             }
+            if (info.offset > 0 && info.offset <= st.st_size &&
+                crc32c_file_range(file_fd, resume_window_start(info.offset), info.offset) == info.checksum)
+                printf("Resuming upload at byte %lld of %lld\n", info.offset, (long long)st.st_size);
+            else
+                info.offset = 0;
+            info.size = st.st_size;
+            channel_write(&channel, &info, sizeof(info));
+            lseek(file_fd, info.offset, SEEK_SET);
+
             // Read and send the file contents in chunks
             response_t response;
             ssize_t bytes_read;
             long int total_written = 0;
-            while ((bytes_read = read(file_fd, response.content, sizeof(response.content))) > 0)
+            uint32_t file_crc = info.offset > 0 ? crc32c_file_range(file_fd, 0, info.offset) : 0;
+            while (!signal_received && (bytes_read = read(file_fd, response.content, sizeof(response.content))) > 0)
             {
+                file_crc = crc32c(file_crc, response.content, bytes_read);
                 // Set the response properties
+                response.length = bytes_read;
                 response.is_complete = 0;
                 response.is_exit = 0;
 
                 // Send the response to the server
-                if (write(client_fd_write, &response, sizeof(response)) == -1)
+                if (channel_send(&channel, &response) == -1)
                 {
                     perror("Error writing to server");
                     break;
                 }
-                sem_post(client_connection_sem);
-                printf("%d bytes uploaded..\n", strlen(response.content));
-                total_written += strlen(response.content);
-                // Reset the buffer
-                memset(response.content, 0, sizeof(response.content));
+                printf("%d bytes uploaded..\n", response.length);
+                total_written += response.length;
             }
 
             // Close the file descriptor
             close(file_fd);
-            sem_post(sem_file);
-            sem_close(sem_file);
-            sem_unlink(file_sem_name);
-            // Send the exit flag to indicate the upload is complete
-            response.is_complete = 1;
+            // Send the exit flag, is_complete tells the server whether to commit
+            response.length = 0;
+            response.is_complete = !signal_received;
             response.is_exit = 1;
-            if (write(client_fd_write, &response, sizeof(response)) == -1)
+            // Without the last frame the server waits for ever, and so would we for its answer
+            if (channel_send(&channel, &response) == -1)
             {
                 perror("Error writing to server");
-                break;
+                exit(EXIT_FAILURE);
             }
-            printf("File uploaded successfully. (%ld bytes)\n", total_written);
-            response.is_exit = 0;
+            if (signal_received)
+            {
+                printf("\nUpload interrupted, run upload %s again to resume\n", command.file);
+                signal_received = 0;
+                continue;
+            }
+            info.checksum = file_crc;
+            if (channel_write(&channel, &info, sizeof(info)) == -1 || channel_read(&channel, &info, sizeof(info)) == -1)
+            {
+                perror("Error finishing upload");
+                exit(EXIT_FAILURE);
+            }
+            if (info.status == TRANSFER_OK)
+                printf("File uploaded successfully. (%ld bytes, crc32c %08x)\n", total_written, file_crc);
+            else if (info.status == TRANSFER_EXISTS)
+                printf("\nFile already exist!\n");
+            else
+                printf("Upload failed, please try again\n");
             continue;
         }
 
@@ -293,9 +449,8 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
 
         while (!response.is_complete)
         {
-            sem_wait(client_connection_sem);
             // Read the response from the server in chunks of 2048 bytes
-            if (read(client_fd_read, &response, sizeof(response)) == -1)
+            if (channel_recv(&channel, &response) == -1)
             {
                 if (errno == EINTR)
                 {
@@ -319,43 +474,44 @@ void bibo_client(int client_pid, int server_fd, connection_type_t connection_typ
             }
 
             // Process the chunk of data received from the server
-            printf("%s", response.content);
+            fwrite(response.content, 1, response.length, stdout);
             fflush(stdout);
-
-            // Reset the buffer
-            memset(response.content, 0, sizeof(response.content));
         }
     }
 
     // Clean up
-    unlink(client_fifo_name_read);
-    unlink(client_fifo_name_write);
+    if (!is_socket)
+    {
+        unlink(client_fifo_name_read);
+        unlink(client_fifo_name_write);
+    }
 }
 
 void check_usage(int argc, char *argv[])
 {
-    if (argc != 3 || (strcmp(argv[1], "connect") != 0 && strcmp(argv[1], "tryConnect") != 0))
+    if ((argc != 3 && argc != 4) || (strcmp(argv[1], "connect") != 0 && strcmp(argv[1], "tryConnect") != 0) ||
+        (argc == 4 && strcmp(argv[3], "high") != 0 && strcmp(argv[3], "normal") != 0 && strcmp(argv[3], "low") != 0))
     {
-        fprintf(stderr, "Usage: %s <connect/tryConnect> ServerPID\n", argv[0]);
+        fprintf(stderr, "Usage: %s <connect/tryConnect> <ServerPID/host:port> [high/normal/low]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 }
 
-int check_connection_res(connection_response_t *response)
+int check_connection_res(connection_reply_t *response)
 {
     int flag = 0;
-    if (*response == WAITING)
+    if (response->status == WAITING)
     {
         printf(">> Waiting for Que.. \n");
         fflush(stdout);
         flag = 1;
     }
-    else if (*response == CONNECTED)
+    else if (response->status == CONNECTED)
     {
         printf(">> Connection established:\n");
         fflush(stdout);
     }
-    else if (*response == LEAVE)
+    else if (response->status == LEAVE)
     {
         printf(">> Que full, leaving...\n");
         fflush(stdout);
@@ -395,6 +551,16 @@ int parse_connection_type(char *str)
         return TRY_CONNECT;
 }
 
+priority_t parse_priority(int argc, char *argv[])
+{
+    if (argc < 4 || strcmp(argv[3], "normal") == 0)
+        return PRIORITY_NORMAL;
+    else if (strcmp(argv[3], "high") == 0)
+        return PRIORITY_HIGH;
+    else
+        return PRIORITY_LOW;
+}
+
 void create_client_fifo(char *client_fifo_name)
 {
     if (mkfifo(client_fifo_name, 0777) == -1 && errno != EEXIST)
@@ -416,6 +582,38 @@ int connect_server_fifo(char *server_fifo_name)
     return server_fd;
 }
 
+// Returns a connected session socket, or -1 if the server has none
+int connect_server_socket(pid_t server_pid)
+{
+    struct sockaddr_un addr;
+    int sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock_fd == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), SERVER_SOCKET_TEMPLATE, (long)server_pid);
+    if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+int read_connection_reply(int sock_fd, connection_reply_t *reply)
+{
+    ssize_t bytes_read;
+    while ((bytes_read = recv(sock_fd, reply, sizeof(*reply), MSG_WAITALL)) == -1 && errno == EINTR && !signal_received)
+        ;
+    if (bytes_read != sizeof(*reply))
+    {
+        if (!signal_received)
+            printf(">> Server closed the connection\n");
+        return -1;
+    }
+    return 0;
+}
+
 sem_t *create_client_connection_sem()
 {
     char client_connection_sem_name[CLIENT_SEM_NAME_LEN];
@@ -431,12 +629,16 @@ sem_t *create_client_connection_sem()
     return client_connection_sem;
 }
 
-void send_connection_req(int client_pid, int server_fd, connection_type_t connection_type)
+void send_connection_req(int client_pid, int server_fd, int is_socket, connection_type_t connection_type,
+                         priority_t priority)
 {
-    connection_request_t request = {client_pid, connection_type};
+    connection_request_t request = {client_pid, connection_type, COMPRESSION_ZLIB, priority};
     int bytes_written;
     while ((bytes_written = write(server_fd, &request, sizeof(request))) == -1)
     {
+        // A server with no process free refuses before reading, its reply says so
+        if (is_socket && errno == EPIPE)
+            return;
         if (errno != EINTR)
         {
             perror("Error while writing to server FIFO");
@@ -449,9 +651,9 @@ void send_connection_req(int client_pid, int server_fd, connection_type_t connec
     }
 }
 
-connection_response_t *create_res_shm()
+connection_reply_t *create_res_shm()
 {
-    connection_response_t *shm_ptr;
+    connection_reply_t *shm_ptr;
     int shm_fd;
     char res_shm_name[RESPOND_SHM_LEN];
     snprintf(res_shm_name, RESPOND_SHM_LEN, RESPOND_SHM_TEMPLATE, (long)getpid());
@@ -461,12 +663,12 @@ connection_response_t *create_res_shm()
         perror("Error creating shared memory");
         exit(EXIT_FAILURE);
     }
-    if (ftruncate(shm_fd, sizeof(connection_response_t)) == -1)
+    if (ftruncate(shm_fd, sizeof(connection_reply_t)) == -1)
     {
         perror("Error resizing shared memory");
         exit(EXIT_FAILURE);
     }
-    shm_ptr = (connection_response_t *)mmap(NULL, sizeof(connection_response_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    shm_ptr = (connection_reply_t *)mmap(NULL, sizeof(connection_reply_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (shm_ptr == MAP_FAILED)
     {
         perror("Error mapping shared memory");
@@ -477,6 +679,9 @@ connection_response_t *create_res_shm()
 
 void disable_terminal()
 {
+    // Commands piped in have no terminal to quiet while queued
+    if (!isatty(STDIN_FILENO))
+        return;
     struct termios new_termios;
     if (tcgetattr(STDIN_FILENO, &orig_termios) == -1)
     {
@@ -499,9 +704,253 @@ void disable_terminal()
 
 void enable_terminal()
 {
+    if (!isatty(STDIN_FILENO))
+        return;
     if (tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios) == -1)
     {
         perror("tcsetattr");
         exit(EXIT_FAILURE);
     }
 }
+
+/*
+ Prints the lines the server streams until Enter or Ctrl-C is pressed,
+ then asks it to stop and waits for the end of the stream.
+*/
+int follow_file(channel_t *channel)
+{
+    printf("Following, press Enter to stop\n");
+    fflush(stdout);
+    response_t response;
+    response.is_complete = 0;
+    int is_cancelled = 0;
+    while (!response.is_complete)
+    {
+        struct pollfd fds[2] = {{channel->fd_read, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (poll(fds, is_cancelled ? 1 : 2, -1) == -1 && errno != EINTR)
+            return -1;
+        if (!is_cancelled && (signal_received || fds[1].revents != 0))
+        {
+            char line[MAX_COMMAND_LENGTH];
+            if (fds[1].revents != 0 && read(STDIN_FILENO, line, sizeof(line)) == -1 && errno != EINTR)
+                return -1;
+            command_t cancel;
+            init_command(&cancel);
+            cancel.type = READF;
+            if (channel_write(channel, &cancel, sizeof(cancel)) == -1)
+                return -1;
+            signal_received = 0;
+            is_cancelled = 1;
+            continue;
+        }
+        if (fds[0].revents == 0)
+            continue;
+        if (channel_recv(channel, &response) == -1)
+            return -1;
+        fwrite(response.content, 1, response.length, stdout);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/*
+ Waits at the prompt until something is typed, printing what the server
+ sends meanwhile: a warning that the session is idle, or the goodbye
+ that ends it. Returns -1 with errno set when a signal came first.
+*/
+int wait_input(channel_t *channel)
+{
+    while (1)
+    {
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {channel->fd_read, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                return -1;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+        if (fds[0].revents != 0)
+            return 0;
+        // A hang up with nothing to read means no frame and no post of the sem will come
+        response_t response;
+        if (!(fds[1].revents & POLLIN) || channel_recv(channel, &response) == -1)
+        {
+            printf("\nServer is closed\n");
+            exit(EXIT_SUCCESS);
+        }
+        fwrite(response.content, 1, response.length, stdout);
+        if (response.is_exit)
+        {
+            printf("bye..\n");
+            exit(EXIT_SUCCESS);
+        }
+        printf("\n> ");
+        fflush(stdout);
+    }
+}
+
+void prepare_download(command_t *command)
+{
+    // A partial file left by an interrupted download is offered for resuming
+    struct stat st;
+    int file_fd = open(command->file, O_RDONLY);
+    if (file_fd == -1)
+        return;
+    if (fstat(file_fd, &st) == 0 && st.st_size > 0)
+    {
+        command->offset = st.st_size;
+        command->checksum = crc32c_file_range(file_fd, resume_window_start(st.st_size), st.st_size);
+    }
+    close(file_fd);
+}
+
+int prepare_upload(command_t *command)
+{
+    // The transfer id stays the same as long as the local file is unchanged,
+    // so an interrupted upload finds its part file on the server again
+    struct stat st;
+    if (stat(command->file, &st) == -1 || !S_ISREG(st.st_mode))
+        return -1;
+    uint32_t id_hi = crc32c(0, command->file, strlen(command->file));
+    uint32_t id_lo = crc32c(id_hi, &st.st_size, sizeof(st.st_size));
+    id_lo = crc32c(id_lo, &st.st_mtime, sizeof(st.st_mtime));
+    command->transfer_id = ((unsigned long long)id_hi << 32) | id_lo;
+    command->size = st.st_size;
+    return 0;
+}
+
+void send_edits(command_t *command, channel_t *channel)
+{
+    // The file of edits travels like an upload, is_complete on the last
+    // frame tells the server whether to apply them
+    response_t response;
+    ssize_t bytes_read = 0;
+    int file_fd = open(command->string, O_RDONLY);
+    response.is_complete = 0;
+    response.is_exit = 0;
+    while (file_fd != -1 && !signal_received && (bytes_read = read(file_fd, response.content, sizeof(response.content))) > 0)
+    {
+        response.length = bytes_read;
+        if (channel_send(channel, &response) == -1)
+        {
+            perror("Error writing to server");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (file_fd != -1)
+        close(file_fd);
+    response.length = 0;
+    response.is_complete = file_fd != -1 && bytes_read == 0 && !signal_received;
+    response.is_exit = 1;
+    signal_received = 0;
+    if (channel_send(channel, &response) == -1)
+    {
+        perror("Error writing to server");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int send_delta_op(delta_op_t *op, void *ctx)
+{
+    channel_t *channel = ctx;
+    if (signal_received)
+        return -1;
+    if (channel_write(channel, op, sizeof(*op)) == -1)
+    {
+        perror("Error writing to server");
+        return -1;
+    }
+    return 0;
+}
+
+void delta_upload(command_t *command, channel_t *channel)
+{
+    delta_header_t header;
+    response_t response;
+    transfer_info_t info;
+    if (channel_read(channel, &header, sizeof(header)) == -1)
+    {
+        perror("Error reading delta header");
+        exit(EXIT_FAILURE);
+    }
+    if (header.status != TRANSFER_OK || header.block_count < 0 || header.block_length <= 0)
+    {
+        printf("Upload failed, please try again\n");
+        return;
+    }
+
+    // Collect the signatures of the server's copy
+    delta_sig_t *sigs = malloc((header.block_count + 1) * sizeof(delta_sig_t));
+    if (sigs == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    long long count = 0;
+    response.is_complete = 0;
+    while (!response.is_complete)
+    {
+        if (channel_recv(channel, &response) == -1)
+        {
+            perror("Error reading signatures");
+            exit(EXIT_FAILURE);
+        }
+        long long received = response.length / sizeof(delta_sig_t);
+        if (received > header.block_count + 1 - count)
+            received = header.block_count + 1 - count;
+        memcpy(sigs + count, response.content, received * sizeof(delta_sig_t));
+        count += received;
+    }
+
+    int file_fd = open(command->file, O_RDONLY);
+    struct stat st;
+    if (file_fd == -1 || fstat(file_fd, &st) == -1)
+    {
+        perror("Error opening file to upload");
+        if (file_fd != -1)
+            close(file_fd);
+        free(sigs);
+        // The server keeps its copy as it is
+        delta_op_t op;
+        memset(&op, 0, sizeof(op));
+        op.type = DELTA_ABORT;
+        channel_write(channel, &op, sizeof(op));
+        return;
+    }
+    unsigned char *data = NULL;
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, file_fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("mmap");
+            exit(EXIT_FAILURE);
+        }
+    }
+    long long literal_bytes = delta_generate(data, st.st_size, sigs, count, header.block_length, send_delta_op, channel);
+    if (data != NULL)
+        munmap(data, st.st_size);
+    close(file_fd);
+    free(sigs);
+    if (literal_bytes == -1)
+    {
+        delta_op_t op;
+        memset(&op, 0, sizeof(op));
+        op.type = DELTA_ABORT;
+        channel_write(channel, &op, sizeof(op));
+        printf("\nDelta upload interrupted, the server copy is unchanged\n");
+        signal_received = 0;
+        return;
+    }
+
+    if (channel_read(channel, &info, sizeof(info)) == -1)
+    {
+        perror("Error reading upload status");
+        exit(EXIT_FAILURE);
+    }
+    if (info.status == TRANSFER_OK)
+        printf("File uploaded successfully. (%lld bytes, %lld sent, %lld reused)\n", info.size, literal_bytes, info.offset);
+    else
+        printf("Upload failed, please try again\n");
+}
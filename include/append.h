@@ -0,0 +1,70 @@
+#ifndef APPEND_H
+#define APPEND_H
+
+#include "types.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define APPEND_SLOTS 64                  // files with appends pending at the same time
+#define APPEND_BUFFER_SIZE (64 * 1024)   // bytes a file can have waiting
+#define APPEND_FLUSH_BYTES (32 * 1024)   // a buffer this full is flushed without waiting longer
+#define APPEND_FLUSH_MS 1                // longest the first append waits for others to join
+#define APPEND_FLUSHER_TIMEOUT_MS 1000   // a flusher silent this long is checked for being alive
+#define APPEND_WAITERS 64                // appenders one file can have waiting
+
+// An append waiting for its flush, told the error of the flush that took it
+typedef struct
+{
+    uint64_t mark;                  // 0 for a free entry
+    int error;
+} append_waiter_t;
+
+/*
+ Lines appended to one file by any client, in arrival order. appended and
+ flushed count bytes ever added and ever written, an append is done once
+ flushed passes the mark it got.
+*/
+typedef struct
+{
+    char file[MAX_FILENAME_LENGTH]; // empty when the slot is free
+    int users;                      // appenders waiting on the slot
+    int flushing;
+    pid_t flusher;
+    uint64_t appended;
+    uint64_t flushed;
+    uint64_t flush_target;          // appended when the running flush took the buffer
+    append_waiter_t waiters[APPEND_WAITERS];
+    size_t length;
+    char buffer[APPEND_BUFFER_SIZE];
+} append_slot_t;
+
+/*
+ Shared by every child, mapped before the first fork. The first appender
+ that finds no flush running becomes the flusher: it waits up to
+ APPEND_FLUSH_MS for more lines, takes the whole buffer and writes it with
+ one call while the next lines already gather behind it.
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    append_slot_t slots[APPEND_SLOTS];
+} append_table_t;
+
+/*
+ Writes length bytes of data to the end of file, returns 0 or -1 with
+ errno set.
+*/
+typedef int (*append_flush_fn)(const char *file, const char *data, size_t length, void *ctx);
+
+append_table_t *append_table_init();
+/*
+ Adds data to the buffer of file and returns once flush has written it:
+ 0 on success, -1 with errno set when the flush failed, 1 without doing
+ anything when every slot is taken by other files or its file has too
+ many appends waiting.
+*/
+int append_submit(append_table_t *table, const char *file, const char *data, size_t length, append_flush_fn flush,
+                  void *ctx);
+
+#endif // APPEND_H
@@ -0,0 +1,58 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "types.h"
+#include "checksum.h"
+#include <semaphore.h>
+#include <zlib.h>
+
+#define COMPRESSION_MIN_LENGTH 64
+#define COMPRESSION_BACKOFF_FRAMES 16
+
+/*
+ One side of a client connection. The server posts sem after every frame
+ it sends and the client waits on it before reading one, traffic from the
+ client to the server relies on the blocking read alone. Socket sessions
+ have no sem and rely on the blocking read both ways.
+*/
+typedef struct
+{
+    int fd_read;
+    int fd_write;
+    sem_t *sem;
+    int is_server;
+    int is_stream;    // TCP, header and payload go out in one segment
+    compression_t compression;
+    z_stream deflater;
+    z_stream inflater;
+    int deflater_ready;
+    int inflater_ready;
+    int stream_open;  // the receiver holds our deflate history
+    int skip_frames;  // frames to send raw before trying to compress again
+    unsigned long long *bytes_sent;     // counted here when set, headers included
+    unsigned long long *bytes_received;
+} channel_t;
+
+void channel_init(channel_t *channel, int fd_read, int fd_write, sem_t *sem, int is_server, compression_t compression);
+void channel_destroy(channel_t *channel);
+/*
+ Send and receive a response_t as a frame_header_t plus payload, content
+ is compressed with the negotiated codec whenever that makes it smaller.
+ Both return 0 on success and -1 with errno set on failure, a frame whose
+ content does not match its crc32c fails with EBADMSG.
+*/
+int channel_send(channel_t *channel, response_t *response);
+int channel_recv(channel_t *channel, response_t *response);
+/*
+ Adds data to the content of response and sends each frame that fills
+ up, so a stream of small pieces goes out in full frames. The caller
+ sends what is left with is_complete set.
+*/
+int channel_append(channel_t *channel, response_t *response, const void *data, size_t len);
+/*
+ Fixed size messages such as commands and transfer handshakes.
+*/
+int channel_write(channel_t *channel, const void *buf, size_t len);
+int channel_read(channel_t *channel, void *buf, size_t len);
+
+#endif // CHANNEL_H
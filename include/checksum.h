@@ -0,0 +1,29 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "types.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ CRC32C (Castagnoli) of buf, continuing from a previous crc value.
+ Start a new checksum with crc = 0. Runs on the SSE4.2 crc32 instruction
+ when the CPU has one and on slicing-by-8 tables otherwise.
+*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+/*
+ CRC32C of the byte range [start, end) of fd, read with pread so the
+ file offset is left untouched. Returns 0 for an empty range.
+*/
+uint32_t crc32c_file_range(int fd, off_t start, off_t end);
+/*
+ 64-bit xxHash (XXH64) of buf, used where a collision resistant
+ block fingerprint is needed.
+*/
+uint64_t hash64(const void *buf, size_t len, uint64_t seed);
+/*
+ Start of the window that is verified before resuming a transfer at offset.
+*/
+off_t resume_window_start(off_t offset);
+
+#endif // CHECKSUM_H
@@ -12,6 +12,11 @@
  Returns 0 on success, or -1 on failure.
 */
 int parse_command(char *input_str, command_t *command);
+/*
+ Returns 1 if the file and string of a received command are terminated
+ and the file names something directly inside the served directory.
+*/
+int is_valid_command(const command_t *command);
 command_type_t get_type(char *str);
 char *get_message(command_type_t type);
 void init_command(command_t *command);
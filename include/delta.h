@@ -0,0 +1,31 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "types.h"
+#include "checksum.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef int (*delta_emit_fn)(delta_op_t *op, void *ctx);
+
+/*
+ Block length used for a basis file of the given size, roughly its
+ square root clamped to [DELTA_MIN_BLOCK_LENGTH, DELTA_MAX_BLOCK_LENGTH].
+*/
+int delta_block_length(long long size);
+/*
+ Rolling checksum of a block: low 16 bits hold the byte sum, high 16 bits
+ the position weighted sum.
+*/
+unsigned int delta_weak(const unsigned char *buf, size_t len);
+void delta_make_sig(const unsigned char *buf, size_t len, delta_sig_t *sig);
+/*
+ Walks data with a rolling checksum and calls emit with DELTA_COPY ops for
+ runs of blocks found in sigs and DELTA_LITERAL ops for everything else,
+ followed by a single DELTA_END op. Stops and returns -1 as soon as emit
+ returns -1, returns the number of literal bytes emitted otherwise.
+*/
+long long delta_generate(const unsigned char *data, size_t len, const delta_sig_t *sigs, long long count,
+                         int block_length, delta_emit_fn emit, void *ctx);
+
+#endif // DELTA_H
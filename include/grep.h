@@ -0,0 +1,61 @@
+#ifndef GREP_H
+#define GREP_H
+
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+#include <regex.h>
+
+#define GREP_MAX_THREADS 8
+#define GREP_PIECE_SIZE (4 * 1024 * 1024) // large files are searched in pieces of about this size
+#define GREP_MAX_TERMS 8
+
+/*
+ A pattern without regex metacharacters is searched for with memmem, which
+ glibc vectorises. Otherwise the longest run of characters every match
+ has to contain, if any, finds candidate lines the same way and only
+ those lines go through the regex.
+*/
+typedef struct
+{
+    int is_literal;
+    char literal[MAX_WRITE_STRING_LENGTH];
+    size_t literal_length; // 0 when the regex has no required run
+    regex_t regex;
+    int has_regex;
+    int term_count; // more literals a line needs besides literal (search)
+    char terms[GREP_MAX_TERMS][MAX_WRITE_STRING_LENGTH];
+    size_t term_lengths[GREP_MAX_TERMS];
+} grep_pattern_t;
+
+/*
+ Called once per matching line, in file order and line order within a file.
+ text does not include the newline. Returning -1 stops the search.
+*/
+typedef int (*grep_emit_fn)(const char *file, long long line, const char *text, size_t length, void *ctx);
+
+/*
+ Returns 0, or -1 if expr is not a valid extended regular expression.
+*/
+int grep_compile(grep_pattern_t *pattern, const char *expr);
+/*
+ A pattern for lines holding every one of count literal terms, the longest
+ one is searched for. Returns 0, or -1 if there are no usable terms.
+*/
+int grep_compile_terms(grep_pattern_t *pattern, char **terms, int count);
+void grep_free(grep_pattern_t *pattern);
+/*
+ Searches the files of dirname whose names match glob with worker threads,
+ large files split into pieces, and emits the matching lines in order.
+ Stops after limit matches unless limit is 0. Returns the number of
+ matches emitted, or -1 if emit asked to stop.
+*/
+long long grep_search(grep_pattern_t *pattern, const char *dirname, const char *glob, long long limit,
+                      grep_emit_fn emit, void *ctx);
+/*
+ grep_search over the given files of dirname, in the order given.
+*/
+long long grep_search_files(grep_pattern_t *pattern, const char *dirname, char **names, long long count,
+                            long long limit, grep_emit_fn emit, void *ctx);
+
+#endif // GREP_H
@@ -0,0 +1,64 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "types.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define INDEX_FILE_NAME ".index"
+#define INDEX_TEMP_NAME ".index.tmp"
+#define INDEX_MAGIC "BIBOIDX1"
+#define INDEX_SETTLE_MS 200 // quiet time after the last change before the index is rewritten
+
+/*
+ Trigram inverted index over the files of the server directory, kept in
+ INDEX_FILE_NAME: this header, one index_file_t per file sorted by name,
+ the postings, the ids of the files holding each trigram in increasing
+ order, then one index_trigram_t per trigram sorted by value. A trigram
+ is three bytes of content, first byte highest.
+
+ Every file carries what stat said before it was read, a file that does
+ not look the same any more is always searched, so a stale index costs
+ time but never answers.
+*/
+typedef struct
+{
+    char magic[8];
+    uint32_t file_count;
+    uint32_t trigram_count;
+    uint64_t posting_count;
+    uint64_t trigrams_offset;
+    uint64_t postings_offset;
+} index_header_t;
+
+typedef struct
+{
+    char name[MAX_FILENAME_LENGTH];
+    int64_t size;
+    int64_t mtime; // nanoseconds
+    uint64_t inode;
+} index_file_t;
+
+typedef struct
+{
+    uint32_t trigram;
+    uint32_t count;  // files holding it
+    uint64_t first;  // index of its first posting
+} index_trigram_t;
+
+/*
+ The indexer process: indexes every file of dirname, then follows changes
+ through inotify and rewrites the index once they settle. Returns when
+ interrupted by a signal.
+*/
+void index_run(const char *dirname, int log_fd);
+/*
+ Names of the files of dirname that may hold a line with all count terms,
+ in name order. Without a usable index that is every file. Returns the
+ number of names, *names is freed with index_free_names.
+*/
+long long index_candidates(const char *dirname, char **terms, int count, char ***names);
+void index_free_names(char **names, long long count);
+
+#endif // INDEX_H
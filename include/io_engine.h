@@ -0,0 +1,94 @@
+#ifndef IO_ENGINE_H
+#define IO_ENGINE_H
+
+#include "types.h"
+#include <linux/io_uring.h>
+
+#define IO_QUEUE_DEPTH 4           // blocks in flight per transfer
+#define IO_BLOCK_SIZE (128 * 1024) // bytes per read or write submitted
+#define IO_DIRECT_ALIGN 4096       // offset and length alignment of O_DIRECT reads
+#define IO_DROP_BEHIND_MIN (32 * 1024 * 1024) // buffered streams at least this long leave no cache behind
+
+typedef enum
+{
+    IO_BLOCK_FREE,
+    IO_BLOCK_IN_FLIGHT,
+    IO_BLOCK_DONE
+} io_block_state_t;
+
+typedef struct
+{
+    io_block_state_t state;
+    off_t offset;
+    size_t length;  // bytes asked for, or gathered so far by a writer
+    size_t done;    // bytes earlier completions of a short transfer already moved
+    ssize_t result; // bytes done or -errno once completed
+} io_block_t;
+
+/*
+ Streams one file at a time through IO_QUEUE_DEPTH registered buffers.
+ A reader keeps every buffer busy reading ahead while the caller sends
+ the oldest one, a writer gathers small writes into whole blocks and
+ only waits when all of them are still being written. The file is
+ registered as a fixed file for the duration of the transfer.
+
+ A reader on an O_DIRECT descriptor reads whole aligned blocks around the
+ range and hands out only the bytes asked for. A buffered reader tells
+ the kernel the stream is sequential, asks for the block past the ones in
+ flight, and on long streams drops what has already been sent.
+
+ When io_uring is not available (old kernel, seccomp, ...) ring_fd is -1
+ and the same calls fall back to pread and pwrite on the same buffers.
+
+ Only file I/O goes through the ring. Channel sends stay blocking writes
+ of one frame at a time, there is no batching of them here.
+*/
+typedef struct
+{
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    int has_fixed_buffers;
+    int has_fixed_file;
+    unsigned to_submit;
+    char *buffers;                     // IO_QUEUE_DEPTH blocks, page aligned
+    io_block_t blocks[IO_QUEUE_DEPTH];
+    int fd;
+    int head;                          // block handed out or filled next
+    int is_writer;
+    int is_direct;
+    int drop_behind;
+    off_t drop_offset;                 // reader: cache before this was already dropped
+    int error;                         // first errno a writer ran into
+    off_t next_offset;
+    off_t end;
+    size_t block_pos;                  // reader: bytes of blocks[head] already copied out
+} io_engine_t;
+
+/*
+ Sets up the ring, falling back silently when io_uring can not be used.
+*/
+void io_engine_init(io_engine_t *engine);
+void io_engine_destroy(io_engine_t *engine);
+/*
+ Reads [offset, end) of fd ahead of the caller, io_reader_read copies the
+ next bytes out in order like read(2) and returns 0 at end. fd may have
+ been opened with O_DIRECT.
+*/
+void io_reader_open(io_engine_t *engine, int fd, off_t offset, off_t end);
+ssize_t io_reader_read(io_engine_t *engine, void *buf, size_t len);
+void io_reader_close(io_engine_t *engine);
+/*
+ Writes sequentially to fd from offset on. Errors are reported by the
+ call that notices them and by io_writer_close, which waits for every
+ block to reach the file. Both return 0 or -1 with errno set.
+*/
+void io_writer_open(io_engine_t *engine, int fd, off_t offset);
+int io_writer_write(io_engine_t *engine, const void *buf, size_t len);
+int io_writer_close(io_engine_t *engine);
+
+#endif // IO_ENGINE_H
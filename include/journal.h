@@ -0,0 +1,85 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "types.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define JOURNAL_FILE_NAME ".journal"
+#define JOURNAL_MAGIC 0x314a4942u // "BIJ1"
+#define JOURNAL_COMMIT_MS 2       // default for -j, longest a record waits for others to share its fsync
+#define JOURNAL_COMMIT_RECORDS 32 // a group this large is synced without waiting any longer
+#define JOURNAL_CHECKPOINT_SIZE (4 * 1024 * 1024) // journal bytes that trigger a checkpoint
+#define JOURNAL_LEADER_TIMEOUT_MS 1000 // a leader silent this long is checked for being alive
+
+/*
+ One in-place write, followed by length bytes of data. The record is a
+ physical redo: writing the same bytes at the same offset again changes
+ nothing, so replay does not need to know what was already applied. The
+ identity of the file at the time guards against replaying onto a file
+ that has since been replaced by a rename (upload, writeT -b).
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t length;
+    uint32_t checksum; // crc32c of the record past this field and the data
+    uint32_t reserved;
+    int64_t offset;
+    uint64_t inode;
+    int64_t birth;     // creation time in ns, 0 when the file system does not keep it
+    char file[MAX_FILENAME_LENGTH];
+} journal_record_t;
+
+/*
+ Group commit state shared by every child, mapped before the first fork.
+ Records are appended under the lock, the first writer to need them
+ durable becomes the leader, waits up to commit_ms for more records and
+ syncs them all with one fdatasync. LSNs count bytes ever appended.
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int fd;
+    int commit_ms;
+    uint64_t appended_lsn;
+    uint64_t durable_lsn;
+    long long records;         // appended
+    long long durable_records;
+    long long unapplied;       // records not yet written to their file
+    int has_leader;
+    pid_t leader;
+    off_t size;                // journal bytes since the last checkpoint
+    int is_failed;             // an fdatasync failed, no record is taken until the next start
+    char dirname[MAX_PATH_LENGTH];
+} journal_t;
+
+/*
+ Applies the records of a journal left by a crash and empties it. Runs
+ before the journal is opened and any client is served.
+*/
+void journal_replay(const char *dirname, int log_fd);
+journal_t *journal_open(const char *dirname, int commit_ms);
+/*
+ Writes length bytes of data at offset of fd, which is file of the server
+ directory, once the record of it is durable. held is set to the offset
+ of the record in the journal until the write is done, -1 after, in memory
+ that outlives the caller. Returns 0, or -1 with errno set, EIO once the
+ journal could not be synced.
+*/
+int journal_write(journal_t *journal, const char *file, int fd, off_t offset, const void *data, size_t length,
+                  long long *held);
+/*
+ Finishes the write of a caller that died holding the record at held, so
+ that the journal can be checkpointed again.
+*/
+void journal_abandon(journal_t *journal, long long *held);
+/*
+ Empties the journal once every child is gone and every record is in its
+ file, so the next start has nothing to replay over files that may be
+ changed in between.
+*/
+void journal_close(journal_t *journal);
+
+#endif // JOURNAL_H
@@ -0,0 +1,77 @@
+#ifndef META_H
+#define META_H
+
+#include "types.h"
+#include <stdint.h>
+#include <pthread.h>
+
+#define META_WAYS 4                     // entries a name may take, the least recently used goes
+#define META_SETS 4096
+#define META_LOCKS 64                   // sets share locks round robin
+#define META_BLOOM_BITS (1u << 23)      // 1 MiB, a few percent false positives at a million files
+#define META_BLOOM_HASHES 4
+
+typedef enum
+{
+    META_EMPTY,
+    META_PRESENT,
+    META_ABSENT
+} meta_state_t;
+
+/*
+ What stat said about a file of the server directory the last time
+ anyone looked, or that it was not there. size is what a reader gets,
+ for a manifest the size of the file it describes.
+*/
+typedef struct
+{
+    char file[MAX_FILENAME_LENGTH];
+    meta_state_t state;
+    uint64_t inode;
+    long long size;
+    int64_t mtime;    // ns
+    long long lines;  // -1 until a readF counted them
+    uint64_t used;    // tick of the last use
+} meta_entry_t;
+
+/*
+ Shared by every child, mapped before the first fork. A Bloom filter of
+ every name in the directory answers most misses without a system call,
+ the table holds the rest. The server drops an entry whenever it changes
+ the file, the watcher child does the same for changes made behind the
+ server's back, found with inotify. Until the watcher has filled the
+ filter, or when it can not watch at all, lookups go to the file system.
+*/
+typedef struct
+{
+    pthread_mutex_t locks[META_LOCKS];
+    uint64_t changes[META_LOCKS];       // bumped with every drop, a lookup racing one keeps its answer to itself
+    uint64_t tick;
+    int is_ready;
+    int active_bloom;                   // the filter in use, the other is rebuilt after an overflow
+    uint64_t bloom[2][META_BLOOM_BITS / 64];
+    meta_entry_t entries[META_SETS][META_WAYS];
+} meta_cache_t;
+
+meta_cache_t *meta_init();
+/*
+ Looks file up, from memory when it can. Returns 1 and fills entry when
+ the file exists, 0 when it does not.
+*/
+int meta_lookup(meta_cache_t *cache, const char *dirname, const char *file, meta_entry_t *entry);
+/*
+ Called by the server whenever it creates or changes file.
+*/
+void meta_changed(meta_cache_t *cache, const char *file);
+/*
+ Remembers the line count of file as entry describes it, if it is still
+ the same file.
+*/
+void meta_set_lines(meta_cache_t *cache, const meta_entry_t *entry, long long lines);
+/*
+ The watcher: fills the filter and follows changes to dirname until a
+ signal ends it.
+*/
+void meta_run(meta_cache_t *cache, const char *dirname, int log_fd);
+
+#endif // META_H
@@ -0,0 +1,21 @@
+#ifndef NET_H
+#define NET_H
+
+#include "types.h"
+
+#define TCP_LISTEN_BACKLOG 128
+#define MAX_HOST_LENGTH 256
+
+/*
+ Both take "[host:]port", an IPv6 host goes in brackets. Without a host
+ the listener binds 127.0.0.1, 0.0.0.0 or [::] serve every interface,
+ and the client connects to loopback.
+*/
+int tcp_listen(const char *address);    // non-blocking, exits on failure
+int tcp_connect(const char *address);   // blocking, -1 with errno set on failure
+/*
+ Most responses are small, send them right away instead of waiting for more.
+*/
+void tcp_set_nodelay(int sock_fd);
+
+#endif // NET_H
@@ -1,22 +1,103 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include "types.h"
 #include <stdlib.h>
+#include <semaphore.h>
 
+#define QUEUE_CAPACITY 1024 // power of two
+#define CACHE_LINE_SIZE 64
+#define ADMISSION_WAITERS (QUEUE_CAPACITY * PRIORITY_CLASSES)
+
+typedef struct
+{
+    unsigned long sequence; // which lap of the ring may use this slot next
+    client_info_t client;
+} queue_slot_t;
+
+/*
+ Bounded MPMC ring of waiting clients that lives entirely inside one
+ shared memory segment, so the parent and every child see the same queue.
+ Producers and consumers claim positions with a compare and swap on their
+ own counter and hand slots over through the per slot sequence number,
+ no process ever holds a lock. The counters sit on separate cache lines
+ so enqueuers and dequeuers do not slow each other down.
+*/
 typedef struct
 {
-    void **data;
-    int front;
-    int rear;
-    int capacity;
-    int size;
+    unsigned long enqueue_pos;
+    char enqueue_pad[CACHE_LINE_SIZE - sizeof(unsigned long)];
+    unsigned long dequeue_pos;
+    char dequeue_pad[CACHE_LINE_SIZE - sizeof(unsigned long)];
+    queue_slot_t slots[QUEUE_CAPACITY];
 } queue_t;
 
-queue_t *queue_create();
-void queue_destroy(queue_t *queue);
-void queue_enqueue(queue_t *queue, void *item);
-void *queue_dequeue(queue_t *queue);
-void *queue_peek(queue_t *queue);
+#define ADMISSION_WAITER_FREE 0
+#define ADMISSION_WAITER_QUEUED 1
+#define ADMISSION_WAITER_ADMITTED 2  // handed a slot, woken
+#define ADMISSION_WAITER_ABANDONED 3 // its child died while queued
+
+/*
+ A child waiting in the queue sleeps on its own wakeup, so a freed slot
+ goes to the process that holds that client's connection.
+*/
+typedef struct
+{
+    sem_t wakeup;
+    int in_use; // ADMISSION_WAITER_*
+} admission_waiter_t;
+
+/*
+ The waiting room shared by the parent and every child: one ring per
+ priority class, the number of clients being served and how many may be.
+ The limit moves between limit_min and limit_max with the load and can
+ be changed by a local client up to limit_cap, see admission in server.c.
+*/
+typedef struct
+{
+    queue_t classes[PRIORITY_CLASSES];
+    int active; // see admission in server.c
+    char active_pad[CACHE_LINE_SIZE - sizeof(int)];
+    int limit;
+    int limit_min;
+    int limit_max;
+    int limit_cap;    // most clients the process table was sized for
+    int idle_timeout; // seconds a session may go without a command, 0 for ever
+    admission_waiter_t waiters[ADMISSION_WAITERS];
+} admission_queue_t;
+
+void queue_init(queue_t *queue);
+/*
+ Both return 0 on success, -1 when the queue is full or empty.
+*/
+int queue_enqueue(queue_t *queue, const client_info_t *client);
+int queue_dequeue(queue_t *queue, client_info_t *client);
+/*
+ Number of clients waiting, counting ones whose enqueue is still in flight.
+*/
 int queue_size(queue_t *queue);
 
+void admission_queue_init(admission_queue_t *queue);
+int admission_enqueue(admission_queue_t *queue, const client_info_t *client);
+/*
+ Takes the longest waiting client of the highest priority class that has one.
+*/
+int admission_dequeue(admission_queue_t *queue, client_info_t *client);
+int admission_waiting(admission_queue_t *queue);
+/*
+ Claims a free waiter for the calling child, returns its index or -1.
+*/
+int admission_waiter_claim(admission_queue_t *queue);
+void admission_waiter_release(admission_queue_t *queue, int waiter);
+/*
+ Hands a slot to the child sleeping on waiter. Returns 0 and frees the
+ waiter instead when that child is gone.
+*/
+int admission_waiter_wake(admission_queue_t *queue, int waiter);
+/*
+ For a child that died or gave up holding waiter. Returns 1 if a slot had already
+ been handed to it, which the caller then gives back.
+*/
+int admission_waiter_abandon(admission_queue_t *queue, int waiter);
+
 #endif
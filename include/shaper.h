@@ -0,0 +1,56 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include "types.h"
+#include <time.h>
+
+typedef enum
+{
+    TRAFFIC_INTERACTIVE, // readF, list, help and the like
+    TRAFFIC_BULK         // upload, download and delta upload
+} traffic_class_t;
+
+/*
+ Disk bandwidth shared by every child, lives in memory mapped before the
+ first fork. Each session moving bulk data adds its weight while it runs
+ and gets total bulk rate * weight / total_weight of it.
+*/
+typedef struct
+{
+    int total_weight;
+} bandwidth_t;
+
+typedef struct
+{
+    double rate;   // bytes per second, 0 means no limit
+    double burst;  // most tokens that can pile up while idle
+    double tokens;
+    struct timespec last;
+} token_bucket_t;
+
+typedef struct
+{
+    token_bucket_t buckets[2]; // one per traffic_class_t
+    bandwidth_t *shared;
+    double shared_rate;        // total bulk rate split among sessions
+    int weight;
+    priority_t priority;
+    int in_bulk;               // our weight is in shared->total_weight
+} shaper_t;
+
+void shaper_init(shaper_t *shaper, bandwidth_t *shared, const server_config_t *config, priority_t priority);
+/*
+ Starts a command of the given class: sets the I/O priority of the
+ process and joins the fair share for bulk transfers.
+*/
+void shaper_begin(shaper_t *shaper, traffic_class_t traffic);
+/*
+ Accounts for bytes moved and sleeps as long as the limits require.
+*/
+void shaper_throttle(shaper_t *shaper, traffic_class_t traffic, size_t bytes);
+/*
+ Leaves the fair share, safe to call when no command is running.
+*/
+void shaper_end(shaper_t *shaper);
+
+#endif // SHAPER_H
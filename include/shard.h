@@ -0,0 +1,62 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#define SHARD_DIR ".shards"
+#define SHARD_COUNT 256        // subdirectories, a power of two
+#define SHARD_SCAN_THREADS 8   // shards listed at the same time
+
+/*
+ With -S the files of the server directory live in SHARD_DIR/xx/<file>,
+ xx the crc32c of the name modulo SHARD_COUNT in hex, so no directory
+ grows with the number of files. Clients still see one flat directory:
+ every path of a file comes from shard_path and listings from
+ shard_list. Temporaries stay in the server directory and are renamed
+ into place across directories of the same file system.
+
+ A flat directory is converted while it is served. Until that is done a
+ file missing from its shard is looked for where it used to be, new
+ files always go to the shard.
+*/
+
+/*
+ Turns sharding on when wanted or when dirname already has shards, and
+ creates the shard directories. Called once before the first fork.
+*/
+void shard_setup(const char *dirname, int is_wanted);
+int shard_is_enabled();
+/*
+ Path of file in dirname, whether or not it exists yet.
+*/
+void shard_path(const char *dirname, const char *file, char *path, size_t size);
+/*
+ Keeps file from being moved into its shard until shard_unlock, so a
+ path from shard_path stays the one to change. Taken by every writer
+ before it finds the path of its file, and by readers until the file is
+ open. Returns what shard_unlock takes,
+ -1 when no file is left to move.
+*/
+int shard_lock(const char *dirname, const char *file);
+void shard_unlock(int lock_fd);
+/*
+ Directory file is kept in, for watching it.
+*/
+void shard_dir(const char *dirname, const char *file, char *path, size_t size);
+/*
+ Names of every file of dirname, hidden ones left out, sorted. Returns
+ their number; free them with shard_free_names.
+*/
+long long shard_list(const char *dirname, char ***names);
+void shard_free_names(char **names, long long count);
+/*
+ Moves the files still lying flat in dirname into their shards, each
+ with its shard locked against writers, until done or *stop is set. Runs in a child of its
+ own while clients are served.
+*/
+void shard_migrate(const char *dirname, int log_fd, volatile sig_atomic_t *stop);
+
+#endif // SHARD_H
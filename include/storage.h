@@ -0,0 +1,111 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "types.h"
+#include "checksum.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#define CHUNK_STORE_DIR ".chunks"
+#define MANIFEST_MAGIC "BIBOCAS1"
+#define CDC_MIN_CHUNK (2 * 1024)
+#define CDC_AVG_BITS 13 // cut points land every 8K on average past the minimum
+#define CDC_MAX_CHUNK (64 * 1024)
+#define MANIFEST_FILE_TEMPLATE ".%s.%ld.manifest"
+#define MATERIALIZE_FILE_TEMPLATE ".%s.%ld.plain"
+#define STORAGE_TEMP_NAME_LEN (sizeof(MANIFEST_FILE_TEMPLATE) + MAX_FILENAME_LENGTH + 20)
+
+/*
+ With the deduplicating backend a file in the server directory may be a
+ manifest: this header followed by one manifest_entry_t per chunk, in
+ file order. Manifests also carry the sticky bit, which nothing else in
+ the directory sets, so a client can not pass off an upload as one.
+ Chunks live once in CHUNK_STORE_DIR/xx/<hash>, each a 64 bit reference
+ count followed by the data, the count is updated under flock.
+*/
+typedef struct
+{
+    char magic[8];
+    long long size;          // size of the file the manifest describes
+    long long count;         // number of entries that follow
+    unsigned int checksum;   // crc32c of the entries
+    unsigned int reserved;
+} manifest_header_t;
+
+typedef struct
+{
+    unsigned long long hash[2];
+    unsigned int length;
+    unsigned int reserved;
+} manifest_entry_t;
+
+/*
+ Read side of a stored file, a plain file or a manifest alike.
+*/
+typedef struct
+{
+    int fd;
+    int is_manifest;
+    long long size;
+    long long pos;
+    manifest_entry_t *entries;
+    long long *offsets;      // file offset each entry starts at
+    long long count;
+    long long chunk_index;   // chunk open in chunk_fd, -1 if none
+    int chunk_fd;
+    char dirname[MAX_PATH_LENGTH];
+} stored_file_t;
+
+/*
+ Opens path for reading. Returns 0 on success, -1 with errno set otherwise.
+ What is opened stays as it was until storage_close without any lock
+ held in between: writers replace a file someone reads instead of editing
+ it, and a manifest keeps its chunks. So the file lock is only needed
+ around the open.
+*/
+int storage_open(stored_file_t *file, const char *dirname, const char *path);
+ssize_t storage_read(stored_file_t *file, void *buf, size_t len);
+ssize_t storage_pread(stored_file_t *file, void *buf, size_t len, off_t offset);
+off_t storage_seek(stored_file_t *file, off_t offset);
+uint32_t storage_crc32c(stored_file_t *file, off_t start, off_t end);
+void storage_close(stored_file_t *file);
+/*
+ Returns 1 if fd holds a manifest, 0 if it is a plain file.
+*/
+int storage_is_manifest(int fd);
+/*
+ Splits the contents of src_fd into content defined chunks, adds them to
+ the chunk store and writes a manifest for them to manifest_path. Returns
+ 0 on success, -1 if the data had to stay where it was.
+*/
+int storage_ingest(const char *dirname, int src_fd, const char *manifest_path);
+/*
+ Drops the references a manifest holds, deleting chunks nobody uses any more.
+ Does nothing while the manifest still has a name, call it once the last
+ one is gone. While it is still open for reading the last reader does it.
+*/
+void storage_release(const char *dirname, int manifest_fd);
+/*
+ Returns 1 if the plain file fd is open through storage_open anywhere, an
+ in-place write would then change what is being read.
+*/
+int storage_has_readers(int fd);
+/*
+ Releases and removes a manifest written by storage_ingest that never
+ made it into place.
+*/
+void storage_discard(const char *dirname, const char *manifest_path);
+/*
+ Turns the manifest dirname/file back into a plain file so it can be
+ edited in place. Does nothing for plain files.
+*/
+int storage_materialize(const char *dirname, const char *file);
+/*
+ Recounts references from every manifest in dirname and its versions,
+ each inode once, and removes chunks that are no longer referenced, e.g.
+ after a crash between steps. Does nothing without a chunk store.
+*/
+void storage_gc(const char *dirname, int log_fd);
+
+#endif // STORAGE_H
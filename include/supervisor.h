@@ -0,0 +1,98 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+#include "types.h"
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define SUPERVISOR_HELPERS 4          // indexer, shard migrator, metadata watcher, tuner
+#define SUPERVISOR_MAX_RESTARTS 5     // crashes in a row before a helper is left down
+#define SUPERVISOR_STABLE_SECONDS 10  // a helper that ran this long starts its count again
+
+typedef enum
+{
+    WORKER_RESTART_NEVER,
+    WORKER_RESTART_ON_FAILURE // killed by a signal or exited with a non-zero status
+} worker_restart_t;
+
+/*
+ What a worker tells the supervisor while it runs, in memory shared with
+ the parent so it is still there when the worker crashed.
+*/
+typedef struct
+{
+    long counter_id;                   // client_<n> it serves, 0 for none
+    int is_admitted;                   // holds an admission slot
+    int waiter;                        // admission waiter it sleeps on, -1 for none
+    long long journal_record;          // offset of its journal record not yet written, -1 for none
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+} worker_report_t;
+
+typedef struct
+{
+    pid_t pid;                         // -1 for a free slot
+    const char *name;
+    worker_restart_t restart;
+    void (*run)(void *arg);            // what a restarted worker does again
+    void *arg;
+    int restarts;                      // crashes in a row
+    struct timespec started;
+    worker_report_t *report;
+} worker_t;
+
+/*
+ The parent's table of children, fixed in size. Exits are picked up from
+ a signalfd for SIGCHLD, each with its resource usage from wait4, and
+ their slots taken again by the next fork. A worker whose restart policy
+ says so is forked again in the same slot.
+*/
+typedef struct
+{
+    worker_t *workers;
+    worker_report_t *reports;          // shared, one per slot
+    int *free_slots;                   // stack of the slots not in use
+    int *pid_slots;                    // slot of every live pid, open addressing, -1 for an empty entry
+    unsigned int pid_mask;             // entries in pid_slots less one, a power of two
+    int free_count;
+    int capacity;
+    int live;
+    int signal_fd;
+    int is_stopping;
+    int log_fd;
+    sigset_t orig_mask;
+    void (*exited)(const worker_t *worker); // called for every worker reaped, before its slot is reused
+} supervisor_t;
+
+/*
+ Blocks SIGCHLD in the caller and opens signal_fd for it. Called once in
+ the parent before the first fork.
+*/
+void supervisor_init(supervisor_t *supervisor, int capacity, int log_fd, void (*exited)(const worker_t *worker));
+/*
+ Forks a worker into a free slot. The worker runs run(arg) and exits;
+ with a NULL run this works like fork and the child goes on by itself
+ from the 0 it gets back. Returns -1 with errno set when the fork failed,
+ EAGAIN when every slot is taken.
+*/
+pid_t supervisor_spawn(supervisor_t *supervisor, const char *name, worker_restart_t restart, void (*run)(void *),
+                       void *arg);
+/*
+ Reaps every worker that has exited, called when signal_fd is readable.
+*/
+void supervisor_reap(supervisor_t *supervisor);
+/*
+ Sends sig to every worker. Async signal safe, does nothing in a worker.
+*/
+void supervisor_signal(supervisor_t *supervisor, int sig);
+/*
+ Waits for every worker to exit, restarting none.
+*/
+void supervisor_stop(supervisor_t *supervisor);
+/*
+ The calling worker's own report, NULL in the parent.
+*/
+worker_report_t *supervisor_self();
+
+#endif // SUPERVISOR_H
@@ -1,6 +1,7 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#define _GNU_SOURCE // GNU getopt and the Linux specific file calls
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
 #include <stdio.h>
@@ -15,6 +16,10 @@
 #define MAX_COMMAND_LENGTH 512
 #define SERVER_FIFO_TEMPLATE "/tmp/bibo_server.%ld"
 #define SERVER_FIFO_NAME_LEN (sizeof(SERVER_FIFO_TEMPLATE) + 20)
+#define SERVER_SOCKET_TEMPLATE "/tmp/bibo_server.%ld.sock"
+#define SERVER_SOCKET_NAME_LEN (sizeof(SERVER_SOCKET_TEMPLATE) + 20)
+#define SERVER_SOCKET_BACKLOG 64
+#define SOCKET_REQUEST_TIMEOUT 5 // seconds a new connection may take to send its request
 #define CLIENT_WRITE_FIFO_TEMPLATE "/tmp/bibo_client_write.%ld"
 #define CLIENT_WRITE_FIFO_NAME_LEN (sizeof(CLIENT_WRITE_FIFO_TEMPLATE) + 20)
 #define CLIENT_READ_FIFO_TEMPLATE "/tmp/bibo_client_read.%ld"
@@ -30,6 +35,26 @@
 #define RESPOND_SHM_LEN (sizeof(FREE_SLOT_SEM_NAME_TEMPLATE) + 20)
 #define SHM_QUEUE_NAME_TEMPLATE "/que.%ld"
 #define SHM_QUEUE_NAME_LEN (sizeof(SHM_QUEUE_NAME_TEMPLATE) + 20)
+#define PART_FILE_TEMPLATE ".%s.%016llx.part"
+#define PART_FILE_NAME_LEN (sizeof(PART_FILE_TEMPLATE) + MAX_FILENAME_LENGTH + 16)
+#define PART_FILE_HASHED_TEMPLATE ".%016llx.%016llx.part" // for names that would not fit in NAME_MAX
+#define RESUME_VERIFY_WINDOW (64 * 1024)
+#define DELTA_FILE_TEMPLATE ".%s.%ld.delta"
+#define DELTA_FILE_NAME_LEN (sizeof(DELTA_FILE_TEMPLATE) + MAX_FILENAME_LENGTH + 20)
+#define PART_FILE_MAX_AGE (7 * 24 * 60 * 60) // seconds an abandoned upload may wait to be resumed
+#define BATCH_FILE_TEMPLATE ".%s.%ld.batch"
+#define BATCH_FILE_NAME_LEN (sizeof(BATCH_FILE_TEMPLATE) + MAX_FILENAME_LENGTH + 20)
+#define BATCH_MAX_LENGTH (64 * 1024 * 1024) // bytes of edits one writeT -b may carry
+#define DELTA_MIN_BLOCK_LENGTH 2048
+#define DELTA_MAX_BLOCK_LENGTH (128 * 1024)
+#define DIRECT_IO_THRESHOLD (256LL * 1024 * 1024) // default for -D, in bytes
+#define SESSION_IDLE_TIMEOUT 900   // default for -I, seconds a session may go without a command
+#define SESSION_IDLE_WARNING 60    // seconds of notice before an idle session is closed
+#define SESSION_IDLE_POLL_MS 5000  // an idle session looks at a changed timeout this often
+#define ADMISSION_TUNE_MS 1000     // the limit is adjusted at most this often
+#define ADMISSION_BUSY_PRESSURE 40 // % of time stalled on CPU or I/O above which the limit comes down
+#define ADMISSION_IDLE_PRESSURE 10 // below which it goes up while clients wait
+#define ADMISSION_HANDOFF_SPINS 1000 // yields an enqueue in flight gets before its client counts as dead
 
 typedef enum
 {
@@ -37,8 +62,14 @@ typedef enum
     LIST,
     READF,
     WRITET,
+    BATCH_WRITE,
     UPLOAD,
+    DELTA_UPLOAD,
     DOWNLOAD,
+    CHECKSUM,
+    GREP,
+    SEARCH,
+    LIMIT,
     QUIT,
     KILLSERVER,
     UNKNOWN
@@ -55,14 +86,39 @@ typedef struct
     command_type_t type;
     command_type_t sub_type;
     char file[MAX_FILENAME_LENGTH];       // filename
-    int line;                             // line number
-    char string[MAX_WRITE_STRING_LENGTH]; // string to write (for WRITET command)
+    int line;                             // line number, first line of a range
+    int last_line;                        // last line of a range (for READF), -1 for the end of the file
+    int tail;                             // number of lines to read from the end (readF -t)
+    int limit;                            // matches to stop after (for GREP), 0 for no limit
+    int follow;                           // keep streaming lines appended to the file (readF -f)
+    char string[MAX_WRITE_STRING_LENGTH]; // string to write (for WRITET command), local file of edits (BATCH_WRITE)
+    unsigned long long transfer_id;       // identifies a resumable upload
+    long long offset;                     // bytes the client already has (for DOWNLOAD)
+    unsigned int checksum;                // crc32c of the window ending at offset
+    long long size;                       // size of the file being uploaded, lets the server preallocate
+    int idle;                             // seconds a session may sit idle (for LIMIT -i), -1 to leave it
 } command_t;
 
+typedef enum
+{
+    COMPRESSION_NONE,
+    COMPRESSION_ZLIB
+} compression_t;
+
+typedef enum
+{
+    PRIORITY_HIGH,
+    PRIORITY_NORMAL,
+    PRIORITY_LOW
+} priority_t;
+#define PRIORITY_CLASSES 3
+
 typedef struct
 {
     pid_t pid;
     connection_type_t connection_type;
+    compression_t compression; // best codec the client can decode
+    priority_t priority;       // admission and I/O scheduling class
 
 } connection_request_t;
 
@@ -73,11 +129,23 @@ typedef enum
     LEAVE
 } connection_response_t;
 
+typedef struct
+{
+    connection_response_t status;
+    compression_t compression; // codec both sides agreed on
+} connection_reply_t;
+
 typedef struct
 {
     pid_t pid;
     pid_t counter_id;
     connection_type_t connection_type;
+    compression_t compression;
+    priority_t priority;
+    int sock_fd; // session socket, -1 when the client came through the FIFOs
+    int waiter;  // admission_waiter_t the serving child sleeps on while queued
+    int is_remote; // came in over TCP, pid is only good for the log
+    int is_owner;  // runs as the user the server runs as, may ask for high priority
     char fifo_name_write[CLIENT_WRITE_FIFO_NAME_LEN];
     char fifo_name_read[CLIENT_READ_FIFO_NAME_LEN];
 
@@ -86,7 +154,103 @@ typedef struct
 typedef struct
 {
     char content[CHUNK_SIZE];
+    int length; // number of valid bytes in content (for DOWNLOAD/UPLOAD)
     int is_complete;
     int is_exit;
 } response_t;
+
+#define FRAME_COMPLETE 0x1
+#define FRAME_EXIT 0x2
+#define FRAME_COMPRESSED 0x4
+#define FRAME_RESET 0x8 // compressed frame that starts a new stream
+
+/*
+ What actually travels for a response_t: this header followed by
+ length bytes of (possibly compressed) content.
+*/
+typedef struct
+{
+    int length;     // payload bytes following the header
+    int raw_length; // content bytes once decompressed
+    int flags;
+    unsigned int checksum; // crc32c of the decompressed content
+} frame_header_t;
+
+typedef enum
+{
+    TRANSFER_OK,
+    TRANSFER_NO_FILE,
+    TRANSFER_EXISTS,
+    TRANSFER_ERROR
+} transfer_status_t;
+
+/*
+ Handshake of DOWNLOAD/UPLOAD, exchanged before the first chunk and
+ again by UPLOAD once the file has been committed.
+*/
+typedef struct
+{
+    transfer_status_t status;
+    long long size;        // server file size (DOWNLOAD), part file or total size (UPLOAD)
+    long long offset;      // offset the transfer resumes at
+    unsigned int checksum; // crc32c of the window ending at offset
+} transfer_info_t;
+
+/*
+ DELTA_UPLOAD: the server describes its copy of the file as one signature
+ per block, the client answers with a stream of delta_op_t that either
+ reference runs of those blocks or carry literal data.
+*/
+typedef struct
+{
+    transfer_status_t status;
+    int block_length;
+    long long block_count;
+    long long size;
+} delta_header_t;
+
+typedef struct
+{
+    unsigned int weak;           // rolling checksum of the block
+    unsigned int length;         // only the last block may be shorter
+    unsigned long long strong;   // hash64 of the block
+} delta_sig_t;
+
+typedef enum
+{
+    DELTA_LITERAL,
+    DELTA_COPY,
+    DELTA_END,
+    DELTA_ABORT
+} delta_op_type_t;
+
+typedef struct
+{
+    delta_op_type_t type;
+    int length;            // literal bytes in data
+    long long block;       // first block of a DELTA_COPY
+    long long count;       // number of consecutive blocks to copy
+    long long size;        // total size of the new file (DELTA_END)
+    unsigned int checksum; // crc32c of the new file (DELTA_END)
+    char data[CHUNK_SIZE];
+} delta_op_t;
+
+/*
+ Optional behaviour chosen with command line flags when the server starts.
+*/
+typedef struct
+{
+    int dedup;                  // store uploads as manifests over a shared chunk store
+    long long client_rate;      // bytes/s one client may move in bulk transfers, 0 for no limit
+    long long interactive_rate; // bytes/s of readF output per client, 0 for no limit
+    long long bulk_rate;        // bytes/s shared by all bulk transfers by priority, 0 for no limit
+    const char *tcp_address;    // "[host:]port" to accept TCP clients on, NULL for local clients only
+    long long direct_threshold; // downloads of files at least this large bypass the page cache, 0 never
+    int index;                  // keep a trigram index of the directory for search
+    int commit_ms;              // longest a journaled write waits to share an fsync with others
+    int versions;               // old versions kept of every file, 0 to edit files in place
+    int shards;                 // keep files in hashed subdirectories instead of one flat directory
+    int idle_timeout;           // seconds an idle session keeps its slot, 0 for ever
+    int limit_max;              // clients the limit may grow to under light load, 0 to keep it fixed
+} server_config_t;
 #endif
\ No newline at end of file
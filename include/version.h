@@ -0,0 +1,51 @@
+#ifndef VERSION_H
+#define VERSION_H
+
+#include "types.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define VERSION_DIR ".versions"
+#define VERSION_TEMP_TEMPLATE ".%s.%ld.cow"
+#define VERSION_TEMP_NAME_LEN (sizeof(VERSION_TEMP_TEMPLATE) + MAX_FILENAME_LENGTH + 20)
+
+/*
+ With -V the files of the server directory are never changed in place.
+ A change builds the new contents next to the file, sharing blocks with
+ it where the file system can, and renames them over it. The inode that
+ was replaced stays behind as VERSION_DIR/<file>/<n>, n counting up from
+ 1, and is never written again. A reader keeps whatever inode it opened,
+ so it sees one version from start to end, and <file>@<n> names an old
+ one.
+*/
+
+/*
+ Gives dst_fd the first length bytes of src_fd, sharing the blocks with
+ FICLONE where possible and copying them otherwise. Returns 0, or -1 with
+ errno set.
+*/
+int version_clone(int src_fd, int dst_fd, off_t length);
+/*
+ Whether the file system of dirname shares blocks with FICLONE. Without
+ it every change of a file copies the whole file.
+*/
+int version_can_clone(const char *dirname);
+/*
+ Keeps the current dirname/file as its next version and drops the oldest
+ ones beyond keep. Returns the new version number, 0 when there is no
+ file, or -1 with errno set.
+*/
+long version_save(const char *dirname, const char *file, int keep);
+/*
+ Path of name in dirname, where "<file>@<n>" is version n of file when
+ that version exists. Returns 1 for a version, 0 otherwise.
+*/
+int version_path(const char *dirname, const char *name, char *path, size_t size);
+/*
+ Writes a "<file>@<n> <size> bytes <time>" line for every kept version of
+ file into buf, oldest first. Returns the length of the list like
+ snprintf, size or more when it did not fit.
+*/
+size_t version_list(const char *dirname, const char *file, char *buf, size_t size);
+
+#endif // VERSION_H
@@ -1,8 +1,24 @@
 #include "include/types.h"
 #include "include/queue.h"
+#include "include/shaper.h"
+#include "include/io_engine.h"
 #include "include/command_parser.h"
 #include "include/logger.h"
+#include "include/checksum.h"
+#include "include/delta.h"
+#include "include/channel.h"
+#include "include/storage.h"
+#include "include/net.h"
+#include "include/grep.h"
+#include "include/index.h"
+#include "include/journal.h"
+#include "include/append.h"
+#include "include/version.h"
+#include "include/shard.h"
+#include "include/meta.h"
+#include "include/supervisor.h"
 #include <stdio.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/wait.h>
@@ -16,62 +32,190 @@
 #include <dirent.h>
 #include <semaphore.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <time.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <sys/statvfs.h>
+#include <sys/inotify.h>
+
+// Where grep_search sends the matches it finds
+typedef struct
+{
+    channel_t *channel;
+    shaper_t *shaper;
+    response_t response;
+} match_stream_t;
+
+// What the helper children need to run, also when they are started again
+typedef struct
+{
+    char *dirname;
+    int log_fd;
+} helper_args_t;
+
+// One "<line #> <text>" record of a writeT -b, text stays in the received data
+typedef struct
+{
+    long long line;
+    size_t offset;
+    size_t length;
+    long long seq; // keeps edits of the same line in the order they came
+} batch_edit_t;
 
 void bibo_server(char *dirname, int max_clients);
-queue_t *init_queue(int server_pid);
+admission_queue_t *init_queue(int server_pid);
+bandwidth_t *init_bandwidth();
 void init_client_array(client_info_t *clients, int max_client);
 void enter_directory(const char *dirname);
 void set_signal_handlers();
 int set_server_fifo();
-sem_t *init_free_slot_sem();
+int set_server_socket();
 int *init_counter();
+client_info_t wait_request(int server_fd, int listen_fd, int tcp_fd, int log_fd);
 client_info_t read_request(int server_fd, int log_fd);
-int handle_client(client_info_t *current_client, int *counter, sem_t *client_connection_sem, char *dirname, int log_fd, int max_clients);
+client_info_t accept_request(int listen_fd, int is_remote);
+int receive_request(client_info_t *client_info);
+void signal_client(client_info_t *client);
+void init_client_info(client_info_t *client_info, connection_request_t *request);
+void reply_connection(client_info_t *client, connection_reply_t *client_shm, sem_t *client_connection_sem,
+                      connection_response_t status);
+void refuse_connection(client_info_t *client, int log_fd);
+void stop_server(int server_fd, int listen_fd, int tcp_fd, int log_fd);
+int handle_client(client_info_t *current_client, int *counter, sem_t *client_connection_sem, char *dirname, int log_fd);
 int open_client_fifo(char *client_fifo_name, int mode);
 sem_t *connect_client_connection_sem(int client_pid);
-connection_response_t *connect_client_shm(int client_pid);
+connection_reply_t *connect_client_shm(int client_pid);
 void add_mask();
 void remove_mask();
 void clean_up(int client_fifo_fd_read, int client_fifo_fd_write, sem_t *client_connection_sem);
-
-pid_t *child_pids;
-int num_children = 0;
+void handle_delta_upload(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, int log_fd);
+void handle_batch_write(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, int log_fd);
+int rewrite_lines(char *dirname, const char *file, const char *file_path, const char *data, const batch_edit_t *edits,
+                  long long count, long long *lines);
+int compare_edits(const void *a, const void *b);
+int append_to_file(const char *file, const char *data, size_t length, void *ctx);
+long long parse_edits(char *data, size_t length, batch_edit_t **edits);
+int send_lines(stored_file_t *file, command_t *command, channel_t *channel, shaper_t *shaper, long long *lines);
+off_t tail_offset(stored_file_t *file, int lines);
+int handle_follow(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, int log_fd);
+int send_match(const char *file, long long line, const char *text, size_t length, void *ctx);
+long long follow_send(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, long long offset);
+int is_followed_event(int inotify_fd, const char *file);
+void preallocate(int fd, off_t offset, long long length);
+int write_full(int fd, const void *buf, size_t length);
+int publish_file(const char *src_path, const char *dest_path);
+int link_temp_file(int fd, const char *path);
+int open_locked(const char *path);
+int write_file(const char *dirname, const char *file, int fd, off_t offset, const void *data, size_t length);
+void part_file_name(char *part_name, size_t size, const char *file, unsigned long long transfer_id);
+void sweep_part_files(char *dirname, int log_fd);
+int admission_acquire(int is_waiting);
+int admission_handoff();
+int admission_pass();
+void admission_release();
+void admission_leave();
+void engine_destroy();
+void worker_exited(const worker_t *worker);
+void run_indexer(void *arg);
+void run_migrator(void *arg);
+void run_watcher(void *arg);
+void run_tuner(void *arg);
+void admission_fill();
+void admission_tune(int log_fd);
+int read_pressure(const char *path);
+int wait_command(channel_t *channel, long counter_id, int log_fd);
+
+supervisor_t supervisor;
 volatile sig_atomic_t signal_received = 0;
 struct sigaction sa_clean;
 sigset_t mask, orig_mask;
 int ppid;
-sem_t *free_slot_sem;
-queue_t *queue;
+admission_queue_t *queue;
 int queue_sh_fd;
 int *counter;
 int counter_sh_fd;
+server_config_t config;
+bandwidth_t *bandwidth;
+journal_t *journal;
+append_table_t *appends;
+meta_cache_t *metas;
+io_engine_t engine; // of the session a child serves
 
 void cleaner_signal_handler()
 {
     signal_received = 1;
-    int i;
-    for (i = 0; i < num_children; i++)
-    {
-        if (child_pids[i] != -1)
-            kill(child_pids[i], SIGINT);
-    }
-    sem_post(free_slot_sem);
+    supervisor_signal(&supervisor, SIGINT);
 }
 
 int main(int argc, char *argv[])
 {
-    // Check the command line arguments
-    if (argc != 3)
+    // Check the command line arguments, flags may come before or after them
+    int opt;
+    memset(&config, 0, sizeof(config));
+    config.direct_threshold = DIRECT_IO_THRESHOLD;
+    config.commit_ms = JOURNAL_COMMIT_MS;
+    config.idle_timeout = SESSION_IDLE_TIMEOUT;
+    while ((opt = getopt(argc, argv, "dr:i:R:t:D:xj:V:SI:A:")) != -1)
     {
-        fprintf(stderr, "Usage: %s <dirname> <max. #ofClients>\n", argv[0]);
+        switch (opt)
+        {
+        case 'd':
+            config.dedup = 1;
+            break;
+        // Rates are given in KiB/s
+        case 'r':
+            config.client_rate = atoll(optarg) * 1024;
+            break;
+        case 'i':
+            config.interactive_rate = atoll(optarg) * 1024;
+            break;
+        case 'R':
+            config.bulk_rate = atoll(optarg) * 1024;
+            break;
+        case 't':
+            config.tcp_address = optarg;
+            break;
+        case 'D':
+            config.direct_threshold = atoll(optarg) * 1024 * 1024;
+            break;
+        case 'x':
+            config.index = 1;
+            break;
+        case 'j':
+            config.commit_ms = atoi(optarg);
+            break;
+        case 'V':
+            config.versions = atoi(optarg);
+            break;
+        case 'S':
+            config.shards = 1;
+            break;
+        case 'I':
+            config.idle_timeout = atoi(optarg);
+            break;
+        case 'A':
+            config.limit_max = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s <dirname> <max. #ofClients> [-d] [-r client KiB/s] [-i interactive KiB/s] [-R total bulk KiB/s] [-t [host:]port] [-D direct I/O MiB] [-x] [-j commit ms] [-V versions] [-S] [-I idle s] [-A max. #ofClients]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        fprintf(stderr, "Usage: %s <dirname> <max. #ofClients> [-d] [-r client KiB/s] [-i interactive KiB/s] [-R total bulk KiB/s] [-t [host:]port] [-D direct I/O MiB] [-x] [-j commit ms] [-V versions] [-S] [-I idle s] [-A max. #ofClients]\n", argv[0]);
         exit(1);
     }
 
     // Parse the max number of clients from the command line
-    int max_clients = atoi(argv[2]);
+    int max_clients = atoi(argv[optind + 1]);
 
     set_signal_handlers();
-    bibo_server(argv[1], max_clients);
+    bibo_server(argv[optind], max_clients);
 
     return 0;
 }
@@ -79,100 +223,193 @@ int main(int argc, char *argv[])
 // Main server function
 void bibo_server(char *dirname, int max_clients)
 {
-    int server_fd, log_fd, client_fifo_fd, max_child;
-    max_child = max_clients;
-    child_pids = malloc(max_clients * sizeof(pid_t));
-    memset(child_pids, -1, max_clients * sizeof(pid_t));
+    int server_fd, listen_fd, tcp_fd = -1, log_fd, client_fifo_fd;
     enter_directory(dirname);
     log_fd = create_log_file(dirname);
     ppid = getpid();
     my_log(log_fd, ">> Server started PID %d...\n", ppid);
+    // Every client served or queued and the helpers, never more however many come and go
+    int limit_max = config.limit_max > max_clients ? config.limit_max : max_clients;
+    supervisor_init(&supervisor, limit_max + ADMISSION_WAITERS + SUPERVISOR_HELPERS, log_fd, worker_exited);
+    helper_args_t helper_args = {dirname, log_fd};
+    shard_setup(dirname, config.shards);
+    sweep_part_files(dirname, log_fd);
+    storage_gc(dirname, log_fd);
+    // Edits a crash cut short are finished before anything reads the files
+    journal_replay(dirname, log_fd);
+    journal = journal_open(dirname, config.commit_ms);
+    appends = append_table_init();
+    metas = meta_init();
+    if (config.dedup)
+        my_log(log_fd, ">> Storing uploads in the deduplicated chunk store\n");
+    if (config.versions > 0)
+    {
+        my_log(log_fd, ">> Keeping the last %d versions of every file\n", config.versions);
+        if (!version_can_clone(dirname))
+            my_log(log_fd, ">> The directory cannot share blocks between versions, every change copies its file\n");
+    }
+    // The helpers are children like the clients, stopped and waited for with them and started again if they crash
+    if (config.index)
+    {
+        pid_t indexer_pid = supervisor_spawn(&supervisor, "indexer", WORKER_RESTART_ON_FAILURE, run_indexer, &helper_args);
+        if (indexer_pid == -1)
+            perror("Error while fork");
+        else
+            my_log(log_fd, ">> Indexing the directory for search, PID %d\n", indexer_pid);
+    }
+    // A flat directory is moved into shards while it is served
+    if (shard_is_enabled())
+    {
+        if (supervisor_spawn(&supervisor, "migrator", WORKER_RESTART_ON_FAILURE, run_migrator, &helper_args) == -1)
+            perror("Error while fork");
+        else
+            my_log(log_fd, ">> Keeping files in %d shards\n", SHARD_COUNT);
+    }
+    // Follows changes made behind the server's back so the metadata cache stays true
+    if (supervisor_spawn(&supervisor, "watcher", WORKER_RESTART_ON_FAILURE, run_watcher, &helper_args) == -1)
+        perror("Error while fork");
     my_log(log_fd, ">> Waiting for clients...\n");
     server_fd = set_server_fifo();
-    free_slot_sem = init_free_slot_sem();
+    listen_fd = set_server_socket();
+    if (config.tcp_address != NULL)
+    {
+        tcp_fd = tcp_listen(config.tcp_address);
+        my_log(log_fd, ">> Accepting TCP clients on %s\n", config.tcp_address);
+    }
     counter = init_counter();
     queue = init_queue(ppid);
+    bandwidth = init_bandwidth();
     *counter = 0;
+    queue->limit = max_clients;
+    queue->limit_min = max_clients;
+    queue->limit_max = limit_max;
+    queue->limit_cap = limit_max;
+    queue->idle_timeout = config.idle_timeout;
+    // Moves the limit with the load, also once a client narrowed the range later on
+    if (queue->limit_max > max_clients)
+    {
+        my_log(log_fd, ">> Serving %d to %d clients at once depending on the load\n", max_clients, queue->limit_max);
+        if (supervisor_spawn(&supervisor, "tuner", WORKER_RESTART_ON_FAILURE, run_tuner, &helper_args) == -1)
+            perror("Error while fork");
+    }
 
     while (1)
     {
-        // Read request from server fifo
-        client_info_t client_info = read_request(server_fd, log_fd);
-        queue_enqueue(queue, &client_info);
+        // Wait for a request on the server fifo or the socket, exits are reaped on the way
+        client_info_t client_info = wait_request(server_fd, listen_fd, tcp_fd, log_fd);
+        if (client_info.pid == -1)
+            continue;
         fflush(stdout);
-        pid_t pid = fork();
+        pid_t pid = supervisor_spawn(&supervisor, "client", WORKER_RESTART_NEVER, NULL, NULL);
+        if (pid == -1 && errno == EAGAIN)
+        {
+            refuse_connection(&client_info, log_fd);
+            continue;
+        }
         if (pid == -1)
         {
-            perror("Error while fork");
+            if (errno != EINTR)
+                perror("Error while fork");
+            if (client_info.sock_fd != -1)
+                close(client_info.sock_fd);
+            if (signal_received)
+                stop_server(server_fd, listen_fd, tcp_fd, log_fd);
             continue;
         }
         else if (pid == 0)
         {
             add_mask();
-            client_info_t *current_client = queue_peek(queue);
-            sem_t *client_connection_sem = connect_client_connection_sem(current_client->pid);
-            connection_response_t *client_shm = connect_client_shm(current_client->pid);
+            close(listen_fd);
+            if (tcp_fd != -1)
+                close(tcp_fd);
+            client_info_t *current_client = &client_info;
+            if (current_client->sock_fd != -1 && receive_request(current_client) == -1)
+                exit(EXIT_SUCCESS);
+            // Socket clients get their replies in-band and need neither
+            sem_t *client_connection_sem = NULL;
+            connection_reply_t *client_shm = NULL;
+            if (current_client->sock_fd == -1)
+            {
+                client_connection_sem = connect_client_connection_sem(current_client->pid);
+                client_shm = connect_client_shm(current_client->pid);
+                client_shm->compression = current_client->compression;
+                // A FIFO client is whoever made its FIFOs
+                struct stat fifo_st;
+                current_client->is_owner = stat(current_client->fifo_name_write, &fifo_st) == 0 && fifo_st.st_uid == getuid();
+            }
+            // Anybody can ask for high priority, only the server's own user gets it
+            if (current_client->priority == PRIORITY_HIGH && !current_client->is_owner)
+                current_client->priority = PRIORITY_NORMAL;
             fflush(stdout);
-            if (queue_size(queue) > max_clients)
+            // What the child holds is in its report, so the supervisor can give it back after a crash
+            worker_report_t *report = supervisor_self();
+            if (!admission_acquire(0))
             {
-                if (current_client->connection_type == TRY_CONNECT)
+                if (current_client->connection_type != TRY_CONNECT)
+                    current_client->waiter = report->waiter = admission_waiter_claim(queue);
+                if (current_client->waiter == -1 || admission_enqueue(queue, current_client) == -1)
                 {
-                    my_log(log_fd, ">> tryConnect request PID %ld... Que FULL... Leaves...\n", (long)current_client->pid);
-                    *client_shm = LEAVE;
-                    sem_post(client_connection_sem);
+                    my_log(log_fd, ">> %s request PID %ld... Que FULL... Leaves...\n",
+                           current_client->connection_type == TRY_CONNECT ? "tryConnect" : "connect", (long)current_client->pid);
+                    reply_connection(current_client, client_shm, client_connection_sem, LEAVE);
+                    if (current_client->waiter != -1)
+                    {
+                        report->waiter = -1;
+                        admission_waiter_release(queue, current_client->waiter);
+                    }
                     exit(EXIT_SUCCESS);
                 }
-                else
+                remove_mask();
+                my_log(log_fd, ">> connect request PID %ld... Que FULL, %d waiting\n", (long)current_client->pid, admission_waiting(queue));
+                reply_connection(current_client, client_shm, client_connection_sem, WAITING);
+                // A client may have left between our first try and the enqueue
+                if (admission_acquire(1))
+                    admission_pass();
+
+                // A freed slot goes to the head of the queue by waking whoever queued it
+                while (sem_wait(&queue->waiters[current_client->waiter].wakeup) == -1 && !signal_received)
+                    ;
+                if (signal_received)
                 {
-                    remove_mask();
-                    my_log(log_fd, ">> connect request PID %ld... Que FULL\n", (long)current_client->pid);
-                    *client_shm = WAITING;
-                    sem_post(client_connection_sem);
-                    sem_wait(free_slot_sem);
-                    if (signal_received)
-                    {
-                        kill(current_client->pid, SIGINT);
-                        exit(EXIT_SUCCESS);
-                    }
+                    // Leaves the queue, a slot that was already handed over goes to the next one
+                    report->waiter = -1;
+                    if (admission_waiter_abandon(queue, current_client->waiter))
+                        admission_release();
+                    signal_client(current_client);
+                    exit(EXIT_SUCCESS);
                 }
+                report->is_admitted = 1;
+                report->waiter = -1;
+                admission_waiter_release(queue, current_client->waiter);
+                my_log(log_fd, ">> connect request PID %ld... admitted, %d waiting\n", (long)current_client->pid, admission_waiting(queue));
+                // The FIFO handshake tells the client to go on from handle_client
+                if (current_client->sock_fd != -1)
+                    reply_connection(current_client, client_shm, client_connection_sem, CONNECTED);
             }
             else
             {
-                *client_shm = CONNECTED;
-                sem_post(client_connection_sem);
+                report->is_admitted = 1;
+                reply_connection(current_client, client_shm, client_connection_sem, CONNECTED);
             }
+            // Every way out of the child gives the slot back
+            atexit(admission_leave);
 
-            *counter += 1;
-            current_client->counter_id = *counter;
-            client_fifo_fd = handle_client(current_client, counter, client_connection_sem, dirname, log_fd, max_clients);
-            queue_dequeue(queue);
-            if (queue_size(queue) >= max_clients)
-                sem_post(free_slot_sem);
+            current_client->counter_id = report->counter_id = __atomic_add_fetch(counter, 1, __ATOMIC_SEQ_CST);
+            client_fifo_fd = handle_client(current_client, counter, client_connection_sem, dirname, log_fd);
             close(client_fifo_fd);
-            unlink(current_client->fifo_name_write);
-            unlink(current_client->fifo_name_read);
-            exit(EXIT_SUCCESS);
-        }
-        else
-        {
-            if (num_children >= max_child)
+            if (current_client->sock_fd == -1)
             {
-                // Resize the child_pids array
-                int new_max_children = max_child * 2; // New desired size
-                pid_t *resized_child_pids = realloc(child_pids, new_max_children * sizeof(pid_t));
-
-                // Update child_pids pointer to the resized array
-                child_pids = resized_child_pids;
-
-                // Update the MAX_CHILDREN value
-                max_child = new_max_children;
+                unlink(current_client->fifo_name_write);
+                unlink(current_client->fifo_name_read);
             }
-            child_pids[num_children++] = pid;
+            exit(EXIT_SUCCESS);
         }
+        else if (client_info.sock_fd != -1)
+            close(client_info.sock_fd);
     }
 }
 
-queue_t *init_queue(int server_pid)
+admission_queue_t *init_queue(int server_pid)
 {
     char shm_que_name[SHM_QUEUE_NAME_LEN];
     snprintf(shm_que_name, SHM_QUEUE_NAME_LEN, SHM_QUEUE_NAME_TEMPLATE, (long)server_pid);
@@ -183,26 +420,36 @@ queue_t *init_queue(int server_pid)
         exit(EXIT_FAILURE);
     }
 
-    if (ftruncate(shm_fd, sizeof(queue_t)) == -1)
+    if (ftruncate(shm_fd, sizeof(admission_queue_t)) == -1)
     {
         perror("Error resizing shared memory");
         exit(EXIT_FAILURE);
     }
     queue_sh_fd = shm_fd;
-    queue_t *queue_ptr = (queue_t *)mmap(NULL, sizeof(queue_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    admission_queue_t *queue_ptr = (admission_queue_t *)mmap(NULL, sizeof(admission_queue_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (queue_ptr == MAP_FAILED)
     {
         perror("Error mapping shared memory");
         exit(EXIT_FAILURE);
     }
-
-    queue_t *queue = queue_create();
-    *queue_ptr = *queue;
-    queue_destroy(queue);
+    admission_queue_init(queue_ptr);
 
     return queue_ptr;
 }
 
+// Bandwidth bookkeeping inherited by every child across fork
+bandwidth_t *init_bandwidth()
+{
+    bandwidth_t *bandwidth_ptr = mmap(NULL, sizeof(bandwidth_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (bandwidth_ptr == MAP_FAILED)
+    {
+        perror("Error mapping shared memory");
+        exit(EXIT_FAILURE);
+    }
+    bandwidth_ptr->total_weight = 0;
+    return bandwidth_ptr;
+}
+
 void enter_directory(const char *dirname)
 {
     // Create the specified directory if it does not already exist
@@ -229,7 +476,9 @@ int set_server_fifo()
     if (mkfifo(serverFifo, 0777) == -1 && errno != EEXIST)
         perror("mkfifo");
 
-    if ((server_fd = open(serverFifo, O_RDONLY)) == -1)
+    // Opening without O_NONBLOCK would wait for the first FIFO client
+    // before the sockets are even listening
+    if ((server_fd = open(serverFifo, O_RDONLY | O_NONBLOCK)) == -1)
     {
         perror("Error while openning fifo");
         exit(1);
@@ -239,23 +488,32 @@ int set_server_fifo()
     {
         perror("Error while openning dummy fifo");
     }
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) & ~O_NONBLOCK);
 
     return server_fd;
 }
 
-sem_t *init_free_slot_sem()
+// Listening socket for the SOCK_SEQPACKET transport, every message keeps its boundaries
+int set_server_socket()
 {
-    char free_slot_sem_name[FREE_SLOT_SEM_NAME_LEN];
-    sem_t *free_slot_sem;
-    snprintf(free_slot_sem_name, FREE_SLOT_SEM_NAME_LEN, FREE_SLOT_SEM_NAME_TEMPLATE, (long)getpid());
-    free_slot_sem = sem_open(free_slot_sem_name, O_CREAT | O_EXCL, 0777, 0);
-    // Check if semaphore was created successfully
-    if (free_slot_sem == SEM_FAILED)
+    struct sockaddr_un addr;
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (listen_fd == -1)
     {
-        perror("Failed to create free_slot_sem");
+        perror("socket");
         exit(EXIT_FAILURE);
     }
-    return free_slot_sem;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), SERVER_SOCKET_TEMPLATE, (long)getpid());
+    unlink(addr.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, SERVER_SOCKET_BACKLOG) == -1)
+    {
+        perror("Error while binding server socket");
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
 }
 
 int *init_counter()
@@ -283,6 +541,43 @@ int *init_counter()
     return shm_ptr;
 }
 
+client_info_t wait_request(int server_fd, int listen_fd, int tcp_fd, int log_fd)
+{
+    struct pollfd fds[4];
+    client_info_t none;
+    fds[0].fd = server_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = listen_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = tcp_fd; // ignored by poll when there is no listener
+    fds[2].events = POLLIN;
+    fds[2].revents = 0;
+    fds[3].fd = supervisor.signal_fd;
+    fds[3].events = POLLIN;
+    // A signal caught while reaping interrupts no poll, the exits it causes wake this one
+    if (signal_received)
+        stop_server(server_fd, listen_fd, tcp_fd, log_fd);
+    while (poll(fds, 4, -1) == -1)
+    {
+        if (errno == EINTR)
+            stop_server(server_fd, listen_fd, tcp_fd, log_fd);
+        perror("poll");
+        exit(EXIT_FAILURE);
+    }
+    if (fds[3].revents & POLLIN)
+    {
+        supervisor_reap(&supervisor);
+        none.pid = -1;
+        none.sock_fd = -1;
+        return none;
+    }
+    if (fds[1].revents & POLLIN)
+        return accept_request(listen_fd, 0);
+    if (fds[2].revents & POLLIN)
+        return accept_request(tcp_fd, 1);
+    return read_request(server_fd, log_fd);
+}
+
 client_info_t read_request(int server_fd, int log_fd)
 {
     client_info_t client_info;
@@ -294,81 +589,256 @@ client_info_t read_request(int server_fd, int log_fd)
         perror("Error reading connection request");
         exit(EXIT_FAILURE);
     }
-    else if (errno == EINTR)
-    {
-        int i;
-        for (i = 0; i < num_children; i++)
-        {
-            int status;
-            pid_t terminated_pid = waitpid(-1, &status, 0);
-
-            if (terminated_pid == -1)
-            {
-                perror("Error waiting for child process");
-                exit(EXIT_FAILURE);
-            }
-
-            printf("Child process with PID %d terminated\n", terminated_pid);
-        }
-        printf("Parent process is terminating...\n");
-        close(log_fd);
-        close(server_fd);
-        exit(EXIT_SUCCESS);
-    }
+    else if (bytes_read == -1)
+        stop_server(server_fd, -1, -1, log_fd);
     else if (bytes_read != sizeof(connection_request_t))
     {
         fprintf(stderr, "Incomplete connection request\n");
         exit(EXIT_FAILURE);
     }
+    init_client_info(&client_info, &request);
     snprintf(client_info.fifo_name_write, CLIENT_WRITE_FIFO_NAME_LEN, CLIENT_WRITE_FIFO_TEMPLATE, (long)request.pid);
     snprintf(client_info.fifo_name_read, CLIENT_READ_FIFO_NAME_LEN, CLIENT_READ_FIFO_TEMPLATE, (long)request.pid);
-    client_info.pid = request.pid;
-    client_info.connection_type = request.connection_type;
-    client_info.counter_id = -1;
     return client_info;
 }
 
-int handle_client(client_info_t *current_client, int *counter, sem_t *client_connection_sem, char *dirname, int log_fd, int max_clients)
+/*
+ Takes the next connection off a listening socket. The request is read
+ by the child in receive_request() so a slow client never holds up the
+ accept loop. Returns a client_info_t with pid -1 if there was none.
+*/
+client_info_t accept_request(int listen_fd, int is_remote)
 {
-    int client_fifo_fd_read, client_fifo_fd_write;
+    client_info_t client_info;
+    memset(&client_info, 0, sizeof(client_info));
+    client_info.pid = -1;
+    // The listeners are non-blocking, the connection may be gone already
+    client_info.sock_fd = accept(listen_fd, NULL, NULL);
+    if (client_info.sock_fd == -1)
+        return client_info;
+    if (is_remote)
+        tcp_set_nodelay(client_info.sock_fd);
+    client_info.pid = 0;
+    client_info.is_remote = is_remote;
+    return client_info;
+}
+
+int receive_request(client_info_t *client_info)
+{
+    connection_request_t request;
+    struct ucred cred;
+    socklen_t cred_length = sizeof(cred);
+    int sock_fd = client_info->sock_fd, is_remote = client_info->is_remote;
+    struct timeval timeout = {SOCKET_REQUEST_TIMEOUT, 0};
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(sock_fd, &request, sizeof(request), MSG_WAITALL) != sizeof(request))
+        return -1;
+    timeout.tv_sec = 0;
+    setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    // The kernel knows who is on the other end of a local socket better than the request does
+    if (!is_remote)
+    {
+        if (getsockopt(sock_fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_length) == -1)
+            return -1;
+        request.pid = cred.pid;
+    }
+    init_client_info(client_info, &request);
+    client_info->sock_fd = sock_fd;
+    client_info->is_remote = is_remote;
+    client_info->is_owner = !is_remote && cred.uid == getuid();
+    return 0;
+}
+
+// Remote clients learn that the server is going away from their socket closing
+void signal_client(client_info_t *client)
+{
+    if (!client->is_remote)
+        kill(client->pid, SIGINT);
+}
+
+void init_client_info(client_info_t *client_info, connection_request_t *request)
+{
+    memset(client_info, 0, sizeof(*client_info));
+    client_info->pid = request->pid;
+    client_info->connection_type = request->connection_type;
+    // zlib is the only codec we speak, anything else falls back to raw frames
+    client_info->compression = request->compression == COMPRESSION_ZLIB ? COMPRESSION_ZLIB : COMPRESSION_NONE;
+    client_info->priority = request->priority >= PRIORITY_HIGH && request->priority <= PRIORITY_LOW ? request->priority : PRIORITY_NORMAL;
+    client_info->counter_id = -1;
+    client_info->sock_fd = -1;
+    client_info->waiter = -1;
+}
+
+// Tells the client how admission went, through its shm or on the socket
+void reply_connection(client_info_t *client, connection_reply_t *client_shm, sem_t *client_connection_sem,
+                      connection_response_t status)
+{
+    if (client->sock_fd != -1)
+    {
+        connection_reply_t reply;
+        reply.status = status;
+        reply.compression = client->compression;
+        if (write(client->sock_fd, &reply, sizeof(reply)) == -1)
+            perror("Error writing connection reply");
+        return;
+    }
+    client_shm->status = status;
     sem_post(client_connection_sem);
-    if ((client_fifo_fd_write = open(current_client->fifo_name_read, O_WRONLY)) == -1)
+}
+
+/*
+ Tells a client there is no room even to queue it when no child is left to
+ do it: every slot of the process table is taken. Runs in the parent, so
+ it neither blocks nor exits.
+*/
+void refuse_connection(client_info_t *client, int log_fd)
+{
+    connection_reply_t reply;
+    reply.status = LEAVE;
+    reply.compression = COMPRESSION_NONE;
+    my_log(log_fd, ">> No process free for a new client... Leaves...\n");
+    if (client->sock_fd != -1)
     {
-        perror("Error whlie opening write fifo");
-        exit(EXIT_FAILURE);
+        // A TCP close with the request still unread would reset the reply away
+        connection_request_t request;
+        while (recv(client->sock_fd, &request, sizeof(request), MSG_DONTWAIT) > 0)
+            ;
+        if (send(client->sock_fd, &reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+            perror("Error writing connection reply");
+        close(client->sock_fd);
+        return;
     }
-    if ((client_fifo_fd_read = open(current_client->fifo_name_write, O_RDONLY)) == -1)
+    char sem_name[CLIENT_SEM_NAME_LEN], res_shm_name[RESPOND_SHM_LEN];
+    snprintf(sem_name, CLIENT_SEM_NAME_LEN, CLIENT_SEM_NAME_TEMPLATE, (long)client->pid);
+    snprintf(res_shm_name, RESPOND_SHM_LEN, RESPOND_SHM_TEMPLATE, (long)client->pid);
+    sem_t *client_connection_sem = sem_open(sem_name, O_RDWR);
+    int shm_fd = shm_open(res_shm_name, O_RDWR, 0666);
+    connection_reply_t *client_shm = MAP_FAILED;
+    if (shm_fd != -1 && ftruncate(shm_fd, sizeof(connection_reply_t)) == 0)
+        client_shm = mmap(NULL, sizeof(connection_reply_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    if (client_connection_sem != SEM_FAILED && client_shm != MAP_FAILED)
     {
-        perror("Error while opening read fifo");
-        exit(EXIT_FAILURE);
+        *client_shm = reply;
+        sem_post(client_connection_sem);
+    }
+    if (client_shm != MAP_FAILED)
+        munmap(client_shm, sizeof(connection_reply_t));
+    if (shm_fd != -1)
+        close(shm_fd);
+    if (client_connection_sem != SEM_FAILED)
+        sem_close(client_connection_sem);
+}
+
+void stop_server(int server_fd, int listen_fd, int tcp_fd, int log_fd)
+{
+    char socket_path[SERVER_SOCKET_NAME_LEN], shm_que_name[SHM_QUEUE_NAME_LEN];
+    supervisor_stop(&supervisor);
+    journal_close(journal);
+    printf("Parent process is terminating...\n");
+    snprintf(socket_path, sizeof(socket_path), SERVER_SOCKET_TEMPLATE, (long)getpid());
+    unlink(socket_path);
+    snprintf(shm_que_name, sizeof(shm_que_name), SHM_QUEUE_NAME_TEMPLATE, (long)getpid());
+    shm_unlink(shm_que_name);
+    close(log_fd);
+    close(server_fd);
+    if (listen_fd != -1)
+        close(listen_fd);
+    if (tcp_fd != -1)
+        close(tcp_fd);
+    exit(EXIT_SUCCESS);
+}
+
+int handle_client(client_info_t *current_client, int *counter, sem_t *client_connection_sem, char *dirname, int log_fd)
+{
+    int client_fifo_fd_read, client_fifo_fd_write;
+    if (current_client->sock_fd != -1)
+    {
+        // One socket carries both directions
+        client_fifo_fd_read = current_client->sock_fd;
+        client_fifo_fd_write = current_client->sock_fd;
+    }
+    else
+    {
+        sem_post(client_connection_sem);
+        if ((client_fifo_fd_write = open(current_client->fifo_name_read, O_WRONLY)) == -1)
+        {
+            perror("Error whlie opening write fifo");
+            exit(EXIT_FAILURE);
+        }
+        if ((client_fifo_fd_read = open(current_client->fifo_name_write, O_RDONLY)) == -1)
+        {
+            perror("Error while opening read fifo");
+            exit(EXIT_FAILURE);
+        }
     }
     my_log(log_fd, "Client PID %ld connected as “client_%d”\n", current_client->pid, *counter);
     fflush(stdout);
     remove_mask();
+    channel_t channel;
+    channel_init(&channel, client_fifo_fd_read, client_fifo_fd_write, client_connection_sem, 1, current_client->compression);
+    channel.bytes_sent = &supervisor_self()->bytes_sent;
+    channel.bytes_received = &supervisor_self()->bytes_received;
+    shaper_t shaper;
+    shaper_init(&shaper, bandwidth, &config, current_client->priority);
+    io_engine_init(&engine);
+    // However the session ends the ring and its buffers are given back
+    atexit(engine_destroy);
 
     while (1)
     {
         command_t command;
-        int bytes_read = read(client_fifo_fd_read, &command, sizeof(command));
+        // Idle sessions do not count against anyone's share of the disk
+        shaper_end(&shaper);
+        // A session nobody uses any more gives its slot to the queue
+        int wait_status = wait_command(&channel, current_client->counter_id, log_fd);
+        if (wait_status == 1)
+        {
+            clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+            signal_client(current_client);
+            exit(EXIT_SUCCESS);
+        }
+        // A TCP stream may hand the command over in pieces
+        int read_status = wait_status == -1 ? -1 : channel_read(&channel, &command, sizeof(command));
 
-        if (bytes_read == -1 && errno != EINTR)
+        if (read_status == -1 && errno == EINTR)
         {
-            perror("Error while reading bytes from client fifo read");
+            clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+            signal_client(current_client);
+            my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+            exit(EXIT_SUCCESS);
         }
-        else if (errno == EINTR)
+        else if (read_status == -1)
         {
+            // The client is gone, what is left in command is the one before
+            if (errno != EPIPE)
+                perror("Error while reading bytes from client fifo read");
             clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
-            kill(current_client->pid, SIGINT);
             my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
             exit(EXIT_SUCCESS);
         }
 
+        // Names go into paths, a client that sends anything else is not served further
+        if (!is_valid_command(&command))
+        {
+            my_log(log_fd, "\nClient_%ld sent an invalid command, disconnecting..\n", current_client->counter_id);
+            clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+            exit(EXIT_SUCCESS);
+        }
         my_log(log_fd, "\nRead from client_%d: \n", *counter);
         log_command(&command, log_fd);
-        if (command.type == KILLSERVER)
+        int is_bulk = command.type == UPLOAD || command.type == DOWNLOAD || command.type == DELTA_UPLOAD;
+        shaper_begin(&shaper, is_bulk ? TRAFFIC_BULK : TRAFFIC_INTERACTIVE);
+        if (command.type == KILLSERVER && current_client->is_remote)
+        {
+            // Only a client on this machine may stop the server
+            my_log(log_fd, "\nClient_%ld asked over TCP to stop the server, refused\n", current_client->counter_id);
+            clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+            exit(EXIT_SUCCESS);
+        }
+        else if (command.type == KILLSERVER)
         {
             kill(ppid, SIGINT);
-            kill(current_client->pid, SIGINT);
+            signal_client(current_client);
             clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem); //???
             exit(EXIT_SUCCESS);                                                         //???
         }
@@ -380,7 +850,7 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
             response.is_exit = 1;
 
             // Send the response to the client
-            if (write(client_fifo_fd_write, &response, sizeof(response)) == -1)
+            if (channel_send(&channel, &response) == -1)
             {
                 perror("write");
                 exit(EXIT_FAILURE);
@@ -391,10 +861,6 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
             close(client_fifo_fd_write);
 
             my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
-            sem_post(client_connection_sem);
-            queue_dequeue(queue);
-            if (queue_size(queue) >= max_clients)
-                sem_post(free_slot_sem);
             // Terminate the server process
             exit(EXIT_SUCCESS);
         }
@@ -403,209 +869,161 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
             response_t response;
             char *help_message = get_message(command.sub_type);
             strcpy(response.content, help_message);
+            response.length = strlen(help_message);
             response.is_complete = 1;
-            if (write(client_fifo_fd_write, &response, sizeof(response)) == -1)
+            response.is_exit = 0;
+            if (channel_send(&channel, &response) == -1)
             {
                 if (errno == EINTR)
                 {
                     clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
-                    kill(current_client->pid, SIGINT);
+                    signal_client(current_client);
                     my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
                     exit(EXIT_SUCCESS);
                 }
                 perror("Error while writing to client fifo");
                 exit(EXIT_FAILURE);
             }
-            sem_post(client_connection_sem);
         }
-        else if (command.type == LIST)
+        else if (command.type == LIST && command.file[0] != '\0')
         {
-            response_t response;
-
-            DIR *dir;
-            struct dirent *ent;
-            if ((dir = opendir(dirname)) != NULL)
+            // The kept versions of one file, grown until the whole list fits
+            size_t size = CHUNK_SIZE, length;
+            char *version_list_buf = NULL;
+            do
             {
-                // Count the number of files in the directory
-                int num_files = 0;
-                while ((ent = readdir(dir)) != NULL)
+                size *= 2;
+                version_list_buf = realloc(version_list_buf, size);
+                if (version_list_buf == NULL)
                 {
-                    if (ent->d_type == DT_REG)
-                    {
-                        num_files++;
-                    }
-                }
-                closedir(dir);
-
-                // Allocate memory for file_list
-                char *file_list = (char *)malloc(num_files * (MAX_FILENAME_LENGTH + 2) * sizeof(char));
-                if (file_list == NULL)
-                {
-                    perror("malloc");
+                    perror("realloc");
                     exit(EXIT_FAILURE);
                 }
-
-                // Populate file_list with the filenames
-                if ((dir = opendir(dirname)) != NULL)
+                length = version_list(dirname, command.file, version_list_buf, size);
+            } while (length >= size);
+            if (length == 0)
+                length = snprintf(version_list_buf, size, "No versions of %s are kept\n", command.file);
+            response_t response;
+            size_t i;
+            for (i = 0; i == 0 || i < length; i += CHUNK_SIZE)
+            {
+                response.length = length - i < CHUNK_SIZE ? length - i : CHUNK_SIZE;
+                memcpy(response.content, version_list_buf + i, response.length);
+                response.is_exit = 0;
+                response.is_complete = i + CHUNK_SIZE >= length;
+                shaper_throttle(&shaper, TRAFFIC_INTERACTIVE, response.length);
+                if (channel_send(&channel, &response) == -1)
                 {
-                    file_list[0] = '\0';
-                    while ((ent = readdir(dir)) != NULL)
-                    {
-                        if (ent->d_type == DT_REG)
-                        {
-                            strcat(file_list, ent->d_name);
-                            strcat(file_list, "\n");
-                        }
-                    }
-                    closedir(dir);
-
-                    // Send the response to the client in chunks of CHUNK_SIZE bytes
-                    response.is_complete = 0;
-                    size_t len = strlen(file_list);
-                    size_t i;
-                    for (i = 0; i < len; i += CHUNK_SIZE)
+                    if (errno == EINTR)
                     {
-                        memset(response.content, 0, sizeof(response.content));
-                        strncpy(response.content, file_list + i, CHUNK_SIZE);
-                        if (i + CHUNK_SIZE >= len)
-                        {
-                            response.is_complete = 1;
-                        }
-                        if (write(client_fifo_fd_write, &response, sizeof(response)) == -1)
-                        {
-                            if (errno == EINTR)
-                            {
-                                clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
-                                kill(current_client->pid, SIGINT);
-                                my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
-                                exit(EXIT_SUCCESS);
-                            }
-                            perror("write");
-                            exit(EXIT_FAILURE);
-                        }
-                        sem_post(client_connection_sem);
+                        clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+                        signal_client(current_client);
+                        my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+                        exit(EXIT_SUCCESS);
                     }
+                    perror("write");
+                    exit(EXIT_FAILURE);
                 }
-                else
-                {
-                    // Error opening directory
-                    perror("opendir");
-                }
-
-                // Free the dynamically allocated memory
-                free(file_list);
-            }
-            else
-            {
-                // Error opening directory
-                perror("opendir");
             }
+            free(version_list_buf);
         }
-        else if (command.type == READF)
+        else if (command.type == LIST)
         {
             response_t response;
 
-            // Open the file
-            char filepath[MAX_PATH_LENGTH];
-            char file_sem_name[FILE_SEM_NAME_LEN];
-            snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command.file);
-            snprintf(filepath, MAX_PATH_LENGTH, "%s/%s", dirname, command.file);
-            sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
-            if (sem_file == SEM_FAILED)
+            // Every shard is listed and the lists merged, or the directory itself without shards
+            char **names;
+            long long num_files = shard_list(dirname, &names), n;
+            size_t len = 0;
+            for (n = 0; n < num_files; n++)
+                len += strlen(names[n]) + 1;
+
+            // Allocate memory for file_list
+            char *file_list = (char *)malloc(len + 1);
+            if (file_list == NULL)
             {
-                perror("sem_open");
+                perror("malloc");
                 exit(EXIT_FAILURE);
             }
-            sem_wait(sem_file);
-            int file_fd = open(filepath, O_RDONLY);
-            if (file_fd == -1)
+
+            // Populate file_list with the filenames
+            len = 0;
+            for (n = 0; n < num_files; n++)
             {
-                perror("open");
-                exit(EXIT_FAILURE);
+                size_t name_length = strlen(names[n]);
+                memcpy(file_list + len, names[n], name_length);
+                file_list[len + name_length] = '\n';
+                len += name_length + 1;
             }
+            file_list[len] = '\0';
+            shard_free_names(names, num_files);
 
-            // Read the file chunk by chunk
-            char chunk[CHUNK_SIZE];
-            ssize_t bytes_read;
-            int is_line_requested = command.line > 0;
-            int is_complete = 0;
-            size_t content_length = 0;
-            while ((bytes_read = read(file_fd, chunk, sizeof(chunk))) > 0 && !is_complete)
+            // Send the response to the client in chunks of CHUNK_SIZE bytes
+            response.is_complete = 0;
+            size_t i;
+            for (i = 0; i == 0 || i < len; i += CHUNK_SIZE)
             {
-                // Check if a specific line is requested and send only that line
-                if (is_line_requested)
-                {
-                    int line_start = 0;
-                    int line_end = -1;
-                    int line_number = 1;
-                    for (int i = 0; i < bytes_read && !is_complete; i++)
-                    {
-                        if (chunk[i] == '\n')
-                        {
-                            line_number++;
-                            if (line_number == command.line)
-                            {
-                                line_start = i + 1;
-                            }
-                            else if (line_number == command.line + 1)
-                            {
-                                line_end = i;
-                                is_complete = 1;
-                            }
-                        }
-                    }
-                    if (line_end == -1)
-                    {
-                        line_end = bytes_read;
-                        is_complete = 1;
-                    }
-
-                    content_length = line_end - line_start;
-                    memset(response.content, 0, sizeof(response.content));
-                    memcpy(response.content, chunk + line_start, content_length);
-                }
-                // Otherwise, send the whole file chunk by chunk
-                else
+                memset(response.content, 0, sizeof(response.content));
+                response.length = len - i < CHUNK_SIZE ? len - i : CHUNK_SIZE;
+                memcpy(response.content, file_list + i, response.length);
+                response.is_exit = 0;
+                if (i + CHUNK_SIZE >= len)
                 {
-                    content_length = bytes_read;
-                    memset(response.content, 0, sizeof(response.content));
-                    memcpy(response.content, chunk, content_length);
-                    if (bytes_read < (ssize_t)sizeof(chunk))
-                    {
-                        is_complete = 1;
-                    }
+                    response.is_complete = 1;
                 }
-
-                // Send the response to the client
-                response.is_complete = is_complete;
-                if (write(client_fifo_fd_write, &response, sizeof(response)) == -1)
+                shaper_throttle(&shaper, TRAFFIC_INTERACTIVE, response.length);
+                if (channel_send(&channel, &response) == -1)
                 {
                     if (errno == EINTR)
                     {
                         clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
-                        kill(current_client->pid, SIGINT);
+                        signal_client(current_client);
                         my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
                         exit(EXIT_SUCCESS);
                     }
                     perror("write");
                     exit(EXIT_FAILURE);
                 }
-                sem_post(client_connection_sem);
             }
 
-            // Close the file descriptor
-            close(file_fd);
-            sem_post(sem_file);
-            sem_close(sem_file);
-            sem_unlink(file_sem_name);
+            // Free the dynamically allocated memory
+            free(file_list);
         }
-        else if (command.type == WRITET)
+        else if (command.type == READF && command.follow)
+        {
+            if (handle_follow(&command, &channel, &shaper, dirname, log_fd) == -1)
+            {
+                clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+                signal_client(current_client);
+                my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+                exit(EXIT_SUCCESS);
+            }
+        }
+        else if (command.type == READF)
         {
+            response_t response;
+
             // Open the file
             char filepath[MAX_PATH_LENGTH];
             char file_sem_name[FILE_SEM_NAME_LEN];
             snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command.file);
-            snprintf(filepath, MAX_PATH_LENGTH, "%s/%s", dirname, command.file);
+            // Missing files and lines past the end are answered from the metadata cache
+            meta_entry_t meta;
+            // The path stays good until the file is open, the migrator may be moving it
+            int shard_fd = shard_lock(dirname, command.file);
+            int is_version = version_path(dirname, command.file, filepath, sizeof(filepath));
+            int is_known = !is_version && meta_lookup(metas, dirname, command.file, &meta);
+            if ((!is_version && !is_known) ||
+                (is_known && command.tail == 0 && command.line > 0 && meta.lines >= 0 && command.line > meta.lines))
+            {
+                shard_unlock(shard_fd);
+                response.length = is_known ? 0
+                                           : snprintf(response.content, sizeof(response.content), "There is no such a file\n");
+                response.is_complete = 1;
+                response.is_exit = 0;
+                channel_send(&channel, &response);
+                continue;
+            }
             sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
             if (sem_file == SEM_FAILED)
             {
@@ -613,98 +1031,61 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
                 exit(EXIT_FAILURE);
             }
             sem_wait(sem_file);
-            int file_fd = open(filepath, O_RDWR | O_CREAT, 0777);
-            if (file_fd == -1)
+            stored_file_t file;
+            int open_status = storage_open(&file, dirname, filepath);
+            // What was opened stays as it is, writers need not wait for the client
+            sem_post(sem_file);
+            sem_close(sem_file);
+            sem_unlink(file_sem_name);
+            shard_unlock(shard_fd);
+            if (open_status == -1)
             {
-                perror("open");
-                exit(EXIT_FAILURE);
+                response.length = snprintf(response.content, sizeof(response.content), "There is no such a file\n");
+                response.is_complete = 1;
+                response.is_exit = 0;
+                channel_send(&channel, &response);
+                continue;
             }
-
-            // Determine the content to write based on whether a line number is provided
-            char content[MAX_WRITE_STRING_LENGTH];
-            ssize_t content_length;
-
-            if (command.line > 0)
+            if (!file.is_manifest)
+                posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+            // The last lines are found backwards from the end, everything else in one pass
+            if (command.tail > 0)
+                storage_seek(&file, tail_offset(&file, command.tail));
+            long long lines;
+            if (send_lines(&file, &command, &channel, &shaper, &lines) == -1)
             {
-                // Find the position to insert the new line
-                off_t offset = 0;
-                int line_number = 1;
-                ssize_t bytes_read;
-                char chunk[CHUNK_SIZE];
-
-                // Reset the file descriptor position to the beginning
-                if (lseek(file_fd, 0, SEEK_SET) == -1)
-                {
-                    perror("lseek");
-                    exit(EXIT_FAILURE);
-                }
-                while ((bytes_read = read(file_fd, chunk, sizeof(chunk))) > 0)
-                {
-                    for (ssize_t i = 0; i < bytes_read; i++)
-                    {
-                        if (chunk[i] == '\n')
-                        {
-                            line_number++;
-                            if (line_number == command.line)
-                            {
-                                // Move the cursor to the position after the line
-                                offset += i + 1;
-                                break;
-                            }
-                        }
-                    }
-
-                    if (line_number == command.line)
-                    {
-                        break;
-                    }
-
-                    offset += bytes_read;
-                    memset(chunk, 0, sizeof(chunk));
-                }
-                // Move the cursor to the line position for writing
-                if (lseek(file_fd, offset, SEEK_SET) == -1)
-                {
-                    perror("lseek");
-                    exit(EXIT_FAILURE);
-                }
-
-                // Read the old content after the line
-                char old_content[MAX_WRITE_STRING_LENGTH];
-                ssize_t old_content_length = read(file_fd, old_content, sizeof(old_content) - 1);
-                if (old_content_length == -1)
-                {
-                    perror("read");
-                    exit(EXIT_FAILURE);
-                }
-                old_content[old_content_length] = '\0';
-
-                // Move the cursor back to the line position for overwriting
-                if (lseek(file_fd, offset, SEEK_SET) == -1)
+                if (errno == EINTR)
                 {
-                    perror("lseek");
-                    exit(EXIT_FAILURE);
+                    clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+                    signal_client(current_client);
+                    my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+                    exit(EXIT_SUCCESS);
                 }
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
 
-                // Write the new string
-                content_length = snprintf(content, sizeof(content), "%s\n", command.string);
-                ssize_t bytes_written = write(file_fd, content, content_length);
-                if (bytes_written == -1)
-                {
-                    if (errno == EINTR)
-                    {
-                        clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
-                        kill(current_client->pid, SIGINT);
-                        my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
-                        exit(EXIT_SUCCESS);
-                    }
-                    perror("write");
-                    exit(EXIT_FAILURE);
-                }
+            // Counted against the file that was read, kept only if the cache still describes it
+            struct stat st;
+            if (is_known && lines >= 0 && fstat(file.fd, &st) == 0 && st.st_ino == meta.inode && file.size == meta.size &&
+                (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec == meta.mtime)
+                meta_set_lines(metas, &meta, lines);
 
-                // Write the old content after the line
-                bytes_written = write(file_fd, old_content, old_content_length);
-                if (bytes_written == -1)
+            // Close the file descriptor
+            storage_close(&file);
+        }
+        else if (command.type == WRITET)
+        {
+            if (command.line <= 0)
+            {
+                // Appends from every client to the same file are gathered and written together
+                char content[MAX_WRITE_STRING_LENGTH];
+                ssize_t content_length = snprintf(content, sizeof(content), "%s\n", command.string);
+                int status = append_submit(appends, command.file, content, content_length, append_to_file, dirname);
+                if (status == 1)
+                    status = append_to_file(command.file, content, content_length, dirname);
+                if (status == -1)
                 {
                     perror("write");
                     exit(EXIT_FAILURE);
@@ -712,41 +1093,209 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
             }
             else
             {
-                // Simply append the string to the end of the file
-                content_length = snprintf(content, sizeof(content), "%s\n", command.string);
-                if (lseek(file_fd, 0, SEEK_END) == -1)
+                // Open the file
+                char filepath[MAX_PATH_LENGTH];
+                char file_sem_name[FILE_SEM_NAME_LEN];
+                snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command.file);
+                sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+                if (sem_file == SEM_FAILED)
                 {
-                    perror("lseek");
+                    perror("sem_open");
                     exit(EXIT_FAILURE);
                 }
-                ssize_t bytes_written = write(file_fd, content, content_length);
-                if (bytes_written == -1)
-                {
-                    perror("write");
+                sem_wait(sem_file);
+                // The path is found once the file can no longer be moved into its shard
+                int shard_fd = shard_lock(dirname, command.file);
+                shard_path(dirname, command.file, filepath, sizeof(filepath));
+                // Everything after the line moves down, so the file is rewritten in one pass like writeT -b
+                batch_edit_t edit = {command.line, 0, strlen(command.string), 0};
+                long long lines;
+                if (rewrite_lines(dirname, command.file, filepath, command.string, &edit, 1, &lines) == -1)
                     exit(EXIT_FAILURE);
+                shard_unlock(shard_fd);
+                sem_post(sem_file);
+                sem_close(sem_file);
+                sem_unlink(file_sem_name);
+            }
+            // Send the response to the client indicating success
+            response_t response;
+            response.is_complete = 1;
+            response.is_exit = 0;
+            response.length = snprintf(response.content, sizeof(response.content), "Successfully written to file.\n");
+            if (channel_send(&channel, &response) == -1)
+            {
+                if (errno == EINTR)
+                {
+                    clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+                    signal_client(current_client);
+                    my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+                    exit(EXIT_SUCCESS);
                 }
+                perror("write");
+                exit(EXIT_FAILURE);
             }
-            close(file_fd);
+        }
+        else if (command.type == GREP || command.type == SEARCH)
+        {
+            // Only the matching lines travel, the files are searched here
+            grep_pattern_t pattern;
+            char *terms[GREP_MAX_TERMS + 1];
+            int term_count = 0;
+            if (command.type == SEARCH)
+            {
+                char *save, *term = strtok_r(command.string, " ", &save);
+                for (; term != NULL && term_count <= GREP_MAX_TERMS; term = strtok_r(NULL, " ", &save))
+                    terms[term_count++] = term;
+            }
+            match_stream_t stream;
+            stream.channel = &channel;
+            stream.shaper = &shaper;
+            stream.response.length = 0;
+            stream.response.is_complete = 0;
+            stream.response.is_exit = 0;
+            long long matches = -2;
+            if (command.type == SEARCH &&
+                (term_count > GREP_MAX_TERMS || grep_compile_terms(&pattern, terms, term_count) == -1))
+                stream.response.length = snprintf(stream.response.content, sizeof(stream.response.content),
+                                                  "At most %d terms\n", GREP_MAX_TERMS);
+            else if (command.type == SEARCH)
+            {
+                // The index narrows the files down, the search proper checks every line
+                char **names;
+                long long count = index_candidates(dirname, terms, term_count, &names);
+                matches = grep_search_files(&pattern, dirname, names, count, 0, send_match, &stream);
+                index_free_names(names, count);
+                grep_free(&pattern);
+                my_log(log_fd, "search in %lld candidate files found %lld matches\n", count, matches);
+            }
+            else if (grep_compile(&pattern, command.string) == -1)
+                stream.response.length = snprintf(stream.response.content, sizeof(stream.response.content),
+                                                  "Invalid pattern\n");
+            else
+            {
+                matches = grep_search(&pattern, dirname, command.file, command.limit, send_match, &stream);
+                grep_free(&pattern);
+                my_log(log_fd, "grep '%s' in '%s' found %lld matches\n", command.string, command.file, matches);
+            }
+            if (matches == 0)
+                stream.response.length = snprintf(stream.response.content, sizeof(stream.response.content),
+                                                  "No matches\n");
+            stream.response.is_complete = 1;
+            if (matches == -1 || channel_send(&channel, &stream.response) == -1)
+            {
+                if (errno == EINTR)
+                {
+                    clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+                    signal_client(current_client);
+                    my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+                    exit(EXIT_SUCCESS);
+                }
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (command.type == DELTA_UPLOAD)
+        {
+            handle_delta_upload(&command, &channel, &shaper, dirname, log_fd);
+        }
+        else if (command.type == BATCH_WRITE)
+        {
+            handle_batch_write(&command, &channel, &shaper, dirname, log_fd);
+        }
+        else if (command.type == LIMIT)
+        {
+            // Changed for every session at once, the tuner keeps the limit within the range
+            response_t response;
+            int is_refused = !current_client->is_owner && (command.line > 0 || command.idle >= 0);
+            if (is_refused)
+                my_log(log_fd, ">> Client_%ld is not the server's user and may not change the limits, refused\n",
+                       current_client->counter_id);
+            else if (command.line > 0)
+            {
+                // The process table has no room beyond the size it was given at the start
+                int limit_min = command.line < queue->limit_cap ? command.line : queue->limit_cap;
+                int limit_max = command.last_line < queue->limit_cap ? command.last_line : queue->limit_cap;
+                if (limit_max < limit_min)
+                    limit_max = limit_min;
+                __atomic_store_n(&queue->limit_min, limit_min, __ATOMIC_RELEASE);
+                __atomic_store_n(&queue->limit_max, limit_max, __ATOMIC_RELEASE);
+                int limit = __atomic_load_n(&queue->limit, __ATOMIC_ACQUIRE);
+                limit = limit < limit_min ? limit_min : limit > limit_max ? limit_max : limit;
+                __atomic_store_n(&queue->limit, limit, __ATOMIC_RELEASE);
+                my_log(log_fd, ">> Client_%ld set the limit to %d-%d clients\n", current_client->counter_id, limit_min,
+                       limit_max);
+                admission_fill();
+            }
+            if (!is_refused && command.idle >= 0)
+            {
+                __atomic_store_n(&queue->idle_timeout, command.idle, __ATOMIC_RELEASE);
+                my_log(log_fd, ">> Client_%ld set the idle timeout to %d seconds\n", current_client->counter_id, command.idle);
+            }
+            response.length = snprintf(response.content, sizeof(response.content),
+                                       "%s%d clients served, %d waiting, limit %d (%d-%d), idle timeout %d seconds\n",
+                                       is_refused ? "Only the server's user may change the limits\n" : "",
+                                       __atomic_load_n(&queue->active, __ATOMIC_ACQUIRE), admission_waiting(queue),
+                                       queue->limit, queue->limit_min, queue->limit_max, queue->idle_timeout);
+            response.is_complete = 1;
+            response.is_exit = 0;
+            if (channel_send(&channel, &response) == -1)
+            {
+                if (errno == EINTR)
+                {
+                    clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
+                    signal_client(current_client);
+                    my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
+                    exit(EXIT_SUCCESS);
+                }
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (command.type == CHECKSUM)
+        {
+            // Digest of the stored file, computed here so nothing has to travel
+            response_t response;
+            char filepath[MAX_PATH_LENGTH];
+            char file_sem_name[FILE_SEM_NAME_LEN];
+            snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command.file);
+            int shard_fd = shard_lock(dirname, command.file);
+            version_path(dirname, command.file, filepath, sizeof(filepath));
+            sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+            if (sem_file == SEM_FAILED)
+            {
+                perror("sem_open");
+                exit(EXIT_FAILURE);
+            }
+            sem_wait(sem_file);
+            stored_file_t file;
+            int open_status = storage_open(&file, dirname, filepath);
             sem_post(sem_file);
             sem_close(sem_file);
             sem_unlink(file_sem_name);
-            // Send the response to the client indicating success
-            response_t response;
+            shard_unlock(shard_fd);
+            if (open_status == -1)
+                response.length = snprintf(response.content, sizeof(response.content), "There is no such a file\n");
+            else
+            {
+                uint32_t crc = storage_crc32c(&file, 0, file.size);
+                response.length = snprintf(response.content, sizeof(response.content), "%08x  %s (%lld bytes, crc32c)\n",
+                                           crc, command.file, file.size);
+                storage_close(&file);
+            }
             response.is_complete = 1;
-            snprintf(response.content, sizeof(response.content), "Successfully written to file.\n");
-            if (write(client_fifo_fd_write, &response, sizeof(response)) == -1)
+            response.is_exit = 0;
+            if (channel_send(&channel, &response) == -1)
             {
                 if (errno == EINTR)
                 {
                     clean_up(client_fifo_fd_read, client_fifo_fd_write, client_connection_sem);
-                    kill(current_client->pid, SIGINT);
+                    signal_client(current_client);
                     my_log(log_fd, "\nClient_%ld disconnected..\n", current_client->counter_id);
                     exit(EXIT_SUCCESS);
                 }
                 perror("write");
                 exit(EXIT_FAILURE);
             }
-            sem_post(client_connection_sem);
         }
         else if (command.type == DOWNLOAD)
         {
@@ -756,16 +1305,18 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
 
             // Open the file for reading
             char file_path[MAX_PATH_LENGTH];
-
-            int is_file_exist = 1;
-            snprintf(file_path, sizeof(file_path), "%s/%s", dirname, command.file);
-            int file_fd = open(file_path, O_RDONLY);
-            if (file_fd == -1)
+            transfer_info_t info;
+            memset(&info, 0, sizeof(info));
+            // <file>@<n> downloads a kept version
+            meta_entry_t meta;
+            int shard_fd = shard_lock(dirname, command.file);
+            if (!version_path(dirname, command.file, file_path, sizeof(file_path)) &&
+                !meta_lookup(metas, dirname, command.file, &meta))
             {
-                is_file_exist = 0;
+                shard_unlock(shard_fd);
+                info.status = TRANSFER_NO_FILE;
                 my_log(log_fd, "Requested file is not exist !\n");
-                write(client_fifo_fd_write, &is_file_exist, sizeof(is_file_exist));
-                sem_post(client_connection_sem);
+                channel_write(&channel, &info, sizeof(info));
                 continue;
             }
             char file_sem_name[FILE_SEM_NAME_LEN];
@@ -776,20 +1327,67 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
                 perror("sem_open");
                 exit(EXIT_FAILURE);
             }
+            // The lock only covers the open, the opened file stays as it is however long the
+            // client takes, see storage_open
             sem_wait(sem_file);
-            // Read and send the file contents in chunks
+            stored_file_t file;
+            int open_status = storage_open(&file, dirname, file_path);
+            sem_post(sem_file);
+            sem_close(sem_file);
+            sem_unlink(file_sem_name);
+            shard_unlock(shard_fd);
+            if (open_status == -1)
+            {
+                info.status = TRANSFER_NO_FILE;
+                my_log(log_fd, "Requested file is not exist !\n");
+                channel_write(&channel, &info, sizeof(info));
+                continue;
+            }
+
+            // Resume at the client's offset if its last window matches ours
+            info.status = TRANSFER_OK;
+            info.size = file.size;
+            info.offset = 0;
+            if (command.offset > 0 && command.offset <= file.size &&
+                storage_crc32c(&file, resume_window_start(command.offset), command.offset) == command.checksum)
+            {
+                info.offset = command.offset;
+                my_log(log_fd, "Resuming download of '%s' at byte %lld\n", command.file, info.offset);
+            }
+            storage_seek(&file, info.offset);
+            channel_write(&channel, &info, sizeof(info));
+
+            // Read and send the file contents in chunks, the checksum covers
+            // the whole file including what the client already had
             ssize_t bytes_read;
+            uint32_t file_crc = info.offset > 0 ? storage_crc32c(&file, 0, info.offset) : 0;
+            int is_sent = 0;
+            // Plain files are read ahead through the engine, manifests chunk by chunk.
+            // Very large ones bypass the page cache so they do not push out hot files.
+            int direct_fd = -1;
+            if (!file.is_manifest && config.direct_threshold > 0 && file.size >= config.direct_threshold)
+            {
+                // The name may hold a newer file by now, open the one already pinned
+                char proc_path[64];
+                snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", file.fd);
+                direct_fd = open(proc_path, O_RDONLY | O_DIRECT);
+            }
+            if (!file.is_manifest)
+                io_reader_open(&engine, direct_fd != -1 ? direct_fd : file.fd, info.offset, file.size);
             while (response.is_complete == 0)
             {
-                bytes_read = read(file_fd, response.content, sizeof(response.content));
-                if (bytes_read < (ssize_t)sizeof(CHUNK_SIZE))
-                {
-                    response.is_complete = 1;
-                    response.content[bytes_read - 1] = '\0';
-                }
+                if (file.is_manifest)
+                    bytes_read = storage_read(&file, response.content, sizeof(response.content));
+                else
+                    bytes_read = io_reader_read(&engine, response.content, sizeof(response.content));
+                if (bytes_read < 0)
+                    bytes_read = 0;
+                file_crc = crc32c(file_crc, response.content, bytes_read);
+                shaper_throttle(&shaper, TRAFFIC_BULK, bytes_read);
+                response.length = bytes_read;
                 response.is_complete = (bytes_read < (ssize_t)sizeof(response.content));
-                // Send the response to the client
-                if (write(client_fifo_fd_write, &response, sizeof(response)) == -1)
+                // Send the response to the client, the bytes the checksum was taken over
+                if (channel_send(&channel, &response) == -1)
                 {
                     if (errno == EINTR)
                     {
@@ -801,52 +1399,92 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
                     perror("Error writing response to client");
                     break;
                 }
-
-                sem_post(client_connection_sem);
-                if (response.is_complete)
-                    break;
-
-                memset(response.content, 0, sizeof(response.content));
+                is_sent = response.is_complete;
+            }
+            if (!file.is_manifest)
+                io_reader_close(&engine);
+            if (direct_fd != -1)
+                close(direct_fd);
+            if (is_sent)
+            {
+                info.checksum = file_crc;
+                channel_write(&channel, &info, sizeof(info));
             }
 
             // Close the file descriptor
-            close(file_fd);
-            sem_post(sem_file);
-            sem_close(sem_file);
-            sem_unlink(file_sem_name);
+            storage_close(&file);
         }
         else if (command.type == UPLOAD)
         {
-            // Open the file for writing
-            char file_path[MAX_PATH_LENGTH], is_file_exist = 0;
-            snprintf(file_path, sizeof(file_path), "%s/%s", dirname, command.file);
-            if (access(file_path, F_OK) == 0)
+            // Uploads land in a hidden part file named after the transfer id and
+            // are renamed into place once the client has sent the last chunk
+            char file_path[MAX_PATH_LENGTH], part_name[PART_FILE_NAME_LEN], part_path[MAX_PATH_LENGTH];
+            transfer_info_t info;
+            memset(&info, 0, sizeof(info));
+            shard_path(dirname, command.file, file_path, sizeof(file_path));
+            part_file_name(part_name, sizeof(part_name), command.file, command.transfer_id);
+            snprintf(part_path, sizeof(part_path), "%s/%s", dirname, part_name);
+            meta_entry_t meta;
+            if (meta_lookup(metas, dirname, command.file, &meta))
             {
                 my_log(log_fd, "File '%s' already exists. Aborting upload.\n", command.file);
-                is_file_exist = 1;
+                info.status = TRANSFER_EXISTS;
+                channel_write(&channel, &info, sizeof(info));
+                continue;
             }
-            write(client_fifo_fd_write, &is_file_exist, sizeof(is_file_exist));
-            sem_post(client_connection_sem);
-            if (is_file_exist == 1)
+
+            int file_fd = open(part_path, O_RDWR | O_CREAT, 0777);
+            struct stat st;
+            if (file_fd == -1 || fstat(file_fd, &st) == -1)
             {
+                perror("Error opening file for writing");
+                if (file_fd != -1)
+                    close(file_fd);
+                info.status = TRANSFER_ERROR;
+                channel_write(&channel, &info, sizeof(info));
                 continue;
             }
 
-            int file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
-            if (file_fd == -1)
+            // Offer the size and last window checksum of what we already have
+            info.status = TRANSFER_OK;
+            info.size = st.st_size;
+            info.offset = st.st_size;
+            if (st.st_size > 0)
+                info.checksum = crc32c_file_range(file_fd, resume_window_start(st.st_size), st.st_size);
+            channel_write(&channel, &info, sizeof(info));
+
+            // The client answers with the offset it resumes at and the total size
+            if (channel_read(&channel, &info, sizeof(info)) == -1)
             {
-                perror("Error opening file for writing");
+                close(file_fd);
+                continue;
+            }
+            int is_finished = 0, is_corrupt = 0;
+            // Only what we offered can be resumed, the data is still taken so the stream stays in step
+            // and the part file is left as it is
+            if (info.offset < 0 || info.offset > st.st_size)
+            {
+                my_log(log_fd, "Upload of '%s' asked to resume at byte %lld of %lld, discarding it\n", command.file,
+                       info.offset, (long long)st.st_size);
+                info.offset = st.st_size;
+                info.size = st.st_size;
+                is_corrupt = 1;
+            }
+            if (info.offset > 0)
+                my_log(log_fd, "Resuming upload of '%s' at byte %lld\n", command.file, info.offset);
+            if (ftruncate(file_fd, info.offset) == -1 || lseek(file_fd, info.offset, SEEK_SET) == -1)
+            {
+                perror("Error preparing part file");
                 exit(EXIT_FAILURE);
             }
+            preallocate(file_fd, info.offset, info.size - info.offset);
 
             // Read and write the file contents in chunks
             response_t response;
-            ssize_t bytes_written;
+            io_writer_open(&engine, file_fd, info.offset);
             while (1)
             {
-                sem_wait(client_connection_sem);
-                ssize_t bytes_read = read(client_fifo_fd_read, &response, sizeof(response));
-                if (bytes_read == -1)
+                if (channel_recv(&channel, &response) == -1)
                 {
                     if (errno == EINTR)
                     {
@@ -855,28 +1493,130 @@ int handle_client(client_info_t *current_client, int *counter, sem_t *client_con
                         close(client_fifo_fd_write);
                         exit(EXIT_SUCCESS);
                     }
-                    perror("Error reading from client");
+                    // Keep reading so the stream stays in step, the part is dropped below
+                    if (errno == EBADMSG)
+                    {
+                        is_corrupt = 1;
+                        continue;
+                    }
+                    my_log(log_fd, "\nClient_%ld vanished during upload, keeping part file.\n", current_client->counter_id);
                     break;
                 }
-                else if (bytes_read < (ssize_t)sizeof(CHUNK_SIZE))
-                {
-                    response.content[bytes_read - 1] = '\0';
-                }
                 if (response.is_exit)
                 {
-                    my_log(log_fd, "\nFile upload completed.\n");
+                    is_finished = response.is_complete;
                     break;
                 }
-                bytes_written = write(file_fd, response.content, strlen(response.content));
-                if (bytes_written == -1)
+                if (!is_corrupt && io_writer_write(&engine, response.content, response.length) == -1)
                 {
                     perror("Error writing to file");
-                    break;
+                    is_corrupt = 1;
                 }
+                shaper_throttle(&shaper, TRAFFIC_BULK, response.length);
+            }
+            // Everything received has to be in the part file before it is checked or resumed
+            if (io_writer_close(&engine) == -1)
+            {
+                perror("Error writing to file");
+                is_corrupt = 1;
+            }
+            if (!is_finished)
+            {
+                my_log(log_fd, "\nFile upload interrupted, '%s' can be resumed.\n", command.file);
+                // Hands back the space reserved past what arrived
+                if (fstat(file_fd, &st) == 0 && ftruncate(file_fd, st.st_size) == -1)
+                    perror("Error trimming part file");
+                close(file_fd);
+                continue;
             }
 
-            // Close the file descriptor
+            // The client follows the last frame with the checksum of the whole file
+            transfer_info_t trailer;
+            if (channel_read(&channel, &trailer, sizeof(trailer)) == -1)
+            {
+                close(file_fd);
+                continue;
+            }
+            // The checksum is taken over what the part file holds, not over what arrived
+            uint32_t file_crc = 0;
+            if (fstat(file_fd, &st) == -1)
+                is_corrupt = 1;
+            else if (!is_corrupt)
+                file_crc = crc32c_file_range(file_fd, 0, st.st_size);
+            if (is_corrupt || trailer.checksum != file_crc)
+            {
+                my_log(log_fd, "\nUpload of '%s' failed its checksum, discarding it.\n", command.file);
+                is_corrupt = 1;
+            }
+            info.checksum = file_crc;
+
+            // Chunk the upload before taking the lock, only the rename needs it
+            char manifest_name[STORAGE_TEMP_NAME_LEN], manifest_path[MAX_PATH_LENGTH];
+            int is_stored = 0;
             close(file_fd);
+            if (config.dedup && !is_corrupt && st.st_size == info.size)
+            {
+                snprintf(manifest_name, sizeof(manifest_name), MANIFEST_FILE_TEMPLATE, command.file, (long)getpid());
+                snprintf(manifest_path, sizeof(manifest_path), "%s/%s", dirname, manifest_name);
+                int part_read_fd = open(part_path, O_RDONLY);
+                is_stored = part_read_fd != -1 && storage_ingest(dirname, part_read_fd, manifest_path) == 0;
+                if (part_read_fd != -1)
+                    close(part_read_fd);
+                if (!is_stored)
+                    my_log(log_fd, "\nCould not add '%s' to the chunk store, keeping a plain copy.\n", command.file);
+            }
+
+            // Commit the part file under the file lock
+            char file_sem_name[FILE_SEM_NAME_LEN];
+            snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command.file);
+            sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+            if (sem_file == SEM_FAILED)
+            {
+                perror("sem_open");
+                exit(EXIT_FAILURE);
+            }
+            sem_wait(sem_file);
+            int shard_fd = shard_lock(dirname, command.file);
+            shard_path(dirname, command.file, file_path, sizeof(file_path));
+            if (is_corrupt)
+            {
+                info.status = TRANSFER_ERROR;
+                unlink(part_path);
+            }
+            else if (st.st_size != info.size)
+            {
+                my_log(log_fd, "\nUpload of '%s' is %lld bytes, expected %lld.\n", command.file, (long long)st.st_size, info.size);
+                info.status = TRANSFER_ERROR;
+                unlink(part_path);
+            }
+            else if (publish_file(is_stored ? manifest_path : part_path, file_path) == -1)
+            {
+                if (errno == EEXIST)
+                {
+                    info.status = TRANSFER_EXISTS;
+                    unlink(part_path);
+                }
+                else
+                {
+                    perror("rename");
+                    info.status = TRANSFER_ERROR;
+                }
+            }
+            else
+            {
+                my_log(log_fd, "\nFile upload completed.\n");
+                info.status = TRANSFER_OK;
+                meta_changed(metas, command.file);
+                if (is_stored)
+                    unlink(part_path);
+            }
+            if (is_stored && info.status != TRANSFER_OK)
+                storage_discard(dirname, manifest_path);
+            shard_unlock(shard_fd);
+            sem_post(sem_file);
+            sem_close(sem_file);
+            sem_unlink(file_sem_name);
+            channel_write(&channel, &info, sizeof(info));
             continue;
         }
     }
@@ -909,9 +1649,9 @@ sem_t *connect_client_connection_sem(int client_pid)
     return client_connection_sem;
 }
 
-connection_response_t *connect_client_shm(int client_pid)
+connection_reply_t *connect_client_shm(int client_pid)
 {
-    connection_response_t *shm_ptr;
+    connection_reply_t *shm_ptr;
     int shm_fd;
     char res_shm_name[RESPOND_SHM_LEN];
     snprintf(res_shm_name, RESPOND_SHM_LEN, RESPOND_SHM_TEMPLATE, (long)client_pid);
@@ -921,12 +1661,12 @@ connection_response_t *connect_client_shm(int client_pid)
         perror("Error opening shared memory");
         exit(EXIT_FAILURE);
     }
-    if (ftruncate(shm_fd, sizeof(connection_response_t)) == -1)
+    if (ftruncate(shm_fd, sizeof(connection_reply_t)) == -1)
     {
         perror("Error resizing shared memory");
         exit(EXIT_FAILURE);
     }
-    shm_ptr = (connection_response_t *)mmap(NULL, sizeof(connection_response_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    shm_ptr = (connection_reply_t *)mmap(NULL, sizeof(connection_reply_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
     if (shm_ptr == MAP_FAILED)
     {
         perror("Error mapping shared memory");
@@ -953,16 +1693,1261 @@ void remove_mask()
     sigprocmask(SIG_SETMASK, &orig_mask, NULL);
 }
 
-void clean_up(int client_fifo_fd_read, int client_fifo_fd_write, sem_t *client_connection_sem)
+void handle_delta_upload(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, int log_fd)
 {
-    close(client_fifo_fd_read);
-    close(client_fifo_fd_write);
-    if (sem_close(free_slot_sem) == -1)
+    char file_path[MAX_PATH_LENGTH], delta_name[DELTA_FILE_NAME_LEN], delta_path[MAX_PATH_LENGTH];
+    delta_header_t header;
+    transfer_info_t info;
+    memset(&header, 0, sizeof(header));
+    memset(&info, 0, sizeof(info));
+    snprintf(delta_name, sizeof(delta_name), DELTA_FILE_TEMPLATE, command->file, (long)getpid());
+    snprintf(delta_path, sizeof(delta_path), "%s/%s", dirname, delta_name);
+
+    // Without a copy on our side every byte arrives as a literal. Like a download
+    // the basis only needs the lock while it is opened, see storage_open
+    char file_sem_name[FILE_SEM_NAME_LEN];
+    snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command->file);
+    sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+    if (sem_file == SEM_FAILED)
     {
-        perror("sem_close");
+        perror("sem_open");
+        exit(EXIT_FAILURE);
+    }
+    sem_wait(sem_file);
+    int shard_fd = shard_lock(dirname, command->file);
+    shard_path(dirname, command->file, file_path, sizeof(file_path));
+    stored_file_t basis;
+    int has_basis = storage_open(&basis, dirname, file_path) == 0;
+    shard_unlock(shard_fd);
+    sem_post(sem_file);
+    sem_close(sem_file);
+    sem_unlink(file_sem_name);
+    header.status = TRANSFER_OK;
+    if (has_basis)
+    {
+        header.size = basis.size;
+        header.block_length = delta_block_length(basis.size);
+        header.block_count = (basis.size + header.block_length - 1) / header.block_length;
+    }
+    else
+    {
+        header.block_length = DELTA_MIN_BLOCK_LENGTH;
+        header.block_count = 0;
+    }
+    channel_write(channel, &header, sizeof(header));
+
+    // Send one signature per block, packed into response frames
+    response_t response;
+    unsigned char *block = malloc(header.block_length);
+    if (block == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    long long i;
+    response.length = 0;
+    response.is_complete = 0;
+    response.is_exit = 0;
+    for (i = 0; i <= header.block_count; i++)
+    {
+        if (i < header.block_count)
+        {
+            ssize_t bytes_read = storage_pread(&basis, block, header.block_length, i * header.block_length);
+            if (bytes_read <= 0)
+            {
+                // The file shrank under us, the final checksum catches the rest
+                header.block_count = i;
+                bytes_read = 0;
+            }
+            else
+            {
+                delta_make_sig(block, bytes_read, (delta_sig_t *)(response.content + response.length));
+                response.length += sizeof(delta_sig_t);
+            }
+        }
+        if (i >= header.block_count || response.length + sizeof(delta_sig_t) > sizeof(response.content))
+        {
+            response.is_complete = i >= header.block_count;
+            channel_send(channel, &response);
+            response.length = 0;
+        }
+    }
+    free(block);
+
+    // Rebuild the file from copied blocks and literals into an anonymous
+    // file next to the original, so an abort leaves nothing behind
+    int is_anonymous = 1;
+    int delta_fd = open(dirname, O_TMPFILE | O_RDWR, 0777);
+    if (delta_fd == -1)
+    {
+        is_anonymous = 0;
+        delta_fd = open(delta_path, O_RDWR | O_CREAT | O_TRUNC, 0777);
+    }
+    if (delta_fd == -1)
+    {
+        perror("Error opening delta file");
+        exit(EXIT_FAILURE);
+    }
+    preallocate(delta_fd, 0, command->size);
+    delta_op_t op;
+    char chunk[CHUNK_SIZE];
+    long long total = 0, copied = 0;
+    uint32_t crc = 0;
+    int op_status, is_failed = 0;
+    info.status = TRANSFER_ERROR;
+    // After a failure the ops are still read up to DELTA_END so the stream stays in step
+    while ((op_status = channel_read(channel, &op, sizeof(op))) == 0)
+    {
+        if (op.type == DELTA_LITERAL)
+        {
+            if (op.length < 0 || op.length > (int)sizeof(op.data))
+                is_failed = 1;
+            if (is_failed)
+                continue;
+            if (write_full(delta_fd, op.data, op.length) == -1)
+            {
+                perror("Error writing delta file");
+                is_failed = 1;
+                continue;
+            }
+            crc = crc32c(crc, op.data, op.length);
+            total += op.length;
+            shaper_throttle(shaper, TRAFFIC_BULK, op.length);
+        }
+        else if (op.type == DELTA_COPY)
+        {
+            // Only the blocks we sent signatures for can be copied
+            if (op.block < 0 || op.count < 0 || op.count > header.block_count - op.block)
+                is_failed = 1;
+            off_t offset = op.block * header.block_length;
+            off_t end = (op.block + op.count) * header.block_length;
+            if (end > header.size)
+                end = header.size;
+            while (!is_failed && offset < end)
+            {
+                size_t want = end - offset < (off_t)sizeof(chunk) ? (size_t)(end - offset) : sizeof(chunk);
+                ssize_t bytes_read = storage_pread(&basis, chunk, want, offset);
+                if (bytes_read <= 0)
+                    break;
+                if (write_full(delta_fd, chunk, bytes_read) == -1)
+                {
+                    perror("Error writing delta file");
+                    is_failed = 1;
+                    break;
+                }
+                crc = crc32c(crc, chunk, bytes_read);
+                shaper_throttle(shaper, TRAFFIC_BULK, bytes_read);
+                offset += bytes_read;
+                total += bytes_read;
+                copied += bytes_read;
+            }
+        }
+        else if (op.type == DELTA_END)
+        {
+            if (!is_failed && op.size == total && op.checksum == crc)
+                info.status = TRANSFER_OK;
+            else
+                my_log(log_fd, "Delta upload of '%s' does not match the client's file\n", command->file);
+            break;
+        }
+        else
+            break;
+    }
+    if (has_basis)
+        storage_close(&basis);
+    if (op_status == -1)
+        op.type = DELTA_ABORT;
+    if (op.type == DELTA_ABORT)
+    {
+        my_log(log_fd, "\nDelta upload of '%s' interrupted.\n", command->file);
+        close(delta_fd);
+        if (!is_anonymous)
+            unlink(delta_path);
+        return;
+    }
+
+    // Replace the original under the file lock
+    char manifest_name[STORAGE_TEMP_NAME_LEN], manifest_path[MAX_PATH_LENGTH];
+    int is_stored = 0;
+    if (info.status == TRANSFER_OK)
+    {
+        // Hand back whatever the size hint reserved past the real end
+        if (ftruncate(delta_fd, total) == -1)
+        {
+            perror("Error truncating delta file");
+            info.status = TRANSFER_ERROR;
+        }
+        else if (config.dedup)
+        {
+            snprintf(manifest_name, sizeof(manifest_name), MANIFEST_FILE_TEMPLATE, command->file, (long)getpid());
+            snprintf(manifest_path, sizeof(manifest_path), "%s/%s", dirname, manifest_name);
+            is_stored = storage_ingest(dirname, delta_fd, manifest_path) == 0;
+        }
+        // rename needs a name to move over the original, give it the hidden one
+        if (info.status == TRANSFER_OK && !is_stored && is_anonymous && link_temp_file(delta_fd, delta_path) == -1)
+        {
+            perror("linkat");
+            info.status = TRANSFER_ERROR;
+        }
+    }
+    if (info.status == TRANSFER_OK)
+    {
+        sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+        if (sem_file == SEM_FAILED)
+        {
+            perror("sem_open");
+            exit(EXIT_FAILURE);
+        }
+        sem_wait(sem_file);
+        shard_fd = shard_lock(dirname, command->file);
+        shard_path(dirname, command->file, file_path, sizeof(file_path));
+        // The version being replaced gives its chunks back once it is gone, unless it is kept
+        int old_fd = open(file_path, O_RDONLY);
+        if (config.versions > 0 && version_save(dirname, command->file, config.versions) == -1)
+        {
+            perror("Error keeping version");
+            info.status = TRANSFER_ERROR;
+        }
+        else if (rename(is_stored ? manifest_path : delta_path, file_path) == -1)
+        {
+            perror("rename");
+            info.status = TRANSFER_ERROR;
+        }
+        else
+        {
+            meta_changed(metas, command->file);
+            if (old_fd != -1)
+                storage_release(dirname, old_fd);
+        }
+        if (old_fd != -1)
+            close(old_fd);
+        if (is_stored && info.status != TRANSFER_OK)
+            storage_discard(dirname, manifest_path);
+        shard_unlock(shard_fd);
+        sem_post(sem_file);
+        sem_close(sem_file);
+        sem_unlink(file_sem_name);
+        my_log(log_fd, "\nDelta upload of '%s' completed, %lld of %lld bytes reused.\n", command->file, copied, total);
+    }
+    close(delta_fd);
+    if (info.status != TRANSFER_OK || is_stored)
+        unlink(delta_path);
+    info.size = total;
+    info.offset = copied;
+    channel_write(channel, &info, sizeof(info));
+}
+
+/*
+ Flushes appends gathered by append_submit, ctx is the server directory.
+ One journaled write for however many lines there are.
+*/
+int append_to_file(const char *file, const char *data, size_t length, void *ctx)
+{
+    const char *dirname = ctx;
+    char filepath[MAX_PATH_LENGTH];
+    char file_sem_name[FILE_SEM_NAME_LEN];
+    snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, file);
+    sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+    if (sem_file == SEM_FAILED)
+    {
+        perror("sem_open");
+        exit(EXIT_FAILURE);
+    }
+    sem_wait(sem_file);
+    int shard_fd = shard_lock(dirname, file);
+    shard_path(dirname, file, filepath, sizeof(filepath));
+    int status = -1;
+    int file_fd = storage_materialize(dirname, file) == -1 ? -1 : open_locked(filepath);
+    if (file_fd != -1)
+    {
+        off_t end = lseek(file_fd, 0, SEEK_END);
+        if (end != -1)
+            status = write_file(dirname, file, file_fd, end, data, length);
+        close(file_fd);
+    }
+    int write_errno = errno;
+    shard_unlock(shard_fd);
+    sem_post(sem_file);
+    sem_close(sem_file);
+    sem_unlink(file_sem_name);
+    errno = write_errno;
+    return status;
+}
+
+int compare_edits(const void *a, const void *b)
+{
+    const batch_edit_t *x = a, *y = b;
+    if (x->line != y->line)
+        return x->line < y->line ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/*
+ Splits the received "<line #> <text>" records and sorts them by line.
+ Returns the number of edits, or minus the number of the first record
+ that is not one.
+*/
+long long parse_edits(char *data, size_t length, batch_edit_t **edits)
+{
+    long long count = 0, capacity = 0, record = 0;
+    size_t pos = 0;
+    *edits = NULL;
+    while (pos < length)
+    {
+        char *newline = memchr(data + pos, '\n', length - pos);
+        size_t end = newline != NULL ? (size_t)(newline - data) : length;
+        char *text;
+        record++;
+        if (end > pos)
+        {
+            long long line = isdigit((unsigned char)data[pos]) ? strtoll(data + pos, &text, 10) : 0;
+            if (line < 1 || (text < data + end && *text != ' '))
+            {
+                free(*edits);
+                *edits = NULL;
+                return -record;
+            }
+            if (text < data + end)
+                text++;
+            if (count == capacity)
+            {
+                capacity = capacity == 0 ? 64 : capacity * 2;
+                batch_edit_t *grown = realloc(*edits, capacity * sizeof(batch_edit_t));
+                if (grown == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+                *edits = grown;
+            }
+            batch_edit_t *edit = &(*edits)[count];
+            edit->line = line;
+            edit->offset = text - data;
+            edit->length = data + end - text;
+            edit->seq = count++;
+        }
+        pos = end + 1;
+    }
+    if (count > 0)
+        qsort(*edits, count, sizeof(batch_edit_t), compare_edits);
+    return count;
+}
+
+/*
+ writeT -b: the client streams the edits like an upload, then they are
+ applied in one pass over the file into a temporary file that replaces it
+ under the file lock. Each text goes in before the line it names, line
+ numbers refer to the file as it was, past the last line means at the end.
+*/
+void handle_batch_write(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, int log_fd)
+{
+    response_t response;
+    char *data = NULL;
+    size_t length = 0, capacity = 0;
+    int is_too_long = 0;
+    // Nothing is touched until every edit is in
+    response.is_exit = 0;
+    while (!response.is_exit)
+    {
+        if (channel_recv(channel, &response) == -1)
+        {
+            my_log(log_fd, "\nBatch write of '%s' interrupted.\n", command->file);
+            free(data);
+            return;
+        }
+        if (is_too_long || length + response.length > BATCH_MAX_LENGTH)
+        {
+            is_too_long = 1;
+            continue;
+        }
+        if (length + response.length + 1 > capacity)
+        {
+            capacity = capacity == 0 ? 64 * 1024 : capacity * 2;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            data = grown;
+        }
+        memcpy(data + length, response.content, response.length);
+        length += response.length;
+        shaper_throttle(shaper, TRAFFIC_BULK, response.length);
+    }
+
+    batch_edit_t *edits = NULL;
+    long long count = 0;
+    response_t reply;
+    reply.is_complete = 1;
+    reply.is_exit = 0;
+    if (!response.is_complete)
+        reply.length = snprintf(reply.content, sizeof(reply.content), "Batch write cancelled, the file is unchanged\n");
+    else if (is_too_long)
+        reply.length = snprintf(reply.content, sizeof(reply.content), "Edits exceed %d MiB, the file is unchanged\n",
+                                BATCH_MAX_LENGTH / (1024 * 1024));
+    else if ((count = parse_edits(data, length, &edits)) < 0)
+        reply.length = snprintf(reply.content, sizeof(reply.content),
+                                "Edit %lld is not \"<line #> <string>\", the file is unchanged\n", -count);
+    if (!response.is_complete || is_too_long || count < 0)
+    {
+        channel_send(channel, &reply);
+        free(data);
+        return;
+    }
+
+    char file_path[MAX_PATH_LENGTH], file_sem_name[FILE_SEM_NAME_LEN];
+    snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command->file);
+    sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+    if (sem_file == SEM_FAILED)
+    {
+        perror("sem_open");
+        exit(EXIT_FAILURE);
+    }
+    sem_wait(sem_file);
+    int shard_fd = shard_lock(dirname, command->file);
+    shard_path(dirname, command->file, file_path, sizeof(file_path));
+    long long lines;
+    int status = rewrite_lines(dirname, command->file, file_path, data, edits, count, &lines);
+    shard_unlock(shard_fd);
+    sem_post(sem_file);
+    sem_close(sem_file);
+    sem_unlink(file_sem_name);
+
+    if (status == 0)
+    {
+        my_log(log_fd, "Batch write of %lld edits to '%s' in one pass over %lld lines\n", count, command->file, lines);
+        reply.length = snprintf(reply.content, sizeof(reply.content), "Successfully applied %lld edits to file.\n", count);
+    }
+    else
+        reply.length = snprintf(reply.content, sizeof(reply.content), "Batch write failed, the file is unchanged\n");
+    channel_send(channel, &reply);
+    free(edits);
+    free(data);
+}
+
+/*
+ Writes a new version of file_path with the edits, sorted by line, put in
+ before their lines in one pass over the old one, and renames it over the
+ old one once it is on disk. The text of an edit is in data. Called with
+ the file's semaphore and shard lock held. lines gets the number of lines
+ of the old version. Returns 0, or -1 with the file unchanged.
+*/
+int rewrite_lines(char *dirname, const char *file, const char *file_path, const char *data, const batch_edit_t *edits,
+                  long long count, long long *lines)
+{
+    char batch_name[BATCH_FILE_NAME_LEN], batch_path[MAX_PATH_LENGTH];
+    snprintf(batch_name, sizeof(batch_name), BATCH_FILE_TEMPLATE, file, (long)getpid());
+    snprintf(batch_path, sizeof(batch_path), "%s/%s", dirname, batch_name);
+
+    // The new version is built next to the old one, anonymously when possible
+    int is_anonymous = 1;
+    int batch_fd = open(dirname, O_TMPFILE | O_RDWR, 0777);
+    if (batch_fd == -1)
+    {
+        is_anonymous = 0;
+        batch_fd = open(batch_path, O_RDWR | O_CREAT | O_TRUNC, 0777);
+    }
+    FILE *out = batch_fd != -1 ? fdopen(batch_fd, "w") : NULL;
+    if (out == NULL)
+    {
+        perror("Error opening batch file");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(out, NULL, _IOFBF, 64 * 1024);
+
+    stored_file_t stored;
+    struct stat st, lock_st;
+    int has_file = storage_open(&stored, dirname, file_path) == 0;
+    // Writes in place that got past the semaphore end before the old version is read, and the ones
+    // after them find the new version, see open_locked. A manifest is never written in place.
+    int lock_fd = -1;
+    while (has_file && !stored.is_manifest)
+    {
+        lock_fd = open_locked(file_path);
+        if (lock_fd == -1 || (fstat(lock_fd, &lock_st) == 0 && fstat(stored.fd, &st) == 0 &&
+                              lock_st.st_ino == st.st_ino && lock_st.st_dev == st.st_dev))
+            break;
+        close(lock_fd);
+        lock_fd = -1;
+        storage_close(&stored);
+        has_file = storage_open(&stored, dirname, file_path) == 0;
+    }
+    if (has_file && fstat(stored.fd, &st) == 0)
+        fchmod(batch_fd, st.st_mode & 0777);
+    long long next = 0, line_number = 1;
+    int at_line_start = 1;
+    char chunk[64 * 1024];
+    ssize_t bytes_read;
+    while (has_file && (bytes_read = storage_read(&stored, chunk, sizeof(chunk))) > 0)
+    {
+        char *p = chunk, *end = chunk + bytes_read;
+        while (p < end)
+        {
+            for (; at_line_start && next < count && edits[next].line == line_number; next++)
+            {
+                fwrite(data + edits[next].offset, 1, edits[next].length, out);
+                fputc('\n', out);
+            }
+            at_line_start = 0;
+            char *newline = memchr(p, '\n', end - p);
+            if (newline == NULL)
+            {
+                fwrite(p, 1, end - p, out);
+                break;
+            }
+            fwrite(p, 1, newline + 1 - p, out);
+            line_number++;
+            at_line_start = 1;
+            p = newline + 1;
+        }
+    }
+    if (has_file)
+        storage_close(&stored);
+    // Whatever names a line past the end follows the last one
+    if (next < count && !at_line_start)
+        fputc('\n', out);
+    for (; next < count; next++)
+    {
+        fwrite(data + edits[next].offset, 1, edits[next].length, out);
+        fputc('\n', out);
+    }
+    *lines = line_number - 1;
+
+    // Acknowledged edits must survive a crash like journaled ones do
+    int status = fflush(out) == 0 && !ferror(out) && fdatasync(batch_fd) == 0 ? 0 : -1;
+    if (status == 0 && is_anonymous && link_temp_file(batch_fd, batch_path) == -1)
+        status = -1;
+    if (status == 0)
+    {
+        // The version being replaced gives its chunks back once it is gone, unless it is kept
+        int old_fd = open(file_path, O_RDONLY);
+        if (config.versions > 0 && version_save(dirname, file, config.versions) == -1)
+            status = -1;
+        if (status == 0)
+            status = rename(batch_path, file_path);
+        if (status == 0)
+            meta_changed(metas, file);
+        if (status == 0 && old_fd != -1)
+            storage_release(dirname, old_fd);
+        if (old_fd != -1)
+            close(old_fd);
+    }
+    if (status == -1)
+    {
+        perror("Error replacing file");
+        unlink(batch_path);
+    }
+    fclose(out);
+    if (lock_fd != -1)
+        close(lock_fd);
+    return status;
+}
+
+/*
+ Takes one of the queue->limit serving slots. Newcomers only get one while
+ nobody is queued so admission stays first come first served, a client
+ already in the queue passes is_waiting to skip that check.
+*/
+int admission_acquire(int is_waiting)
+{
+    int active = __atomic_load_n(&queue->active, __ATOMIC_ACQUIRE);
+    while (active < __atomic_load_n(&queue->limit, __ATOMIC_ACQUIRE))
+    {
+        if (!is_waiting && admission_waiting(queue) > 0)
+            return 0;
+        if (__atomic_compare_exchange_n(&queue->active, &active, active + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ Hands our slot straight to the head of the queue, or frees it when
+ nobody waits or the limit came down below what is served. Runs at exit
+ of every child that was admitted.
+*/
+void admission_release()
+{
+    if (__atomic_load_n(&queue->active, __ATOMIC_ACQUIRE) <= __atomic_load_n(&queue->limit, __ATOMIC_ACQUIRE) &&
+        admission_handoff() == 1)
+        return;
+    __atomic_sub_fetch(&queue->active, 1, __ATOMIC_ACQ_REL);
+    // Somebody may have queued up after we looked, take the slot back for them
+    if (admission_waiting(queue) > 0 && admission_acquire(1))
+        admission_pass();
+}
+
+// Hands a slot just taken for the queue on, returns 0 when it had to give it back instead
+int admission_pass()
+{
+    int status = admission_handoff();
+    if (status == 0)
+        admission_release();
+    else if (status == -1)
+        __atomic_sub_fetch(&queue->active, 1, __ATOMIC_ACQ_REL);
+    return status == 1;
+}
+
+/*
+ Passes a slot we hold to the next client in the queue by waking the child
+ that queued it. Returns 1 when it did, 0 if nobody is waiting and -1 when
+ the head of the queue is an enqueue that never finished, its client died
+ half way; the slot stays with the caller then.
+*/
+int admission_handoff()
+{
+    client_info_t next;
+    int spins = 0;
+    while (admission_waiting(queue) > 0)
+    {
+        if (admission_dequeue(queue, &next) == 0)
+        {
+            spins = 0;
+            if (admission_waiter_wake(queue, next.waiter))
+                return 1;
+            // Its child died while it waited, the next one gets the slot
+            continue;
+        }
+        // The enqueue is still in flight, the supervisor must not wait on it for ever
+        if (++spins > ADMISSION_HANDOFF_SPINS)
+            return -1;
+        sched_yield();
+    }
+    return 0;
+}
+
+// Gives the slot back once, whether the child exits or the supervisor finds it dead
+void admission_leave()
+{
+    worker_report_t *report = supervisor_self();
+    if (__atomic_exchange_n(&report->is_admitted, 0, __ATOMIC_ACQ_REL))
+        admission_release();
+}
+
+void engine_destroy()
+{
+    io_engine_destroy(&engine);
+}
+
+// A child that crashed never ran its exit handlers, what it held is given back for it
+void worker_exited(const worker_t *worker)
+{
+    worker_report_t *report = worker->report;
+    journal_abandon(journal, &report->journal_record);
+    int is_handed = report->waiter != -1 && admission_waiter_abandon(queue, report->waiter);
+    if (__atomic_exchange_n(&report->is_admitted, 0, __ATOMIC_ACQ_REL) || is_handed)
+        admission_release();
+}
+
+// Admits as many queued clients as a raised limit has room for
+void admission_fill()
+{
+    while (admission_waiting(queue) > 0 && admission_acquire(1))
+    {
+        if (!admission_pass())
+            break;
+    }
+}
+
+/*
+ Some avg10 of a pressure stall file, the share of the last ten seconds
+ in which some task waited for the resource, in percent. -1 when the
+ kernel does not tell.
+*/
+int read_pressure(const char *path)
+{
+    double some = -1;
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    if (fscanf(file, "some avg10=%lf", &some) != 1)
+        some = -1;
+    fclose(file);
+    return (int)some;
+}
+
+void run_indexer(void *arg)
+{
+    helper_args_t *args = arg;
+    index_run(args->dirname, args->log_fd);
+}
+
+void run_migrator(void *arg)
+{
+    helper_args_t *args = arg;
+    shard_migrate(args->dirname, args->log_fd, &signal_received);
+}
+
+void run_watcher(void *arg)
+{
+    helper_args_t *args = arg;
+    meta_run(metas, args->dirname, args->log_fd);
+}
+
+void run_tuner(void *arg)
+{
+    helper_args_t *args = arg;
+    admission_tune(args->log_fd);
+}
+
+/*
+ The tuner child: raises the limit while clients wait and neither the
+ CPU nor the disks are saturated, lowers it back towards limit_min when
+ either is. Without pressure stall information the load average stands
+ in for the CPU.
+*/
+void admission_tune(int log_fd)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec interval = {ADMISSION_TUNE_MS / 1000, (ADMISSION_TUNE_MS % 1000) * 1000000L};
+    while (!signal_received)
+    {
+        if (nanosleep(&interval, NULL) == -1 && signal_received)
+            break;
+        int cpu = read_pressure("/proc/pressure/cpu");
+        int io = read_pressure("/proc/pressure/io");
+        if (cpu == -1)
+        {
+            double load;
+            FILE *file = fopen("/proc/loadavg", "r");
+            if (file != NULL && fscanf(file, "%lf", &load) == 1 && cpus > 0)
+                cpu = (int)(load * 100 / cpus);
+            if (file != NULL)
+                fclose(file);
+        }
+        int pressure = cpu > io ? cpu : io;
+        int limit = __atomic_load_n(&queue->limit, __ATOMIC_ACQUIRE);
+        int limit_min = __atomic_load_n(&queue->limit_min, __ATOMIC_ACQUIRE);
+        int limit_max = __atomic_load_n(&queue->limit_max, __ATOMIC_ACQUIRE);
+        int waiting = admission_waiting(queue), next = limit;
+        if (pressure >= ADMISSION_BUSY_PRESSURE && limit > limit_min)
+            next = limit - 1;
+        // Grown by as many as wait, shrunk one at a time so a busy spell does not empty the server
+        else if (pressure < ADMISSION_IDLE_PRESSURE && waiting > 0 && limit < limit_max &&
+                 __atomic_load_n(&queue->active, __ATOMIC_ACQUIRE) >= limit)
+            next = limit + waiting < limit_max ? limit + waiting : limit_max;
+        if (next == limit || !__atomic_compare_exchange_n(&queue->limit, &limit, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            continue;
+        my_log(log_fd, ">> Limit %s to %d clients, %d%% pressure, %d waiting\n", next > limit ? "raised" : "lowered", next,
+               pressure, waiting);
+        if (next > limit)
+            admission_fill();
+    }
+}
+
+/*
+ Waits for the next command of a session. One that stays quiet is warned
+ and, once the idle timeout is up, told goodbye and ended so its slot
+ goes to whoever waits. Returns 0 when a command is coming, 1 when the
+ session timed out and -1 with errno set when a signal came first.
+*/
+int wait_command(channel_t *channel, long counter_id, int log_fd)
+{
+    struct timespec start, now;
+    response_t response;
+    int is_warned = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1)
+    {
+        int timeout = __atomic_load_n(&queue->idle_timeout, __ATOMIC_ACQUIRE);
+        long long wait_ms = SESSION_IDLE_POLL_MS;
+        if (timeout > 0)
+        {
+            long long warning_ms = (timeout / 2 < SESSION_IDLE_WARNING ? timeout / 2 : SESSION_IDLE_WARNING) * 1000LL;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long idle_ms = (now.tv_sec - start.tv_sec) * 1000LL + (now.tv_nsec - start.tv_nsec) / 1000000;
+            long long left_ms = timeout * 1000LL - idle_ms;
+            response.is_complete = 1;
+            if (left_ms <= 0)
+            {
+                response.is_exit = 1;
+                response.length = snprintf(response.content, sizeof(response.content),
+                                           "\nDisconnected after %d seconds without a command\n", timeout);
+                channel_send(channel, &response);
+                my_log(log_fd, "\nClient_%ld idle for %d seconds, disconnected..\n", counter_id, timeout);
+                return 1;
+            }
+            if (!is_warned && warning_ms > 0 && left_ms <= warning_ms)
+            {
+                response.is_exit = 0;
+                response.length = snprintf(response.content, sizeof(response.content),
+                                           "\nIdle for %lld seconds, disconnecting in %lld unless a command comes\n",
+                                           idle_ms / 1000, (left_ms + 999) / 1000);
+                channel_send(channel, &response);
+                is_warned = 1;
+            }
+            long long next_ms = is_warned || warning_ms == 0 ? left_ms : left_ms - warning_ms;
+            if (next_ms < wait_ms)
+                wait_ms = next_ms;
+        }
+        struct pollfd pfd = {channel->fd_read, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int)wait_ms);
+        if (ready == -1 && errno == EINTR)
+            return -1;
+        // Input, a hang up or a poll that failed all go to the read, which tells which it was
+        if (ready != 0)
+            return 0;
+    }
+}
+
+/*
+ Streams the requested lines of file from its current position in as few
+ frames as possible: lines line to last_line when a line is given, the
+ rest of the file otherwise. A single line or range goes out without its
+ final newline. The last frame is always marked complete, even when the
+ file ends on a chunk boundary. Returns -1 if the client can not be
+ reached. *lines is the number of lines of the file when they were all
+ counted on the way, -1 otherwise.
+*/
+int send_lines(stored_file_t *file, command_t *command, channel_t *channel, shaper_t *shaper, long long *lines)
+{
+    char chunk[CHUNK_SIZE];
+    response_t response;
+    ssize_t bytes_read;
+    int is_line_open = 0;
+    int is_line_requested = command->tail == 0 && command->line > 0;
+    int line_number = 1, is_done = is_line_requested && command->last_line != -1 && command->last_line < command->line;
+    response.length = 0;
+    response.is_complete = 0;
+    response.is_exit = 0;
+    while (!is_done && (bytes_read = storage_read(file, chunk, sizeof(chunk))) > 0)
+    {
+        char *p = chunk, *end = chunk + bytes_read;
+        while (p < end && !is_done)
+        {
+            // Line numbers carry over from one chunk to the next
+            char *newline = is_line_requested ? memchr(p, '\n', end - p) : NULL;
+            char *segment_end = newline != NULL ? newline + 1 : end;
+            int length = segment_end - p;
+            if (newline != NULL)
+            {
+                is_done = line_number == command->last_line;
+                if (is_done)
+                    length--;
+            }
+            if (!is_line_requested || line_number >= command->line)
+            {
+                shaper_throttle(shaper, TRAFFIC_INTERACTIVE, length);
+                if (channel_append(channel, &response, p, length) == -1)
+                    return -1;
+            }
+            if (newline != NULL)
+                line_number++;
+            is_line_open = newline == NULL;
+            p = segment_end;
+        }
+    }
+    *lines = is_line_requested && !is_done ? line_number - 1 + is_line_open : -1;
+    response.is_complete = 1;
+    return channel_send(channel, &response);
+}
+
+/*
+ Offset of the first of the last lines lines of file, scanning backwards
+ from the end. A newline ending the file closes the last line.
+*/
+off_t tail_offset(stored_file_t *file, int lines)
+{
+    char chunk[CHUNK_SIZE];
+    off_t pos = file->size;
+    int count = 0;
+    while (pos > 0)
+    {
+        size_t length = pos < (off_t)sizeof(chunk) ? (size_t)pos : sizeof(chunk);
+        pos -= length;
+        ssize_t bytes_read = storage_pread(file, chunk, length, pos);
+        if (bytes_read <= 0)
+            break;
+        ssize_t i;
+        for (i = bytes_read - 1; i >= 0; i--)
+        {
+            if (chunk[i] == '\n' && pos + i != file->size - 1 && ++count == lines)
+                return pos + i + 1;
+        }
+    }
+    return 0;
+}
+
+int send_match(const char *file, long long line, const char *text, size_t length, void *ctx)
+{
+    match_stream_t *stream = ctx;
+    char prefix[MAX_FILENAME_LENGTH + 32];
+    int prefix_length = snprintf(prefix, sizeof(prefix), "%s:%lld:", file, line);
+    shaper_throttle(stream->shaper, TRAFFIC_INTERACTIVE, prefix_length + length + 1);
+    if (channel_append(stream->channel, &stream->response, prefix, prefix_length) == -1 ||
+        channel_append(stream->channel, &stream->response, text, length) == -1 ||
+        channel_append(stream->channel, &stream->response, "\n", 1) == -1)
+        return -1;
+    return 0;
+}
+
+/*
+ readF -f: waits for the file to change and sends the complete lines
+ appended since the last look, until the client sends anything back.
+ The file lock is only taken while reading. Returns -1 when a signal
+ ended the session.
+*/
+int handle_follow(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, int log_fd)
+{
+    response_t response;
+    response.is_exit = 0;
+    response.is_complete = 1;
+
+    // Watch the directory before looking at the size so no append slips between the two,
+    // a file replaced by rename keeps its name but not its inode. With shards the file
+    // is in its shard, or still in the directory until it is moved there.
+    char watch_dir[MAX_PATH_LENGTH];
+    shard_dir(dirname, command->file, watch_dir, sizeof(watch_dir));
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == -1 ||
+        inotify_add_watch(inotify_fd, watch_dir, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1 ||
+        (shard_is_enabled() &&
+         inotify_add_watch(inotify_fd, dirname, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1))
+    {
+        perror("inotify");
+        if (inotify_fd != -1)
+            close(inotify_fd);
+        response.length = snprintf(response.content, sizeof(response.content), "Can not follow the file\n");
+        channel_send(channel, &response);
+        return 0;
+    }
+
+    // Start at the current end, only lines appended from now on are sent
+    char file_path[MAX_PATH_LENGTH];
+    int shard_fd = shard_lock(dirname, command->file);
+    shard_path(dirname, command->file, file_path, sizeof(file_path));
+    stored_file_t file;
+    int open_status = storage_open(&file, dirname, file_path);
+    shard_unlock(shard_fd);
+    if (open_status == -1)
+    {
+        close(inotify_fd);
+        response.length = snprintf(response.content, sizeof(response.content), "There is no such a file\n");
+        channel_send(channel, &response);
+        return 0;
+    }
+    long long offset = file.size;
+    storage_close(&file);
+    my_log(log_fd, "Following '%s' from byte %lld\n", command->file, offset);
+
+    int status = 0;
+    while (1)
+    {
+        struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {channel->fd_read, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                status = -1;
+            else
+                perror("poll");
+            break;
+        }
+        // Anything from the client ends the stream
+        if (fds[1].revents != 0)
+        {
+            command_t cancel;
+            if (channel_read(channel, &cancel, sizeof(cancel)) == -1)
+                status = errno == EINTR ? -1 : 0;
+            break;
+        }
+        if (!is_followed_event(inotify_fd, command->file))
+            continue;
+        if ((offset = follow_send(command, channel, shaper, dirname, offset)) == -1)
+        {
+            status = errno == EINTR ? -1 : 0;
+            break;
+        }
+    }
+    close(inotify_fd);
+    my_log(log_fd, "Stopped following '%s'\n", command->file);
+    if (status == 0)
+    {
+        response.length = 0;
+        channel_send(channel, &response);
+    }
+    return status;
+}
+
+// Drains the pending events, returns 1 if one of them was about file
+int is_followed_event(int inotify_fd, const char *file)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(inotify_fd, events, sizeof(events));
+    int is_followed = 0;
+    char *p;
+    for (p = events; length > 0 && p < events + length;)
+    {
+        struct inotify_event *event = (struct inotify_event *)p;
+        if (event->len > 0 && strcmp(event->name, file) == 0)
+            is_followed = 1;
+        p += sizeof(struct inotify_event) + event->len;
+    }
+    return is_followed;
+}
+
+/*
+ Sends whole lines from offset to the end of the file, a line still being
+ written is held back for the next event. Returns the new offset, or -1
+ when the client can not be reached.
+*/
+long long follow_send(command_t *command, channel_t *channel, shaper_t *shaper, char *dirname, long long offset)
+{
+    char file_path[MAX_PATH_LENGTH], file_sem_name[FILE_SEM_NAME_LEN];
+    int shard_fd = shard_lock(dirname, command->file);
+    shard_path(dirname, command->file, file_path, sizeof(file_path));
+    snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, command->file);
+    sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+    if (sem_file == SEM_FAILED)
+    {
+        perror("sem_open");
         exit(EXIT_FAILURE);
     }
-    if (sem_close(client_connection_sem) == -1)
+    sem_wait(sem_file);
+    stored_file_t file;
+    int send_errno = 0;
+    int open_status = storage_open(&file, dirname, file_path);
+    shard_unlock(shard_fd);
+    if (open_status == 0)
+    {
+        // Truncated or rewritten shorter, start over like tail -f
+        if (file.size < offset)
+            offset = 0;
+        storage_seek(&file, offset);
+        response_t response;
+        response.is_complete = 0;
+        response.is_exit = 0;
+        while (offset < file.size)
+        {
+            ssize_t bytes_read = storage_read(&file, response.content, sizeof(response.content));
+            if (bytes_read <= 0)
+                break;
+            ssize_t length = bytes_read;
+            if (offset + bytes_read >= file.size)
+            {
+                while (length > 0 && response.content[length - 1] != '\n')
+                    length--;
+            }
+            if (length == 0)
+                break;
+            shaper_throttle(shaper, TRAFFIC_INTERACTIVE, length);
+            response.length = length;
+            if (channel_send(channel, &response) == -1)
+            {
+                send_errno = errno;
+                offset = -1;
+                break;
+            }
+            offset += length;
+            if (length < bytes_read)
+                break;
+        }
+        storage_close(&file);
+    }
+    sem_post(sem_file);
+    sem_close(sem_file);
+    sem_unlink(file_sem_name);
+    errno = send_errno;
+    return offset;
+}
+
+int write_full(int fd, const void *buf, size_t length)
+{
+    const char *p = buf;
+    while (length > 0)
+    {
+        ssize_t bytes_written = write(fd, p, length);
+        if (bytes_written == -1)
+            return -1;
+        p += bytes_written;
+        length -= bytes_written;
+    }
+    return 0;
+}
+
+/*
+ Reserves the rest of an upload up front so large files land in few extents.
+ The length comes from the client, so at most half of the free space is taken.
+*/
+void preallocate(int fd, off_t offset, long long length)
+{
+    struct statvfs vfs;
+    if (fstatvfs(fd, &vfs) == -1)
+        return;
+    long long available = (long long)vfs.f_bavail * (long long)vfs.f_frsize;
+    if (length > available / 2)
+        length = available / 2;
+    if (length > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) == -1 && errno != EOPNOTSUPP &&
+        errno != ENOSYS)
+        perror("fallocate");
+}
+
+// Moves a finished upload into place, failing with EEXIST instead of
+// replacing a file that appeared in the meantime
+int publish_file(const char *src_path, const char *dest_path)
+{
+    if (renameat2(AT_FDCWD, src_path, AT_FDCWD, dest_path, RENAME_NOREPLACE) == 0)
+        return 0;
+    if (errno != EINVAL && errno != ENOSYS)
+        return -1;
+    // Filesystems without RENAME_NOREPLACE still refuse to link over a file
+    if (link(src_path, dest_path) == -1)
+        return -1;
+    unlink(src_path);
+    return 0;
+}
+
+// Gives a file opened with O_TMPFILE a name
+int link_temp_file(int fd, const char *path)
+{
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    return linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW);
+}
+
+/*
+ Opens path for writing with flock held. A writer that replaced the file
+ while this one waited leaves the lock on the inode it took away, so the
+ lock only counts once it is on the file that is there now.
+*/
+int open_locked(const char *path)
+{
+    struct stat st, path_st;
+    while (1)
+    {
+        int fd = open(path, O_RDWR | O_CREAT, 0777);
+        if (fd == -1)
+            return -1;
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &st) == 0 && stat(path, &path_st) == 0 && st.st_ino == path_st.st_ino &&
+            st.st_dev == path_st.st_dev)
+            return fd;
+        close(fd);
+    }
+}
+
+/*
+ Writes length bytes of data at offset of file, whose contents fd holds
+ under the lock. Normally the write goes through the journal into fd.
+ With -V, or while a download or readF has fd open, a clone of fd takes
+ the write and replaces file instead, so fd stays as it was, with -V as
+ the newest kept version, and its readers are not disturbed; the rename
+ is what makes the change atomic then.
+*/
+int write_file(const char *dirname, const char *file, int fd, off_t offset, const void *data, size_t length)
+{
+    char path[MAX_PATH_LENGTH], temp_name[VERSION_TEMP_NAME_LEN], temp_path[MAX_PATH_LENGTH];
+    struct stat st;
+    // The cached size and time of the file go once it has changed, whichever way it did
+    if (config.versions <= 0 && !storage_has_readers(fd))
+    {
+        int journal_status = journal_write(journal, file, fd, offset, data, length,
+                                           &supervisor_self()->journal_record);
+        meta_changed(metas, file);
+        return journal_status;
+    }
+    if (fstat(fd, &st) == -1)
+        return -1;
+    shard_path(dirname, file, path, sizeof(path));
+    snprintf(temp_name, sizeof(temp_name), VERSION_TEMP_TEMPLATE, file, (long)getpid());
+    snprintf(temp_path, sizeof(temp_path), "%s/%s", dirname, temp_name);
+    int has_name = 0;
+    int copy_fd = open(dirname, O_TMPFILE | O_RDWR, 0777);
+    if (copy_fd == -1)
+    {
+        has_name = 1;
+        copy_fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC, 0777);
+        if (copy_fd == -1)
+            return -1;
+    }
+
+    int status = version_clone(fd, copy_fd, st.st_size);
+    const char *p = data;
+    size_t left = length;
+    while (status == 0 && left > 0)
+    {
+        ssize_t bytes_written = pwrite(copy_fd, p, left, offset);
+        if (bytes_written == -1)
+            status = -1;
+        else
+        {
+            p += bytes_written;
+            left -= bytes_written;
+            offset += bytes_written;
+        }
+    }
+    if (status == 0 && (fchmod(copy_fd, st.st_mode & 0777) == -1 || fdatasync(copy_fd) == -1))
+        status = -1;
+    // rename needs a name to move over the original
+    if (status == 0 && !has_name)
+    {
+        if (link_temp_file(copy_fd, temp_path) == -1)
+            status = -1;
+        else
+            has_name = 1;
+    }
+    if (status == 0 && ((config.versions > 0 && version_save(dirname, file, config.versions) == -1) ||
+                        rename(temp_path, path) == -1))
+        status = -1;
+    int write_errno = errno;
+    if (status == -1 && has_name)
+        unlink(temp_path);
+    close(copy_fd);
+    meta_changed(metas, file);
+    errno = write_errno;
+    return status;
+}
+
+// Hidden file an upload is written to, a name too long to carry whole goes by its hash
+void part_file_name(char *part_name, size_t size, const char *file, unsigned long long transfer_id)
+{
+    int length = snprintf(part_name, size, PART_FILE_TEMPLATE, file, transfer_id);
+    if (length > NAME_MAX)
+        snprintf(part_name, size, PART_FILE_HASHED_TEMPLATE, (unsigned long long)hash64(file, strlen(file), 0),
+                 transfer_id);
+}
+
+// Removes uploads nobody came back to resume and delta files a crash left behind
+void sweep_part_files(char *dirname, int log_fd)
+{
+    DIR *dir;
+    struct dirent *ent;
+    struct stat st;
+    char path[MAX_PATH_LENGTH];
+    time_t now = time(NULL);
+    int removed = 0;
+    if ((dir = opendir(dirname)) == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(ent->d_name);
+        if (ent->d_type != DT_REG || ent->d_name[0] != '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dirname, ent->d_name);
+        if ((length > 6 && strcmp(ent->d_name + length - 6, ".delta") == 0) ||
+            (length > 6 && strcmp(ent->d_name + length - 6, ".batch") == 0) ||
+            (length > 4 && strcmp(ent->d_name + length - 4, ".cow") == 0))
+        {
+            unlink(path);
+            removed++;
+        }
+        else if (length > 5 && strcmp(ent->d_name + length - 5, ".part") == 0 && stat(path, &st) == 0 &&
+                 now - st.st_mtime > PART_FILE_MAX_AGE)
+        {
+            unlink(path);
+            removed++;
+        }
+    }
+    closedir(dir);
+    if (removed > 0)
+        my_log(log_fd, ">> Removed %d abandoned upload files\n", removed);
+}
+
+void clean_up(int client_fifo_fd_read, int client_fifo_fd_write, sem_t *client_connection_sem)
+{
+    close(client_fifo_fd_read);
+    close(client_fifo_fd_write);
+    if (client_connection_sem != NULL && sem_close(client_connection_sem) == -1)
     {
         perror("sem_close");
         exit(EXIT_FAILURE);
@@ -0,0 +1,197 @@
+#include "../include/append.h"
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+append_table_t *append_table_init()
+{
+    append_table_t *table = mmap(NULL, sizeof(append_table_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+    {
+        perror("Error mapping shared memory");
+        exit(EXIT_FAILURE);
+    }
+    memset(table, 0, sizeof(*table));
+    // A child killed while holding the lock must not take the others with it
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&table->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&table->changed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    return table;
+}
+
+static void table_lock(append_table_t *table)
+{
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&table->lock);
+}
+
+static int table_wait(append_table_t *table, int ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    int status = pthread_cond_timedwait(&table->changed, &table->lock, &deadline);
+    if (status == EOWNERDEAD)
+        pthread_mutex_consistent(&table->lock);
+    return status;
+}
+
+static append_slot_t *find_slot(append_table_t *table, const char *file)
+{
+    append_slot_t *free_slot = NULL;
+    int i;
+    for (i = 0; i < APPEND_SLOTS; i++)
+    {
+        append_slot_t *slot = &table->slots[i];
+        if (strcmp(slot->file, file) == 0)
+            return slot;
+        if (free_slot == NULL && slot->file[0] == '\0')
+            free_slot = slot;
+    }
+    if (free_slot != NULL)
+    {
+        memset(free_slot, 0, offsetof(append_slot_t, buffer));
+        strcpy(free_slot->file, file);
+    }
+    return free_slot;
+}
+
+// Tells every append in (from, to] that its flush failed with error
+static void fail_waiters(append_slot_t *slot, uint64_t from, uint64_t to, int error)
+{
+    int i;
+    for (i = 0; i < APPEND_WAITERS; i++)
+    {
+        if (slot->waiters[i].mark > from && slot->waiters[i].mark <= to)
+            slot->waiters[i].error = error;
+    }
+}
+
+/*
+ Called with the lock held. Gives others a moment to add their lines,
+ then writes everything gathered so far with the lock released.
+*/
+static void flush_slot(append_table_t *table, append_slot_t *slot, append_flush_fn flush, void *ctx)
+{
+    slot->flushing = 1;
+    slot->flusher = getpid();
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (slot->length < APPEND_FLUSH_BYTES)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited_ms = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited_ms >= APPEND_FLUSH_MS || table_wait(table, APPEND_FLUSH_MS - waited_ms) == ETIMEDOUT)
+            break;
+    }
+
+    size_t length = slot->length;
+    char *data = malloc(length);
+    if (data == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(data, slot->buffer, length);
+    slot->length = 0;
+    slot->flush_target = slot->appended;
+    uint64_t from = slot->flushed;
+    char file[MAX_FILENAME_LENGTH];
+    strcpy(file, slot->file);
+    pthread_mutex_unlock(&table->lock);
+    int status = length > 0 ? flush(file, data, length, ctx) : 0;
+    int flush_errno = errno;
+    free(data);
+    table_lock(table);
+    if (status == -1)
+        fail_waiters(slot, from, slot->flush_target, flush_errno);
+    slot->flushed = slot->flush_target;
+    slot->flushing = 0;
+    pthread_cond_broadcast(&table->changed);
+}
+
+// The lines a dead flusher took with it are reported as lost
+static void check_flusher(append_slot_t *slot)
+{
+    if (!slot->flushing || kill(slot->flusher, 0) == 0 || errno != ESRCH)
+        return;
+    fail_waiters(slot, slot->flushed, slot->flush_target, EIO);
+    slot->flushed = slot->flush_target;
+    slot->flushing = 0;
+}
+
+int append_submit(append_table_t *table, const char *file, const char *data, size_t length, append_flush_fn flush,
+                  void *ctx)
+{
+    if (length > APPEND_BUFFER_SIZE || strlen(file) >= MAX_FILENAME_LENGTH)
+        return 1;
+    table_lock(table);
+    append_slot_t *slot = find_slot(table, file);
+    append_waiter_t *waiter = NULL;
+    int i;
+    for (i = 0; slot != NULL && i < APPEND_WAITERS && waiter == NULL; i++)
+    {
+        if (slot->waiters[i].mark == 0)
+            waiter = &slot->waiters[i];
+    }
+    if (waiter == NULL)
+    {
+        if (slot != NULL && slot->users == 0 && slot->length == 0 && !slot->flushing)
+            slot->file[0] = '\0';
+        pthread_mutex_unlock(&table->lock);
+        return 1;
+    }
+    waiter->mark = UINT64_MAX; // taken, the real mark comes once the data is in
+    slot->users++;
+
+    // Make room by flushing what is there, or wait for the flush under way
+    while (slot->length + length > APPEND_BUFFER_SIZE)
+    {
+        if (!slot->flushing)
+            flush_slot(table, slot, flush, ctx);
+        else if (table_wait(table, APPEND_FLUSHER_TIMEOUT_MS) == ETIMEDOUT)
+            check_flusher(slot);
+    }
+    memcpy(slot->buffer + slot->length, data, length);
+    slot->length += length;
+    slot->appended += length;
+    uint64_t mark = slot->appended;
+    waiter->mark = mark;
+    waiter->error = 0;
+    pthread_cond_broadcast(&table->changed);
+
+    while (slot->flushed < mark)
+    {
+        if (!slot->flushing)
+            flush_slot(table, slot, flush, ctx);
+        else if (table_wait(table, APPEND_FLUSHER_TIMEOUT_MS) == ETIMEDOUT)
+            check_flusher(slot);
+    }
+    int error = waiter->error;
+    waiter->mark = 0;
+    // The last one out frees the slot for other files
+    if (--slot->users == 0 && slot->length == 0 && !slot->flushing)
+        slot->file[0] = '\0';
+    pthread_mutex_unlock(&table->lock);
+    errno = error;
+    return error != 0 ? -1 : 0;
+}
@@ -0,0 +1,275 @@
+#include "../include/channel.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t bytes_written = write(fd, p, len);
+        if (bytes_written == -1)
+            return -1;
+        p += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+// MSG_MORE holds a header back until its payload follows
+static int send_more(channel_t *channel, const void *buf, size_t len)
+{
+    const char *p = buf;
+    if (!channel->is_stream)
+        return write_full(channel->fd_write, buf, len);
+    while (len > 0)
+    {
+        ssize_t bytes_sent = send(channel->fd_write, p, len, MSG_MORE);
+        if (bytes_sent == -1)
+            return -1;
+        p += bytes_sent;
+        len -= bytes_sent;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    while (len > 0)
+    {
+        ssize_t bytes_read = read(fd, p, len);
+        if (bytes_read == -1)
+            return -1;
+        if (bytes_read == 0)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        p += bytes_read;
+        len -= bytes_read;
+    }
+    return 0;
+}
+
+void channel_init(channel_t *channel, int fd_read, int fd_write, sem_t *sem, int is_server, compression_t compression)
+{
+    memset(channel, 0, sizeof(*channel));
+    channel->fd_read = fd_read;
+    channel->fd_write = fd_write;
+    channel->sem = sem;
+    channel->is_server = is_server;
+    channel->compression = compression;
+    int type;
+    socklen_t type_length = sizeof(type);
+    channel->is_stream = getsockopt(fd_write, SOL_SOCKET, SO_TYPE, &type, &type_length) == 0 && type == SOCK_STREAM;
+}
+
+void channel_destroy(channel_t *channel)
+{
+    if (channel->deflater_ready)
+        deflateEnd(&channel->deflater);
+    if (channel->inflater_ready)
+        inflateEnd(&channel->inflater);
+    channel->deflater_ready = 0;
+    channel->inflater_ready = 0;
+}
+
+/*
+ Compresses content into out with a sync flush so the frame can be
+ decoded on its own given the frames before it in the same stream.
+ Returns the compressed length, or -1 when it would not be smaller.
+*/
+static int channel_compress(channel_t *channel, const char *content, int length, char *out, int out_size, int *flags)
+{
+    if (!channel->deflater_ready)
+    {
+        if (deflateInit2(&channel->deflater, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        channel->deflater_ready = 1;
+    }
+    if (!channel->stream_open)
+    {
+        deflateReset(&channel->deflater);
+        *flags |= FRAME_RESET;
+    }
+    channel->deflater.next_in = (Bytef *)content;
+    channel->deflater.avail_in = length;
+    channel->deflater.next_out = (Bytef *)out;
+    channel->deflater.avail_out = out_size;
+    if (deflate(&channel->deflater, Z_SYNC_FLUSH) != Z_OK || channel->deflater.avail_in != 0 ||
+        channel->deflater.avail_out == 0)
+    {
+        channel->stream_open = 0;
+        return -1;
+    }
+    int compressed_length = out_size - channel->deflater.avail_out;
+    // Not worth it, leave the stream and back off for a while
+    if (compressed_length >= length - length / 16)
+    {
+        channel->stream_open = 0;
+        channel->skip_frames = COMPRESSION_BACKOFF_FRAMES;
+        return -1;
+    }
+    channel->stream_open = 1;
+    return compressed_length;
+}
+
+int channel_send(channel_t *channel, response_t *response)
+{
+    char payload[CHUNK_SIZE + 64];
+    frame_header_t header;
+    const char *data = response->content;
+    header.length = response->length;
+    header.raw_length = response->length;
+    header.flags = (response->is_complete ? FRAME_COMPLETE : 0) | (response->is_exit ? FRAME_EXIT : 0);
+    header.checksum = crc32c(0, response->content, response->length);
+
+    if (channel->compression == COMPRESSION_ZLIB && response->length >= COMPRESSION_MIN_LENGTH)
+    {
+        if (channel->skip_frames > 0)
+            channel->skip_frames--;
+        else
+        {
+            int flags = FRAME_COMPRESSED;
+            int compressed_length = channel_compress(channel, response->content, response->length,
+                                                     payload, sizeof(payload), &flags);
+            if (compressed_length != -1)
+            {
+                header.length = compressed_length;
+                header.flags |= flags;
+                data = payload;
+            }
+        }
+    }
+    if (!(header.flags & FRAME_COMPRESSED))
+        channel->stream_open = 0;
+    // A finished transfer starts the next one with a fresh stream
+    if (response->is_complete)
+    {
+        channel->stream_open = 0;
+        channel->skip_frames = 0;
+    }
+
+    if (send_more(channel, &header, sizeof(header)) == -1)
+        return -1;
+    if (write_full(channel->fd_write, data, header.length) == -1)
+        return -1;
+    if (channel->bytes_sent != NULL)
+        *channel->bytes_sent += sizeof(header) + header.length;
+    if (channel->is_server && channel->sem != NULL)
+        sem_post(channel->sem);
+    return 0;
+}
+
+int channel_append(channel_t *channel, response_t *response, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        size_t room = sizeof(response->content) - response->length;
+        size_t length = len < room ? len : room;
+        memcpy(response->content + response->length, p, length);
+        response->length += length;
+        p += length;
+        len -= length;
+        if (response->length == (int)sizeof(response->content))
+        {
+            if (channel_send(channel, response) == -1)
+                return -1;
+            response->length = 0;
+        }
+    }
+    return 0;
+}
+
+// The whole frame has been consumed either way, so the stream stays in step
+static int channel_verify(response_t *response, frame_header_t *header)
+{
+    if (crc32c(0, response->content, response->length) != header->checksum)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+int channel_recv(channel_t *channel, response_t *response)
+{
+    char payload[CHUNK_SIZE + 64];
+    frame_header_t header;
+    if (!channel->is_server && channel->sem != NULL)
+        sem_wait(channel->sem);
+    if (read_full(channel->fd_read, &header, sizeof(header)) == -1)
+        return -1;
+    if (header.length < 0 || header.length > (int)sizeof(payload) || header.raw_length < 0 ||
+        header.raw_length > CHUNK_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (read_full(channel->fd_read, payload, header.length) == -1)
+        return -1;
+    if (channel->bytes_received != NULL)
+        *channel->bytes_received += sizeof(header) + header.length;
+
+    response->is_complete = (header.flags & FRAME_COMPLETE) != 0;
+    response->is_exit = (header.flags & FRAME_EXIT) != 0;
+    response->length = header.raw_length;
+    if (!(header.flags & FRAME_COMPRESSED))
+    {
+        memcpy(response->content, payload, header.length);
+        return channel_verify(response, &header);
+    }
+
+    if (!channel->inflater_ready)
+    {
+        if (inflateInit2(&channel->inflater, -15) != Z_OK)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        channel->inflater_ready = 1;
+    }
+    if (header.flags & FRAME_RESET)
+        inflateReset(&channel->inflater);
+    // Leave room past raw_length so the trailing sync marker is consumed too
+    char raw[CHUNK_SIZE + 64];
+    channel->inflater.next_in = (Bytef *)payload;
+    channel->inflater.avail_in = header.length;
+    channel->inflater.next_out = (Bytef *)raw;
+    channel->inflater.avail_out = sizeof(raw);
+    int status = inflate(&channel->inflater, Z_SYNC_FLUSH);
+    if ((status != Z_OK && status != Z_BUF_ERROR) || channel->inflater.avail_in != 0 ||
+        sizeof(raw) - channel->inflater.avail_out != (size_t)header.raw_length)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(response->content, raw, header.raw_length);
+    return channel_verify(response, &header);
+}
+
+int channel_write(channel_t *channel, const void *buf, size_t len)
+{
+    if (write_full(channel->fd_write, buf, len) == -1)
+        return -1;
+    if (channel->bytes_sent != NULL)
+        *channel->bytes_sent += len;
+    if (channel->is_server && channel->sem != NULL)
+        sem_post(channel->sem);
+    return 0;
+}
+
+int channel_read(channel_t *channel, void *buf, size_t len)
+{
+    if (!channel->is_server && channel->sem != NULL)
+        sem_wait(channel->sem);
+    if (read_full(channel->fd_read, buf, len) == -1)
+        return -1;
+    if (channel->bytes_received != NULL)
+        *channel->bytes_received += len;
+    return 0;
+}
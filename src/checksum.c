@@ -0,0 +1,216 @@
+#include "../include/checksum.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_BUFFER_SIZE (64 * 1024)
+
+static uint32_t crc32c_table[8][256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *p, size_t len) = NULL;
+
+static void crc32c_init_table()
+{
+    uint32_t i, j, crc;
+    for (i = 0; i < 256; i++)
+    {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++)
+    {
+        for (j = 1; j < 8; j++)
+            crc32c_table[j][i] = crc32c_table[0][crc32c_table[j - 1][i] & 0xFF] ^ (crc32c_table[j - 1][i] >> 8);
+    }
+}
+
+/*
+ Slicing-by-8, eight table lookups per 8 bytes for CPUs without a crc32
+ instruction. crc is the raw register value, not the finalized checksum.
+*/
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^ crc32c_table[5][(lo >> 16) & 0xFF] ^
+              crc32c_table[4][lo >> 24] ^ crc32c_table[3][hi & 0xFF] ^ crc32c_table[2][(hi >> 8) & 0xFF] ^
+              crc32c_table[1][(hi >> 16) & 0xFF] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ SSE4.2 has a crc32 instruction for exactly this polynomial, eight bytes
+ a cycle once the loop is running.
+*/
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+    uint64_t crc64;
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+static void crc32c_select()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_impl = crc32c_hw;
+        return;
+    }
+#endif
+    crc32c_init_table();
+    crc32c_impl = crc32c_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    if (crc32c_impl == NULL)
+        crc32c_select();
+    return ~crc32c_impl(~crc, buf, len);
+}
+
+uint32_t crc32c_file_range(int fd, off_t start, off_t end)
+{
+    char chunk[CRC32C_BUFFER_SIZE];
+    uint32_t crc = 0;
+    while (start < end)
+    {
+        size_t want = sizeof(chunk);
+        if ((off_t)want > end - start)
+            want = end - start;
+        ssize_t bytes_read = pread(fd, chunk, want, start);
+        if (bytes_read <= 0)
+            break;
+        crc = crc32c(crc, chunk, bytes_read);
+        start += bytes_read;
+    }
+    return crc;
+}
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash64(const void *buf, size_t len, uint64_t seed)
+{
+    const unsigned char *p = buf;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        do
+        {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    }
+    else
+        h = seed + PRIME64_5;
+
+    h += len;
+    while (p + 8 <= end)
+    {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end)
+    {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= (*p++) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+off_t resume_window_start(off_t offset)
+{
+    return offset > RESUME_VERIFY_WINDOW ? offset - RESUME_VERIFY_WINDOW : 0;
+}
@@ -5,7 +5,7 @@ int parse_command(char *input_str, command_t *command)
     char cmd_type_str[MAX_COMMAND_TYPE_LENGTH];
     char cmd_sub_type_str[MAX_COMMAND_TYPE_LENGTH];
     char file[MAX_FILENAME_LENGTH];
-    int line;
+    int line, last_line;
     char string[MAX_WRITE_STRING_LENGTH];
 
     init_command(command);
@@ -30,15 +30,47 @@ int parse_command(char *input_str, command_t *command)
     else if (strcmp(cmd_type_str, "list") == 0)
     {
         command->type = LIST;
+        // list <file> shows the versions kept of it
+        if (sscanf(input_str, "%s %s", cmd_type_str, file) == 2)
+            strcpy(command->file, file);
         return 0;
     }
     else if (strcmp(cmd_type_str, "readF") == 0)
     {
         command->type = READF;
-        if (sscanf(input_str, "%s %s %d", cmd_type_str, file, &line) == 3)
+        if (sscanf(input_str, "%s -f %s", cmd_type_str, file) == 2)
+        {
+            strcpy(command->file, file);
+            command->follow = 1;
+            return 0;
+        }
+        else if (sscanf(input_str, "%s -n %d %s", cmd_type_str, &line, file) == 3 && line >= 0)
+        {
+            strcpy(command->file, file);
+            command->line = 1;
+            command->last_line = line;
+            return 0;
+        }
+        else if (sscanf(input_str, "%s -t %d %s", cmd_type_str, &line, file) == 3 && line > 0)
+        {
+            strcpy(command->file, file);
+            command->tail = line;
+            return 0;
+        }
+        else if (sscanf(input_str, "%s %s %d-%d", cmd_type_str, file, &line, &last_line) == 4)
+        {
+            if (line < 1 || last_line < line)
+                return -1;
+            strcpy(command->file, file);
+            command->line = line;
+            command->last_line = last_line;
+            return 0;
+        }
+        else if (sscanf(input_str, "%s %s %d", cmd_type_str, file, &line) == 3)
         {
             strcpy(command->file, file);
             command->line = line;
+            command->last_line = line;
             return 0;
         }
         else if (sscanf(input_str, "%s %s", cmd_type_str, file) == 2)
@@ -55,7 +87,14 @@ int parse_command(char *input_str, command_t *command)
     else if (strcmp(cmd_type_str, "writeT") == 0)
     {
         command->type = WRITET;
-        if (sscanf(input_str, "%s %s %d %[^\n]", cmd_type_str, file, &line, string) == 4)
+        if (sscanf(input_str, "%s -b %s %255s", cmd_type_str, file, string) == 3)
+        {
+            command->type = BATCH_WRITE;
+            strcpy(command->file, file);
+            strcpy(command->string, string);
+            return 0;
+        }
+        else if (sscanf(input_str, "%s %s %d %[^\n]", cmd_type_str, file, &line, string) == 4)
         {
             strcpy(command->file, file);
             command->line = line;
@@ -77,7 +116,13 @@ int parse_command(char *input_str, command_t *command)
     else if (strcmp(cmd_type_str, "upload") == 0)
     {
         command->type = UPLOAD;
-        if (sscanf(input_str, "%s %s", cmd_type_str, file) == 2)
+        if (sscanf(input_str, "%s -d %s", cmd_type_str, file) == 2)
+        {
+            command->type = DELTA_UPLOAD;
+            strcpy(command->file, file);
+            return 0;
+        }
+        else if (sscanf(input_str, "%s %s", cmd_type_str, file) == 2)
         {
             strcpy(command->file, file);
             return 0;
@@ -100,6 +145,96 @@ int parse_command(char *input_str, command_t *command)
             return -1;
         }
     }
+    else if (strcmp(cmd_type_str, "checksum") == 0)
+    {
+        command->type = CHECKSUM;
+        if (sscanf(input_str, "%s %s", cmd_type_str, file) == 2)
+        {
+            strcpy(command->file, file);
+            return 0;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    else if (strcmp(cmd_type_str, "grep") == 0)
+    {
+        // grep [-m <limit>] <pattern> [glob], every file when no glob is given
+        command->type = GREP;
+        char *rest = input_str + strlen(cmd_type_str);
+        int consumed = 0;
+        if (sscanf(rest, " -m %d%n", &line, &consumed) == 1 && line >= 0)
+        {
+            command->limit = line;
+            rest += consumed;
+        }
+        // A pattern with spaces goes in double quotes
+        int count;
+        while (*rest == ' ')
+            rest++;
+        if (*rest == '"' && strchr(rest + 1, '"') != NULL)
+        {
+            char *close = strchr(rest + 1, '"');
+            if (close - rest - 1 >= MAX_WRITE_STRING_LENGTH)
+                return -1;
+            memcpy(string, rest + 1, close - rest - 1);
+            string[close - rest - 1] = '\0';
+            count = 1 + (sscanf(close + 1, "%255s", file) == 1);
+        }
+        else
+            count = sscanf(rest, "%255s %255s", string, file);
+        if (count < 1 || string[0] == '\0')
+            return -1;
+        strcpy(command->string, string);
+        strcpy(command->file, count == 2 ? file : "*");
+        return 0;
+    }
+    else if (strcmp(cmd_type_str, "search") == 0)
+    {
+        // search <term>..., the terms stay together and are split by the server
+        command->type = SEARCH;
+        char *rest = input_str + strlen(cmd_type_str);
+        while (*rest == ' ')
+            rest++;
+        size_t length = strcspn(rest, "\n");
+        while (length > 0 && rest[length - 1] == ' ')
+            length--;
+        if (length == 0 || length >= MAX_WRITE_STRING_LENGTH)
+            return -1;
+        memcpy(command->string, rest, length);
+        command->string[length] = '\0';
+        return 0;
+    }
+    else if (strcmp(cmd_type_str, "limit") == 0)
+    {
+        // limit [<n> | <min>-<max> | -i <seconds>], the bare command only shows them
+        command->type = LIMIT;
+        if (sscanf(input_str, "%s -i %d", cmd_type_str, &line) == 2)
+        {
+            if (line < 0)
+                return -1;
+            command->idle = line;
+            return 0;
+        }
+        else if (sscanf(input_str, "%s %d-%d", cmd_type_str, &line, &last_line) == 3)
+        {
+            if (line < 1 || last_line < line)
+                return -1;
+            command->line = line;
+            command->last_line = last_line;
+            return 0;
+        }
+        else if (sscanf(input_str, "%s %d", cmd_type_str, &line) == 2)
+        {
+            if (line < 1)
+                return -1;
+            command->line = line;
+            command->last_line = line;
+            return 0;
+        }
+        return 0;
+    }
     else if (strcmp(cmd_type_str, "quit") == 0)
     {
         command->type = QUIT;
@@ -129,6 +264,14 @@ command_type_t get_type(char *str)
         return UPLOAD;
     else if (strcmp(str, "download") == 0)
         return DOWNLOAD;
+    else if (strcmp(str, "checksum") == 0)
+        return CHECKSUM;
+    else if (strcmp(str, "grep") == 0)
+        return GREP;
+    else if (strcmp(str, "search") == 0)
+        return SEARCH;
+    else if (strcmp(str, "limit") == 0)
+        return LIMIT;
     else if (strcmp(str, "quit") == 0)
         return QUIT;
     else if (strcmp(str, "killServer") == 0)
@@ -140,17 +283,25 @@ command_type_t get_type(char *str)
 char *get_message(command_type_t type)
 {
     if (type == HELP)
-        return "Possible client requests:\nhelp, list, readF, writeT, upload, download, quit, killServer\n";
+        return "Possible client requests:\nhelp, list, readF, writeT, upload, download, checksum, grep, search, limit, quit, killServer\n";
     else if (type == LIST)
-        return "sends a request to display the list of files in Servers directory\n";
+        return "sends a request to display the list of files in Servers directory\nlist <file>\ndisplays the versions kept of <file> when the server keeps them, readF and download take <file>@<n> to read version <n>\n";
     else if (type == READF)
-        return "readF <file> <line #>\nrequests to display the # line of the <file>, if no line number is given the whole contents of the file is requested\n";
+        return "readF <file> <line #>\nrequests to display the # line of the <file>, if no line number is given the whole contents of the file is requested\nreadF <file> <from>-<to>\nrequests lines <from> to <to> of the <file>\nreadF -n <N> <file>\nreadF -t <N> <file>\nrequests the first or the last <N> lines of the <file>\nreadF -f <file>\nkeeps displaying the lines appended to <file> until Enter is pressed\n";
     else if (type == WRITET)
-        return "writeT <file> <line #> <string>\nrequest to write the content of “string” to the #th line the <file>, if the line # is not givenwrites to the end of file. If the file does not exists in Servers directory creates and edits thefile at the same time\n";
+        return "writeT <file> <line #> <string>\nrequest to write the content of “string” to the #th line the <file>, if the line # is not givenwrites to the end of file. If the file does not exists in Servers directory creates and edits thefile at the same time\nwriteT -b <file> <edits>\napplies every \"<line #> <string>\" line of the local file <edits> to <file> at once, line numbers refer to <file> before the edits and strings may be of any length\n";
     else if (type == UPLOAD)
-        return "upload <file>\nuploads the file from the current working directory of client to the Servers directory\n";
+        return "upload <file>\nuploads the file from the current working directory of client to the Servers directory, an interrupted upload of the same file resumes where it stopped\nupload -d <file>\nsends only the parts of <file> that differ from the copy in Servers directory and replaces it\n";
     else if (type == DOWNLOAD)
-        return "download <file>\nrequest to receive <file> from Servers directory to client side\n";
+        return "download <file>\nrequest to receive <file> from Servers directory to client side, a partial <file> left by an interrupted download is resumed\n";
+    else if (type == CHECKSUM)
+        return "checksum <file>\nprints the crc32c and size of <file> in Servers directory without transferring it\n";
+    else if (type == GREP)
+        return "grep [-m <limit>] <pattern> [glob]\nprints file:line:text for every line matching the extended regular expression <pattern> in the files of Servers directory whose names match [glob], stopping after <limit> matches if given\n";
+    else if (type == SEARCH)
+        return "search <term>...\nprints file:line:text for every line holding all of the words <term> in the files of Servers directory, answered from the index when the server keeps one\n";
+    else if (type == LIMIT)
+        return "limit\nshows how many clients are served, how many wait and the limits\nlimit <n>\nserves at most <n> clients at once\nlimit <min>-<max>\nlets the server move the limit between <min> and <max> with the CPU and I/O load\nlimit -i <seconds>\ndisconnects clients that send no command for <seconds>, 0 never does\nonly clients of the user the server runs as may change them, at most to the server's -A\n";
     else if (type == QUIT)
         return "Send write request to Server side log file and quits\n";
     else if (type == KILLSERVER)
@@ -159,11 +310,30 @@ char *get_message(command_type_t type)
         return "Invalid command\n";
 }
 
+int is_valid_command(const command_t *command)
+{
+    if (memchr(command->file, '\0', sizeof(command->file)) == NULL ||
+        memchr(command->string, '\0', sizeof(command->string)) == NULL)
+        return 0;
+    // Without a '/' only "." and ".." could leave the directory, and hidden names are
+    // the server's own anyway: the journal, chunks, versions and parts
+    return strchr(command->file, '/') == NULL && command->file[0] != '.';
+}
+
 void init_command(command_t *command)
 {
     memset(command->file, 0, sizeof(command->file));
     command->line = -1;
+    command->last_line = -1;
+    command->tail = 0;
+    command->limit = 0;
+    command->follow = 0;
     memset(command->string, 0, sizeof(command->string));
+    command->transfer_id = 0;
+    command->offset = 0;
+    command->size = 0;
+    command->checksum = 0;
+    command->idle = -1;
 }
 
 // for testing purposes
@@ -184,12 +354,30 @@ void log_command(command_t *command, int log_fd)
     case WRITET:
         my_log(log_fd, "WRITET\n");
         break;
+    case BATCH_WRITE:
+        my_log(log_fd, "BATCH_WRITE\n");
+        break;
     case UPLOAD:
         my_log(log_fd, "UPLOAD\n");
         break;
+    case DELTA_UPLOAD:
+        my_log(log_fd, "DELTA_UPLOAD\n");
+        break;
     case DOWNLOAD:
         my_log(log_fd, "DOWNLOAD\n");
         break;
+    case CHECKSUM:
+        my_log(log_fd, "CHECKSUM\n");
+        break;
+    case GREP:
+        my_log(log_fd, "GREP\n");
+        break;
+    case SEARCH:
+        my_log(log_fd, "SEARCH\n");
+        break;
+    case LIMIT:
+        my_log(log_fd, "LIMIT\n");
+        break;
     case QUIT:
         my_log(log_fd, "QUIT\n");
         break;
@@ -0,0 +1,233 @@
+#include "../include/delta.h"
+
+typedef struct
+{
+    long long *heads;
+    long long *next;
+    unsigned int mask;
+} delta_index_t;
+
+int delta_block_length(long long size)
+{
+    long long length = DELTA_MIN_BLOCK_LENGTH;
+    while (length < DELTA_MAX_BLOCK_LENGTH && length * length < size)
+        length += length / 2;
+    length = (length + 7) & ~7LL;
+    if (length < DELTA_MIN_BLOCK_LENGTH)
+        length = DELTA_MIN_BLOCK_LENGTH;
+    if (length > DELTA_MAX_BLOCK_LENGTH)
+        length = DELTA_MAX_BLOCK_LENGTH;
+    return (int)length;
+}
+
+unsigned int delta_weak(const unsigned char *buf, size_t len)
+{
+    unsigned int a = 0, b = 0;
+    size_t i;
+    for (i = 0; i < len; i++)
+    {
+        a += buf[i];
+        b += (len - i) * buf[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+void delta_make_sig(const unsigned char *buf, size_t len, delta_sig_t *sig)
+{
+    sig->weak = delta_weak(buf, len);
+    sig->length = len;
+    sig->strong = hash64(buf, len, 0);
+}
+
+static unsigned int delta_bucket(unsigned int weak, unsigned int mask)
+{
+    return ((weak ^ (weak >> 16)) * 2654435761u) & mask;
+}
+
+static void delta_index_init(delta_index_t *index, const delta_sig_t *sigs, long long count)
+{
+    unsigned int buckets = 1;
+    long long i;
+    while (buckets < 2 * count)
+        buckets <<= 1;
+    index->mask = buckets - 1;
+    index->heads = malloc(buckets * sizeof(long long));
+    index->next = malloc((count + 1) * sizeof(long long));
+    if (index->heads == NULL || index->next == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(index->heads, -1, buckets * sizeof(long long));
+    // Insert backwards so lookups prefer the lowest matching block
+    for (i = count - 1; i >= 0; i--)
+    {
+        unsigned int bucket = delta_bucket(sigs[i].weak, index->mask);
+        index->next[i] = index->heads[bucket];
+        index->heads[bucket] = i;
+    }
+}
+
+static long long delta_index_find(delta_index_t *index, const delta_sig_t *sigs, unsigned int weak,
+                                  const unsigned char *buf, size_t len, long long preferred)
+{
+    long long i, found = -1;
+    unsigned long long strong = 0;
+    int has_strong = 0;
+    for (i = index->heads[delta_bucket(weak, index->mask)]; i != -1; i = index->next[i])
+    {
+        if (sigs[i].weak != weak || sigs[i].length != len)
+            continue;
+        if (!has_strong)
+        {
+            strong = hash64(buf, len, 0);
+            has_strong = 1;
+        }
+        if (sigs[i].strong != strong)
+            continue;
+        // Continuing the current run keeps copies coalesced
+        if (i == preferred)
+            return i;
+        if (found == -1)
+            found = i;
+    }
+    return found;
+}
+
+static int delta_emit_copy(delta_op_t *op, long long block, long long *pending_block, long long *pending_count,
+                           delta_emit_fn emit, void *ctx)
+{
+    if (*pending_count > 0 && block == *pending_block + *pending_count)
+    {
+        (*pending_count)++;
+        return 0;
+    }
+    if (*pending_count > 0)
+    {
+        op->type = DELTA_COPY;
+        op->length = 0;
+        op->block = *pending_block;
+        op->count = *pending_count;
+        if (emit(op, ctx) == -1)
+            return -1;
+    }
+    *pending_block = block;
+    *pending_count = block >= 0 ? 1 : 0;
+    return 0;
+}
+
+static int delta_emit_literal(delta_op_t *op, const unsigned char *data, size_t len, delta_emit_fn emit, void *ctx)
+{
+    while (len > 0)
+    {
+        size_t length = len < sizeof(op->data) ? len : sizeof(op->data);
+        op->type = DELTA_LITERAL;
+        op->length = length;
+        memcpy(op->data, data, length);
+        if (emit(op, ctx) == -1)
+            return -1;
+        data += length;
+        len -= length;
+    }
+    return 0;
+}
+
+/*
+ Emits the pending copy run followed by data[start, end) as literals.
+*/
+static int delta_flush(delta_op_t *op, const unsigned char *data, size_t start, size_t end,
+                       long long *pending_block, long long *pending_count, delta_emit_fn emit, void *ctx)
+{
+    if (start == end)
+        return 0;
+    if (delta_emit_copy(op, -1, pending_block, pending_count, emit, ctx) == -1)
+        return -1;
+    return delta_emit_literal(op, data + start, end - start, emit, ctx);
+}
+
+long long delta_generate(const unsigned char *data, size_t len, const delta_sig_t *sigs, long long count,
+                         int block_length, delta_emit_fn emit, void *ctx)
+{
+    delta_index_t index;
+    delta_op_t op;
+    size_t L = block_length, pos = 0, literal_start = 0;
+    long long pending_block = -1, pending_count = 0, literal_bytes = 0, found;
+    unsigned int a = 0, b = 0, weak;
+    int status = 0;
+
+    memset(&op, 0, sizeof(op));
+    delta_index_init(&index, sigs, count);
+    if (count > 0 && len >= L)
+    {
+        weak = delta_weak(data, L);
+        a = weak & 0xFFFF;
+        b = weak >> 16;
+    }
+    while (count > 0 && pos + L <= len && status == 0)
+    {
+        weak = (a & 0xFFFF) | (b << 16);
+        found = delta_index_find(&index, sigs, weak, data + pos, L, pending_block + pending_count);
+        if (found >= 0)
+        {
+            literal_bytes += pos - literal_start;
+            status = delta_flush(&op, data, literal_start, pos, &pending_block, &pending_count, emit, ctx);
+            if (status == 0)
+                status = delta_emit_copy(&op, found, &pending_block, &pending_count, emit, ctx);
+            pos += L;
+            literal_start = pos;
+            if (pos + L <= len)
+            {
+                weak = delta_weak(data + pos, L);
+                a = weak & 0xFFFF;
+                b = weak >> 16;
+            }
+            continue;
+        }
+        if (pos + L < len)
+        {
+            a = a - data[pos] + data[pos + L];
+            b = b - L * data[pos] + a;
+        }
+        pos++;
+        // Stream long unmatched stretches instead of holding them back
+        if (pos - literal_start >= sizeof(op.data))
+        {
+            literal_bytes += pos - literal_start;
+            status = delta_flush(&op, data, literal_start, pos, &pending_block, &pending_count, emit, ctx);
+            literal_start = pos;
+        }
+    }
+
+    // The basis file's last block may be shorter than the others
+    if (status == 0 && count > 0 && len - literal_start >= sigs[count - 1].length && sigs[count - 1].length < L)
+    {
+        size_t tail = len - sigs[count - 1].length;
+        if (delta_index_find(&index, sigs, delta_weak(data + tail, len - tail), data + tail, len - tail, count - 1) == count - 1)
+        {
+            literal_bytes += tail - literal_start;
+            status = delta_flush(&op, data, literal_start, tail, &pending_block, &pending_count, emit, ctx);
+            if (status == 0)
+                status = delta_emit_copy(&op, count - 1, &pending_block, &pending_count, emit, ctx);
+            literal_start = len;
+        }
+    }
+    if (status == 0)
+    {
+        literal_bytes += len - literal_start;
+        status = delta_flush(&op, data, literal_start, len, &pending_block, &pending_count, emit, ctx);
+    }
+    if (status == 0)
+        status = delta_emit_copy(&op, -1, &pending_block, &pending_count, emit, ctx);
+    if (status == 0)
+    {
+        op.type = DELTA_END;
+        op.length = 0;
+        op.size = len;
+        op.checksum = crc32c(0, data, len);
+        status = emit(&op, ctx);
+    }
+
+    free(index.heads);
+    free(index.next);
+    return status == -1 ? -1 : literal_bytes;
+}
@@ -0,0 +1,489 @@
+#include "../include/grep.h"
+#include "../include/storage.h"
+#include "../include/shard.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <unistd.h>
+
+typedef struct
+{
+    long long line; // within the piece, from 1
+    size_t offset;  // into the piece's text
+    size_t length;
+} grep_match_t;
+
+typedef struct
+{
+    char file[MAX_FILENAME_LENGTH];
+    off_t start, end;
+    int is_done;
+    long long lines; // lines that start in this piece
+    grep_match_t *matches;
+    long long count, capacity;
+    char *text;
+    size_t text_length, text_capacity;
+} grep_unit_t;
+
+typedef struct
+{
+    grep_pattern_t *pattern;
+    const char *dirname;
+    long long limit;
+    grep_unit_t *units;
+    long long count;
+    long long next; // next unit a worker takes
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} grep_search_t;
+
+static int is_meta(char c)
+{
+    return strchr(".[]()*+?{}|^$\\", c) != NULL;
+}
+
+static void end_run(grep_pattern_t *pattern, const char *run, size_t *run_length)
+{
+    if (*run_length > pattern->literal_length)
+    {
+        memcpy(pattern->literal, run, *run_length);
+        pattern->literal_length = *run_length;
+    }
+    *run_length = 0;
+}
+
+int grep_compile(grep_pattern_t *pattern, const char *expr)
+{
+    size_t i, length = strlen(expr);
+    memset(pattern, 0, sizeof(*pattern));
+    if (length == 0 || length >= sizeof(pattern->literal) || regcomp(&pattern->regex, expr, REG_EXTENDED | REG_NOSUB) != 0)
+        return -1;
+    pattern->has_regex = 1;
+    pattern->is_literal = 1;
+    for (i = 0; i < length; i++)
+    {
+        if (is_meta(expr[i]))
+            pattern->is_literal = 0;
+    }
+    if (pattern->is_literal)
+    {
+        memcpy(pattern->literal, expr, length);
+        pattern->literal_length = length;
+        return 0;
+    }
+    // With alternatives or groups no single run is certain to be in every match
+    if (strpbrk(expr, "|()") != NULL)
+        return 0;
+
+    char run[MAX_WRITE_STRING_LENGTH];
+    size_t run_length = 0;
+    for (i = 0; i < length; i++)
+    {
+        char c = expr[i];
+        if (c == '\\')
+        {
+            // \. and friends are literals, \w and friends are classes
+            if (i + 1 >= length || isalnum((unsigned char)expr[i + 1]))
+            {
+                end_run(pattern, run, &run_length);
+                i++;
+                continue;
+            }
+            c = expr[++i];
+        }
+        else if (c == '[')
+        {
+            // Skip the bracket expression, a ] right after [ or [^ is part of it
+            i++;
+            if (i < length && expr[i] == '^')
+                i++;
+            if (i < length && expr[i] == ']')
+                i++;
+            while (i < length && expr[i] != ']')
+                i++;
+            end_run(pattern, run, &run_length);
+            continue;
+        }
+        else if (c == '{')
+        {
+            // The bounds of an interval are not text
+            while (i < length && expr[i] != '}')
+                i++;
+            end_run(pattern, run, &run_length);
+            continue;
+        }
+        else if (is_meta(c))
+        {
+            end_run(pattern, run, &run_length);
+            continue;
+        }
+        // A character that may be left out does not belong to the run
+        char next = i + 1 < length ? expr[i + 1] : '\0';
+        if (next == '*' || next == '?' || next == '{')
+        {
+            end_run(pattern, run, &run_length);
+            continue;
+        }
+        run[run_length++] = c;
+        if (next == '+')
+            end_run(pattern, run, &run_length);
+    }
+    end_run(pattern, run, &run_length);
+    return 0;
+}
+
+int grep_compile_terms(grep_pattern_t *pattern, char **terms, int count)
+{
+    int i, longest = -1;
+    memset(pattern, 0, sizeof(*pattern));
+    for (i = 0; i < count && i < GREP_MAX_TERMS; i++)
+    {
+        size_t length = strlen(terms[i]);
+        if (length == 0 || length >= sizeof(pattern->literal))
+            return -1;
+        if (longest == -1 || length > strlen(terms[longest]))
+            longest = i;
+    }
+    if (longest == -1)
+        return -1;
+    pattern->is_literal = 1;
+    pattern->literal_length = strlen(terms[longest]);
+    memcpy(pattern->literal, terms[longest], pattern->literal_length);
+    for (i = 0; i < count && i < GREP_MAX_TERMS; i++)
+    {
+        if (i == longest)
+            continue;
+        pattern->term_lengths[pattern->term_count] = strlen(terms[i]);
+        memcpy(pattern->terms[pattern->term_count], terms[i], pattern->term_lengths[pattern->term_count]);
+        pattern->term_count++;
+    }
+    return 0;
+}
+
+void grep_free(grep_pattern_t *pattern)
+{
+    if (pattern->has_regex)
+        regfree(&pattern->regex);
+}
+
+static int has_terms(grep_pattern_t *pattern, const char *start, const char *end)
+{
+    int i;
+    for (i = 0; i < pattern->term_count; i++)
+    {
+        if (memmem(start, end - start, pattern->terms[i], pattern->term_lengths[i]) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+static int grep_regex_match(grep_pattern_t *pattern, const char *start, const char *end)
+{
+    regmatch_t match;
+    match.rm_so = 0;
+    match.rm_eo = end - start;
+    return regexec(&pattern->regex, start, 1, &match, REG_STARTEND) == 0;
+}
+
+static long long count_lines(const char *p, const char *end)
+{
+    long long lines = 0;
+    while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+    {
+        lines++;
+        p++;
+    }
+    return lines;
+}
+
+static void add_match(grep_unit_t *unit, long long line, const char *text, size_t length)
+{
+    if (unit->count == unit->capacity)
+    {
+        unit->capacity = unit->capacity == 0 ? 16 : unit->capacity * 2;
+        unit->matches = realloc(unit->matches, unit->capacity * sizeof(grep_match_t));
+    }
+    if (unit->text_length + length > unit->text_capacity)
+    {
+        while (unit->text_length + length > unit->text_capacity)
+            unit->text_capacity = unit->text_capacity == 0 ? 4096 : unit->text_capacity * 2;
+        unit->text = realloc(unit->text, unit->text_capacity);
+    }
+    if (unit->matches == NULL || unit->text == NULL)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    grep_match_t *match = &unit->matches[unit->count++];
+    match->line = line;
+    match->offset = unit->text_length;
+    match->length = length;
+    memcpy(unit->text + unit->text_length, text, length);
+    unit->text_length += length;
+}
+
+static void grep_lines(grep_search_t *search, grep_unit_t *unit, const char *p, const char *end)
+{
+    grep_pattern_t *pattern = search->pattern;
+    const char *counted = p;
+    long long line = 1;
+    unit->lines = count_lines(p, end) + (p < end && end[-1] != '\n');
+    while (p < end && (search->limit == 0 || unit->count < search->limit) &&
+           !__atomic_load_n(&search->stop, __ATOMIC_RELAXED))
+    {
+        // Jump straight to the next line holding the literal
+        const char *line_start = p;
+        if (pattern->literal_length > 0)
+        {
+            const char *hit = memmem(p, end - p, pattern->literal, pattern->literal_length);
+            if (hit == NULL)
+                break;
+            line_start = memrchr(p, '\n', hit - p);
+            line_start = line_start != NULL ? line_start + 1 : p;
+        }
+        const char *line_end = memchr(line_start, '\n', end - line_start);
+        if (line_end == NULL)
+            line_end = end;
+        line += count_lines(counted, line_start);
+        counted = line_start;
+        if (pattern->is_literal ? has_terms(pattern, line_start, line_end)
+                                : grep_regex_match(pattern, line_start, line_end))
+            add_match(unit, line, line_start, line_end - line_start);
+        p = line_end < end ? line_end + 1 : end;
+    }
+}
+
+/*
+ Reads the lines that start in [start, end) of the unit's file under the
+ file lock: the line running into the piece belongs to the one before,
+ the last line is read to its end.
+*/
+static char *read_piece(grep_search_t *search, grep_unit_t *unit, char **begin, char **end)
+{
+    char path[MAX_PATH_LENGTH], file_sem_name[FILE_SEM_NAME_LEN];
+    shard_path(search->dirname, unit->file, path, sizeof(path));
+    snprintf(file_sem_name, FILE_SEM_NAME_LEN, FILE_SEM_NAME_TEMPLATE, unit->file);
+    sem_t *sem_file = sem_open(file_sem_name, O_CREAT, 0777, 1);
+    if (sem_file == SEM_FAILED)
+        return NULL;
+    sem_wait(sem_file);
+    stored_file_t file;
+    char *buf = NULL;
+    size_t length = 0;
+    if (storage_open(&file, search->dirname, path) == 0)
+    {
+        off_t from = unit->start > 0 ? unit->start - 1 : 0;
+        off_t to = unit->end < file.size ? unit->end : file.size;
+        size_t capacity = to > from ? to - from + CHUNK_SIZE : CHUNK_SIZE;
+        buf = malloc(capacity);
+        while (buf != NULL && from + (off_t)length < file.size)
+        {
+            // Past the piece only until the end of its last line
+            if (from + (off_t)length >= to && length > 0 && buf[length - 1] == '\n')
+                break;
+            if (length + CHUNK_SIZE > capacity)
+            {
+                capacity *= 2;
+                char *grown = realloc(buf, capacity);
+                if (grown == NULL)
+                    break;
+                buf = grown;
+            }
+            size_t want = from + (off_t)length < to ? (size_t)(to - from) - length : CHUNK_SIZE;
+            ssize_t bytes_read = storage_pread(&file, buf + length, want, from + length);
+            if (bytes_read <= 0)
+                break;
+            length += bytes_read;
+        }
+        // Drop what was read past the end of the last line
+        if (buf != NULL && from + (off_t)length > to && to > from)
+        {
+            char *newline = memchr(buf + (to - from - 1), '\n', length - (to - from - 1));
+            if (newline != NULL)
+                length = newline - buf + 1;
+        }
+        storage_close(&file);
+    }
+    sem_post(sem_file);
+    sem_close(sem_file);
+    sem_unlink(file_sem_name);
+    if (buf == NULL)
+        return NULL;
+
+    *begin = buf;
+    *end = buf + length;
+    if (unit->start > 0)
+    {
+        char *newline = memchr(buf, '\n', length);
+        *begin = newline != NULL ? newline + 1 : *end;
+    }
+    return buf;
+}
+
+static void *grep_worker(void *arg)
+{
+    grep_search_t *search = arg;
+    long long index;
+    while (!__atomic_load_n(&search->stop, __ATOMIC_RELAXED) &&
+           (index = __atomic_fetch_add(&search->next, 1, __ATOMIC_RELAXED)) < search->count)
+    {
+        grep_unit_t *unit = &search->units[index];
+        char *begin, *end;
+        char *buf = read_piece(search, unit, &begin, &end);
+        if (buf != NULL)
+        {
+            grep_lines(search, unit, begin, end);
+            free(buf);
+        }
+        pthread_mutex_lock(&search->lock);
+        unit->is_done = 1;
+        pthread_cond_broadcast(&search->done);
+        pthread_mutex_unlock(&search->lock);
+    }
+    return NULL;
+}
+
+// Splits a regular file into pieces
+static void plan_file(grep_search_t *search, const char *name, long long *capacity)
+{
+    char path[MAX_PATH_LENGTH];
+    stored_file_t file;
+    shard_path(search->dirname, name, path, sizeof(path));
+    if (strlen(name) >= MAX_FILENAME_LENGTH || storage_open(&file, search->dirname, path) == -1)
+        return;
+    off_t start;
+    for (start = 0; start < file.size; start += GREP_PIECE_SIZE)
+    {
+        if (search->count == *capacity)
+        {
+            *capacity = *capacity == 0 ? 64 : *capacity * 2;
+            search->units = realloc(search->units, *capacity * sizeof(grep_unit_t));
+            if (search->units == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        grep_unit_t *unit = &search->units[search->count++];
+        memset(unit, 0, sizeof(*unit));
+        strcpy(unit->file, name);
+        unit->start = start;
+        unit->end = start + GREP_PIECE_SIZE;
+    }
+    storage_close(&file);
+}
+
+// Every regular file matching glob, in name order
+static void plan_glob(grep_search_t *search, const char *glob)
+{
+    char **names;
+    long long n = shard_list(search->dirname, &names);
+    long long capacity = 0, i;
+    for (i = 0; i < n; i++)
+    {
+        if (fnmatch(glob, names[i], 0) == 0)
+            plan_file(search, names[i], &capacity);
+    }
+    shard_free_names(names, n);
+}
+
+static long long run_search(grep_search_t *search, grep_emit_fn emit, void *ctx)
+{
+    long long limit = search->limit;
+    if (search->count == 0)
+    {
+        free(search->units);
+        return 0;
+    }
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->done, NULL);
+
+    // Workers leave signals to the thread that talks to the client
+    pthread_t threads[GREP_MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int count = cpus < 1 ? 1 : cpus > GREP_MAX_THREADS ? GREP_MAX_THREADS : (int)cpus;
+    if (count > search->count)
+        count = search->count;
+    sigset_t all, orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+    int i, started = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (pthread_create(&threads[started], NULL, grep_worker, search) == 0)
+            started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    if (started == 0)
+        grep_worker(search);
+
+    // Hand the matches out in order as the pieces finish, line numbers
+    // continue from the pieces before
+    long long emitted = 0, base = 0, index;
+    int status = 0;
+    for (index = 0; index < search->count && status == 0 && (limit == 0 || emitted < limit); index++)
+    {
+        grep_unit_t *unit = &search->units[index];
+        pthread_mutex_lock(&search->lock);
+        while (!unit->is_done)
+            pthread_cond_wait(&search->done, &search->lock);
+        pthread_mutex_unlock(&search->lock);
+        if (unit->start == 0)
+            base = 0;
+        long long j;
+        for (j = 0; j < unit->count && (limit == 0 || emitted < limit); j++)
+        {
+            grep_match_t *match = &unit->matches[j];
+            if (emit(unit->file, base + match->line, unit->text + match->offset, match->length, ctx) == -1)
+            {
+                status = -1;
+                break;
+            }
+            emitted++;
+        }
+        base += unit->lines;
+    }
+
+    __atomic_store_n(&search->stop, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (index = 0; index < search->count; index++)
+    {
+        free(search->units[index].matches);
+        free(search->units[index].text);
+    }
+    free(search->units);
+    pthread_cond_destroy(&search->done);
+    pthread_mutex_destroy(&search->lock);
+    return status == -1 ? -1 : emitted;
+}
+
+long long grep_search(grep_pattern_t *pattern, const char *dirname, const char *glob, long long limit,
+                      grep_emit_fn emit, void *ctx)
+{
+    grep_search_t search;
+    memset(&search, 0, sizeof(search));
+    search.pattern = pattern;
+    search.dirname = dirname;
+    search.limit = limit;
+    plan_glob(&search, glob);
+    return run_search(&search, emit, ctx);
+}
+
+long long grep_search_files(grep_pattern_t *pattern, const char *dirname, char **names, long long count,
+                            long long limit, grep_emit_fn emit, void *ctx)
+{
+    grep_search_t search;
+    long long capacity = 0, i;
+    memset(&search, 0, sizeof(search));
+    search.pattern = pattern;
+    search.dirname = dirname;
+    search.limit = limit;
+    for (i = 0; i < count; i++)
+        plan_file(&search, names[i], &capacity);
+    return run_search(&search, emit, ctx);
+}
@@ -0,0 +1,516 @@
+#include "../include/index.h"
+#include "../include/grep.h"
+#include "../include/storage.h"
+#include "../include/logger.h"
+#include "../include/shard.h"
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define TRIGRAM_SPACE (1u << 24)
+
+typedef struct
+{
+    index_file_t meta;
+    uint32_t *trigrams; // sorted, each once
+    uint32_t count;
+} index_entry_t;
+
+typedef struct
+{
+    const char *dirname;
+    index_entry_t *entries; // sorted by name, the position is the file id
+    long long count, capacity;
+    uint64_t *seen;         // TRIGRAM_SPACE bits, clear between files
+} indexer_t;
+
+static int compare_trigrams(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const index_entry_t *)a)->meta.name, ((const index_entry_t *)b)->meta.name);
+}
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void *grow(void *p, long long *capacity, size_t size)
+{
+    *capacity = *capacity == 0 ? 64 : *capacity * 2;
+    p = realloc(p, *capacity * size);
+    if (p == NULL)
+    {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+/*
+ Reads name with the storage layer, so manifests are indexed by content,
+ and collects its distinct trigrams. Returns -1 if it is not a readable
+ regular file.
+*/
+static int extract_file(indexer_t *indexer, const char *name, index_entry_t *entry)
+{
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    stored_file_t file;
+    shard_path(indexer->dirname, name, path, sizeof(path));
+    // What the file looked like before reading, a change while reading shows later
+    if (strlen(name) >= MAX_FILENAME_LENGTH || stat(path, &st) == -1 || !S_ISREG(st.st_mode) ||
+        storage_open(&file, indexer->dirname, path) == -1)
+        return -1;
+
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->meta.name, name);
+    entry->meta.size = st.st_size;
+    entry->meta.mtime = mtime_ns(&st);
+    entry->meta.inode = st.st_ino;
+    long long capacity = 0;
+    uint32_t window = 0;
+    long long total = 0;
+    char buf[64 * 1024];
+    ssize_t bytes_read;
+    while ((bytes_read = storage_read(&file, buf, sizeof(buf))) > 0)
+    {
+        ssize_t i;
+        for (i = 0; i < bytes_read; i++, total++)
+        {
+            window = ((window << 8) | (unsigned char)buf[i]) & (TRIGRAM_SPACE - 1);
+            if (total < 2 || (indexer->seen[window >> 6] & (1ULL << (window & 63))))
+                continue;
+            indexer->seen[window >> 6] |= 1ULL << (window & 63);
+            if (entry->count == capacity)
+                entry->trigrams = grow(entry->trigrams, &capacity, sizeof(uint32_t));
+            entry->trigrams[entry->count++] = window;
+        }
+    }
+    storage_close(&file);
+
+    uint32_t i;
+    for (i = 0; i < entry->count; i++)
+        indexer->seen[entry->trigrams[i] >> 6] = 0;
+    qsort(entry->trigrams, entry->count, sizeof(uint32_t), compare_trigrams);
+    return 0;
+}
+
+static void clear_entries(indexer_t *indexer)
+{
+    long long i;
+    for (i = 0; i < indexer->count; i++)
+        free(indexer->entries[i].trigrams);
+    indexer->count = 0;
+}
+
+static void scan_all(indexer_t *indexer)
+{
+    // Hidden files, the index itself, part files and the chunk store, are not listed
+    char **names;
+    long long n = shard_list(indexer->dirname, &names), i;
+    clear_entries(indexer);
+    for (i = 0; i < n; i++)
+    {
+        if (indexer->count == indexer->capacity)
+            indexer->entries = grow(indexer->entries, &indexer->capacity, sizeof(index_entry_t));
+        if (extract_file(indexer, names[i], &indexer->entries[indexer->count]) == 0)
+            indexer->count++;
+    }
+    shard_free_names(names, n);
+    qsort(indexer->entries, indexer->count, sizeof(index_entry_t), compare_entries);
+}
+
+// Re-reads one file, or forgets it once it is gone
+static void update_file(indexer_t *indexer, const char *name)
+{
+    index_entry_t key, entry;
+    strncpy(key.meta.name, name, sizeof(key.meta.name) - 1);
+    key.meta.name[sizeof(key.meta.name) - 1] = '\0';
+    index_entry_t *found = bsearch(&key, indexer->entries, indexer->count, sizeof(index_entry_t), compare_entries);
+    int status = extract_file(indexer, name, &entry);
+    if (found != NULL)
+    {
+        free(found->trigrams);
+        if (status == 0)
+            *found = entry;
+        else
+        {
+            long long at = found - indexer->entries;
+            memmove(found, found + 1, (indexer->count - at - 1) * sizeof(index_entry_t));
+            indexer->count--;
+        }
+        return;
+    }
+    if (status == -1)
+        return;
+    if (indexer->count == indexer->capacity)
+        indexer->entries = grow(indexer->entries, &indexer->capacity, sizeof(index_entry_t));
+    indexer->entries[indexer->count++] = entry;
+    qsort(indexer->entries, indexer->count, sizeof(index_entry_t), compare_entries);
+}
+
+// Min-heap of the next trigram of every file, ties broken by file id
+typedef struct
+{
+    uint32_t trigram;
+    uint32_t id;
+    uint32_t pos;
+} heap_item_t;
+
+static int heap_less(heap_item_t *a, heap_item_t *b)
+{
+    return a->trigram < b->trigram || (a->trigram == b->trigram && a->id < b->id);
+}
+
+static void heap_down(heap_item_t *heap, long long count, long long i)
+{
+    while (1)
+    {
+        long long child = 2 * i + 1, smallest = i;
+        if (child < count && heap_less(&heap[child], &heap[smallest]))
+            smallest = child;
+        if (child + 1 < count && heap_less(&heap[child + 1], &heap[smallest]))
+            smallest = child + 1;
+        if (smallest == i)
+            return;
+        heap_item_t swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+/*
+ Merges the per file trigram lists into postings and replaces the index
+ with a rename, so searches see either the old or the new one whole.
+*/
+static int write_index(indexer_t *indexer, uint32_t *trigram_count)
+{
+    char path[MAX_PATH_LENGTH], temp_path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", indexer->dirname, INDEX_FILE_NAME);
+    snprintf(temp_path, sizeof(temp_path), "%s/%s", indexer->dirname, INDEX_TEMP_NAME);
+    FILE *out = fopen(temp_path, "w");
+    if (out == NULL)
+        return -1;
+
+    index_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.file_count = indexer->count;
+    header.postings_offset = sizeof(header) + indexer->count * sizeof(index_file_t);
+    fwrite(&header, sizeof(header), 1, out);
+    long long i;
+    for (i = 0; i < indexer->count; i++)
+        fwrite(&indexer->entries[i].meta, sizeof(index_file_t), 1, out);
+
+    heap_item_t *heap = malloc((indexer->count + 1) * sizeof(heap_item_t));
+    index_trigram_t *table = NULL;
+    long long count = 0, table_count = 0, table_capacity = 0;
+    if (heap == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < indexer->count; i++)
+    {
+        if (indexer->entries[i].count > 0)
+        {
+            heap[count].trigram = indexer->entries[i].trigrams[0];
+            heap[count].id = i;
+            heap[count].pos = 0;
+            count++;
+        }
+    }
+    for (i = count / 2 - 1; i >= 0; i--)
+        heap_down(heap, count, i);
+    while (count > 0)
+    {
+        heap_item_t *top = &heap[0];
+        if (table_count == 0 || table[table_count - 1].trigram != top->trigram)
+        {
+            if (table_count == table_capacity)
+                table = grow(table, &table_capacity, sizeof(index_trigram_t));
+            table[table_count].trigram = top->trigram;
+            table[table_count].count = 0;
+            table[table_count].first = header.posting_count;
+            table_count++;
+        }
+        fwrite(&top->id, sizeof(uint32_t), 1, out);
+        table[table_count - 1].count++;
+        header.posting_count++;
+        index_entry_t *entry = &indexer->entries[top->id];
+        if (++top->pos < entry->count)
+            top->trigram = entry->trigrams[top->pos];
+        else
+            heap[0] = heap[--count];
+        heap_down(heap, count, 0);
+    }
+    free(heap);
+
+    header.trigram_count = table_count;
+    header.trigrams_offset = header.postings_offset + header.posting_count * sizeof(uint32_t);
+    if (table_count > 0)
+        fwrite(table, sizeof(index_trigram_t), table_count, out);
+    free(table);
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    if (ferror(out) | fclose(out) || rename(temp_path, path) == -1)
+    {
+        unlink(temp_path);
+        return -1;
+    }
+    *trigram_count = table_count;
+    return 0;
+}
+
+static void publish(indexer_t *indexer, int log_fd)
+{
+    uint32_t trigram_count;
+    if (write_index(indexer, &trigram_count) == -1)
+        my_log(log_fd, ">> Indexer could not write %s: %s\n", INDEX_FILE_NAME, strerror(errno));
+    else
+        my_log(log_fd, ">> Indexed %lld files, %u trigrams\n", indexer->count, trigram_count);
+}
+
+void index_run(const char *dirname, int log_fd)
+{
+    indexer_t indexer;
+    memset(&indexer, 0, sizeof(indexer));
+    indexer.dirname = dirname;
+    indexer.seen = calloc(TRIGRAM_SPACE / 64, sizeof(uint64_t));
+    if (indexer.seen == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    // Clients come first
+    setpriority(PRIO_PROCESS, 0, 10);
+
+    // Watch before the first scan so no change falls in between, every shard and the
+    // directory itself; an event only names the file, which is all an update needs
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    int i;
+    uint32_t events_wanted = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB;
+    if (inotify_fd != -1 && inotify_add_watch(inotify_fd, dirname, events_wanted) == -1)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    for (i = 0; inotify_fd != -1 && shard_is_enabled() && i < SHARD_COUNT; i++)
+    {
+        char watch_path[MAX_PATH_LENGTH];
+        snprintf(watch_path, sizeof(watch_path), "%s/%s/%02x", dirname, SHARD_DIR, i);
+        if (inotify_add_watch(inotify_fd, watch_path, events_wanted) == -1)
+        {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+    if (inotify_fd == -1)
+        my_log(log_fd, ">> Indexer can not follow changes: %s\n", strerror(errno));
+    scan_all(&indexer);
+    publish(&indexer, log_fd);
+    if (inotify_fd == -1)
+    {
+        clear_entries(&indexer);
+        return;
+    }
+
+    char (*dirty)[MAX_FILENAME_LENGTH] = NULL;
+    long long dirty_count = 0, dirty_capacity = 0;
+    int rescan = 0;
+    while (1)
+    {
+        struct pollfd pfd = {inotify_fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, dirty_count > 0 || rescan ? INDEX_SETTLE_MS : -1);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                break;
+            perror("poll");
+            break;
+        }
+        // Quiet for a while, bring the index up to date
+        if (ready == 0)
+        {
+            long long i;
+            if (rescan)
+                scan_all(&indexer);
+            else
+            {
+                for (i = 0; i < dirty_count; i++)
+                    update_file(&indexer, dirty[i]);
+            }
+            publish(&indexer, log_fd);
+            dirty_count = 0;
+            rescan = 0;
+            continue;
+        }
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length = read(inotify_fd, events, sizeof(events));
+        ssize_t offset = 0;
+        while (length > 0 && offset < length)
+        {
+            struct inotify_event *event = (struct inotify_event *)(events + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+                rescan = 1;
+            if (event->len == 0 || event->name[0] == '.' || strlen(event->name) >= MAX_FILENAME_LENGTH || rescan)
+                continue;
+            long long i;
+            for (i = 0; i < dirty_count && strcmp(dirty[i], event->name) != 0; i++)
+                ;
+            if (i < dirty_count)
+                continue;
+            if (dirty_count == dirty_capacity)
+                dirty = grow(dirty, &dirty_capacity, sizeof(*dirty));
+            strcpy(dirty[dirty_count++], event->name);
+        }
+    }
+    free(dirty);
+    close(inotify_fd);
+    clear_entries(&indexer);
+    free(indexer.entries);
+    free(indexer.seen);
+}
+
+/*
+ Maps the index and checks its layout. Returns NULL when there is none or
+ it can not be trusted.
+*/
+static char *map_index(const char *dirname, size_t *size)
+{
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dirname, INDEX_FILE_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(index_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    index_header_t *header = (index_header_t *)map;
+    uint64_t files_end = sizeof(index_header_t) + (uint64_t)header->file_count * sizeof(index_file_t);
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 || header->postings_offset != files_end ||
+        header->trigrams_offset != files_end + header->posting_count * sizeof(uint32_t) ||
+        header->trigrams_offset + (uint64_t)header->trigram_count * sizeof(index_trigram_t) != (uint64_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return map;
+}
+
+static int compare_file_names(const void *key, const void *file)
+{
+    return strcmp(key, ((const index_file_t *)file)->name);
+}
+
+static int compare_trigram_key(const void *key, const void *trigram)
+{
+    uint32_t x = *(const uint32_t *)key, y = ((const index_trigram_t *)trigram)->trigram;
+    return x < y ? -1 : x > y;
+}
+
+long long index_candidates(const char *dirname, char **terms, int count, char ***names)
+{
+    size_t map_size = 0;
+    char *map = map_index(dirname, &map_size);
+    index_header_t *header = (index_header_t *)map;
+    index_file_t *files = NULL;
+    uint32_t *hits = NULL, query_count = 0;
+    if (map != NULL)
+    {
+        files = (index_file_t *)(map + sizeof(index_header_t));
+        index_trigram_t *table = (index_trigram_t *)(map + header->trigrams_offset);
+        uint32_t *postings = (uint32_t *)(map + header->postings_offset);
+        uint32_t query[MAX_WRITE_STRING_LENGTH * GREP_MAX_TERMS];
+        int i;
+        for (i = 0; i < count && i < GREP_MAX_TERMS; i++)
+        {
+            size_t j, length = strlen(terms[i]);
+            for (j = 2; j < length; j++)
+                query[query_count++] = ((unsigned char)terms[i][j - 2] << 16) |
+                                       ((unsigned char)terms[i][j - 1] << 8) | (unsigned char)terms[i][j];
+        }
+        qsort(query, query_count, sizeof(uint32_t), compare_trigrams);
+        uint32_t unique = 0, q;
+        for (q = 0; q < query_count; q++)
+        {
+            if (unique == 0 || query[unique - 1] != query[q])
+                query[unique++] = query[q];
+        }
+        query_count = unique;
+        hits = calloc(header->file_count + 1, sizeof(uint32_t));
+        if (hits == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (q = 0; q < query_count; q++)
+        {
+            index_trigram_t *found = bsearch(&query[q], table, header->trigram_count, sizeof(index_trigram_t),
+                                             compare_trigram_key);
+            if (found == NULL || found->first + found->count > header->posting_count)
+                continue;
+            uint64_t k;
+            for (k = found->first; k < found->first + found->count; k++)
+            {
+                if (postings[k] < header->file_count)
+                    hits[postings[k]]++;
+            }
+        }
+    }
+
+    // Files the index does not know as they are now are searched regardless
+    char **entries;
+    long long n = shard_list(dirname, &entries), i;
+    long long result = 0;
+    *names = NULL;
+    if (n > 0)
+        *names = malloc(n * sizeof(char *));
+    for (i = 0; i < n; i++)
+    {
+        char path[MAX_PATH_LENGTH];
+        struct stat st;
+        const char *name = entries[i];
+        shard_path(dirname, name, path, sizeof(path));
+        int is_candidate = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+        if (is_candidate && map != NULL)
+        {
+            index_file_t *file = bsearch(name, files, header->file_count, sizeof(index_file_t), compare_file_names);
+            if (file != NULL && file->size == st.st_size && file->mtime == mtime_ns(&st) && file->inode == st.st_ino)
+                is_candidate = hits[file - files] == query_count;
+        }
+        if (is_candidate && *names != NULL)
+            (*names)[result++] = strdup(name);
+    }
+    shard_free_names(entries, n);
+    free(hits);
+    if (map != NULL)
+        munmap(map, map_size);
+    return result;
+}
+
+void index_free_names(char **names, long long count)
+{
+    long long i;
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
@@ -0,0 +1,470 @@
+#include "../include/io_engine.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+// glibc has no wrappers for these, see io_uring_setup(2)
+static int io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static char *block_data(io_engine_t *engine, int index)
+{
+    return engine->buffers + (size_t)index * IO_BLOCK_SIZE;
+}
+
+static int io_ring_init(io_engine_t *engine)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    engine->ring_fd = io_uring_setup(IO_QUEUE_DEPTH, &params);
+    if (engine->ring_fd == -1)
+        return -1;
+
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings with a single mmap
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (engine->cq_ring_size > engine->sq_ring_size)
+            engine->sq_ring_size = engine->cq_ring_size;
+        engine->cq_ring_size = 0;
+    }
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           engine->ring_fd, IORING_OFF_SQ_RING);
+    if (engine->sq_ring == MAP_FAILED)
+        goto fail;
+    engine->cq_ring = engine->sq_ring;
+    if (engine->cq_ring_size > 0)
+    {
+        engine->cq_ring = mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                               engine->ring_fd, IORING_OFF_CQ_RING);
+        if (engine->cq_ring == MAP_FAILED)
+        {
+            munmap(engine->sq_ring, engine->sq_ring_size);
+            goto fail;
+        }
+    }
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        engine->ring_fd, IORING_OFF_SQES);
+    if (engine->sqes == MAP_FAILED)
+    {
+        if (engine->cq_ring_size > 0)
+            munmap(engine->cq_ring, engine->cq_ring_size);
+        munmap(engine->sq_ring, engine->sq_ring_size);
+        goto fail;
+    }
+
+    char *sq = engine->sq_ring, *cq = engine->cq_ring;
+    engine->sq_head = (unsigned *)(sq + params.sq_off.head);
+    engine->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *)(sq + params.sq_off.array);
+    engine->cq_head = (unsigned *)(cq + params.cq_off.head);
+    engine->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    engine->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+fail:
+    close(engine->ring_fd);
+    engine->ring_fd = -1;
+    return -1;
+}
+
+void io_engine_init(io_engine_t *engine)
+{
+    memset(engine, 0, sizeof(*engine));
+    engine->fd = -1;
+    // Page aligned so the same blocks also suit O_DIRECT
+    engine->buffers = mmap(NULL, (size_t)IO_QUEUE_DEPTH * IO_BLOCK_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (engine->buffers == MAP_FAILED)
+    {
+        perror("Error allocating I/O buffers");
+        exit(EXIT_FAILURE);
+    }
+    if (io_ring_init(engine) == -1)
+        return;
+
+    struct iovec iovecs[IO_QUEUE_DEPTH];
+    int i;
+    for (i = 0; i < IO_QUEUE_DEPTH; i++)
+    {
+        iovecs[i].iov_base = block_data(engine, i);
+        iovecs[i].iov_len = IO_BLOCK_SIZE;
+    }
+    // Pinning may fail under a low RLIMIT_MEMLOCK, plain reads and writes still work
+    engine->has_fixed_buffers = io_uring_register(engine->ring_fd, IORING_REGISTER_BUFFERS, iovecs, IO_QUEUE_DEPTH) == 0;
+}
+
+void io_engine_destroy(io_engine_t *engine)
+{
+    if (engine->ring_fd != -1)
+    {
+        munmap(engine->sqes, engine->sqes_size);
+        if (engine->cq_ring_size > 0)
+            munmap(engine->cq_ring, engine->cq_ring_size);
+        munmap(engine->sq_ring, engine->sq_ring_size);
+        close(engine->ring_fd);
+        engine->ring_fd = -1;
+    }
+    munmap(engine->buffers, (size_t)IO_QUEUE_DEPTH * IO_BLOCK_SIZE);
+}
+
+static void io_submit(io_engine_t *engine)
+{
+    while (engine->to_submit > 0)
+    {
+        int submitted = io_uring_enter(engine->ring_fd, engine->to_submit, 0, 0);
+        if (submitted == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        engine->to_submit -= submitted;
+    }
+}
+
+// Puts what is left of blocks[index] on the submission queue
+static void io_prepare(io_engine_t *engine, int index)
+{
+    io_block_t *block = &engine->blocks[index];
+    unsigned tail = *engine->sq_tail;
+    unsigned slot = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = &engine->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    if (engine->has_fixed_buffers)
+        sqe->opcode = engine->is_writer ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        sqe->opcode = engine->is_writer ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = engine->has_fixed_file ? 0 : engine->fd;
+    sqe->flags = engine->has_fixed_file ? IOSQE_FIXED_FILE : 0;
+    sqe->addr = (unsigned long)(block_data(engine, index) + block->done);
+    sqe->len = block->length - block->done;
+    sqe->off = block->offset + block->done;
+    sqe->buf_index = index;
+    sqe->user_data = index;
+    engine->sq_array[slot] = slot;
+    __atomic_store_n(engine->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    engine->to_submit++;
+}
+
+// Queues a read or write of blocks[index], or leaves it for io_wait without a ring
+static void io_queue(io_engine_t *engine, int index)
+{
+    io_block_t *block = &engine->blocks[index];
+    block->state = IO_BLOCK_IN_FLIGHT;
+    block->done = 0;
+    if (engine->ring_fd != -1)
+        io_prepare(engine, index);
+}
+
+static void io_reap(io_engine_t *engine)
+{
+    unsigned head = *engine->cq_head;
+    unsigned tail = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &engine->cqes[head & *engine->cq_mask];
+        int index = cqe->user_data;
+        io_block_t *block = &engine->blocks[index];
+        head++;
+        // Like io_block_sync, a short transfer goes on with the rest and only 0 bytes is the end of the file
+        if (cqe->res > 0)
+            block->done += cqe->res;
+        off_t stop = block->offset + (off_t)block->length;
+        // A reader needs no more than its range, direct reads are rounded up past it
+        if (!engine->is_writer && stop > engine->end)
+            stop = engine->end;
+        if ((cqe->res > 0 || cqe->res == -EINTR) && block->offset + (off_t)block->done < stop)
+        {
+            io_prepare(engine, index);
+            continue;
+        }
+        block->result = cqe->res < 0 && block->done == 0 ? cqe->res : (ssize_t)block->done;
+        block->state = IO_BLOCK_DONE;
+    }
+    __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Synchronous stand-in for a queued block when there is no ring
+static ssize_t io_block_sync(io_engine_t *engine, int index)
+{
+    io_block_t *block = &engine->blocks[index];
+    size_t done = 0;
+    while (done < block->length)
+    {
+        ssize_t result;
+        if (engine->is_writer)
+            result = pwrite(engine->fd, block_data(engine, index) + done, block->length - done, block->offset + done);
+        else
+            result = pread(engine->fd, block_data(engine, index) + done, block->length - done, block->offset + done);
+        if (result == -1 && errno == EINTR)
+            continue;
+        if (result == -1)
+            return done > 0 ? (ssize_t)done : -errno;
+        if (result == 0)
+            break;
+        done += result;
+    }
+    return done;
+}
+
+static void io_wait(io_engine_t *engine, int index)
+{
+    io_block_t *block = &engine->blocks[index];
+    if (block->state != IO_BLOCK_IN_FLIGHT)
+        return;
+    if (engine->ring_fd == -1)
+    {
+        block->result = io_block_sync(engine, index);
+        block->state = IO_BLOCK_DONE;
+        return;
+    }
+    io_reap(engine);
+    while (block->state == IO_BLOCK_IN_FLIGHT)
+    {
+        int submitted = io_uring_enter(engine->ring_fd, engine->to_submit, 1, IORING_ENTER_GETEVENTS);
+        if (submitted == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            perror("io_uring_enter");
+            exit(EXIT_FAILURE);
+        }
+        if (submitted > 0)
+            engine->to_submit -= submitted;
+        io_reap(engine);
+    }
+}
+
+static void io_wait_all(io_engine_t *engine)
+{
+    int i;
+    for (i = 0; i < IO_QUEUE_DEPTH; i++)
+        io_wait(engine, i);
+}
+
+static void io_register_file(io_engine_t *engine, int fd)
+{
+    engine->fd = fd;
+    engine->has_fixed_file = 0;
+    engine->to_submit = 0;
+    engine->head = 0;
+    engine->block_pos = 0;
+    engine->error = 0;
+    memset(engine->blocks, 0, sizeof(engine->blocks));
+    if (engine->ring_fd != -1)
+        engine->has_fixed_file = io_uring_register(engine->ring_fd, IORING_REGISTER_FILES, &fd, 1) == 0;
+}
+
+static void io_unregister_file(io_engine_t *engine)
+{
+    if (engine->has_fixed_file)
+        io_uring_register(engine->ring_fd, IORING_UNREGISTER_FILES, NULL, 0);
+    engine->has_fixed_file = 0;
+    engine->fd = -1;
+}
+
+// Starts reading the next block of the file into blocks[index], if there is one
+static void io_reader_fill(io_engine_t *engine, int index)
+{
+    io_block_t *block = &engine->blocks[index];
+    if (engine->next_offset >= engine->end)
+    {
+        block->state = IO_BLOCK_FREE;
+        return;
+    }
+    block->offset = engine->next_offset;
+    block->length = engine->end - engine->next_offset < IO_BLOCK_SIZE ? (size_t)(engine->end - engine->next_offset)
+                                                                      : IO_BLOCK_SIZE;
+    // O_DIRECT reads the tail as a whole block too, the kernel stops at the end of the file
+    if (engine->is_direct)
+        block->length = (block->length + IO_DIRECT_ALIGN - 1) & ~(size_t)(IO_DIRECT_ALIGN - 1);
+    engine->next_offset += block->length;
+    io_queue(engine, index);
+    // Let the page cache start on the block after the ones in flight
+    if (!engine->is_direct && engine->next_offset < engine->end)
+        posix_fadvise(engine->fd, engine->next_offset, IO_BLOCK_SIZE, POSIX_FADV_WILLNEED);
+}
+
+void io_reader_open(io_engine_t *engine, int fd, off_t offset, off_t end)
+{
+    int i;
+    io_register_file(engine, fd);
+    engine->is_writer = 0;
+    engine->is_direct = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+    engine->drop_behind = !engine->is_direct && end - offset >= IO_DROP_BEHIND_MIN;
+    engine->next_offset = offset;
+    engine->drop_offset = offset;
+    engine->end = end;
+    if (engine->is_direct)
+    {
+        engine->next_offset = offset & ~(off_t)(IO_DIRECT_ALIGN - 1);
+        engine->block_pos = offset - engine->next_offset;
+    }
+    else
+        posix_fadvise(fd, offset, end - offset, POSIX_FADV_SEQUENTIAL);
+    for (i = 0; i < IO_QUEUE_DEPTH; i++)
+        io_reader_fill(engine, i);
+    // One system call puts the whole read ahead in flight
+    io_submit(engine);
+}
+
+ssize_t io_reader_read(io_engine_t *engine, void *buf, size_t len)
+{
+    char *out = buf;
+    size_t copied = 0;
+    while (copied < len)
+    {
+        io_block_t *block = &engine->blocks[engine->head];
+        if (block->state == IO_BLOCK_FREE || block->offset >= engine->end)
+            break;
+        io_wait(engine, engine->head);
+        if (block->result < 0)
+        {
+            // Nothing past a failed block is delivered
+            engine->end = block->offset;
+            if (copied > 0)
+                break;
+            errno = -block->result;
+            return -1;
+        }
+        // Direct reads may run past the range, anything short of it means the file shrank
+        size_t wanted = engine->end - block->offset < (off_t)block->length ? (size_t)(engine->end - block->offset)
+                                                                           : block->length;
+        size_t valid = (size_t)block->result < wanted ? (size_t)block->result : wanted;
+        if (valid < wanted)
+            engine->end = block->offset + valid;
+
+        size_t available = valid > engine->block_pos ? valid - engine->block_pos : 0;
+        size_t length = len - copied < available ? len - copied : available;
+        memcpy(out + copied, block_data(engine, engine->head) + engine->block_pos, length);
+        copied += length;
+        engine->block_pos += length;
+        if (engine->block_pos >= valid)
+        {
+            // Blocks handed out before this one are not read again
+            if (engine->drop_behind && block->offset > engine->drop_offset)
+            {
+                posix_fadvise(engine->fd, engine->drop_offset, block->offset - engine->drop_offset,
+                              POSIX_FADV_DONTNEED);
+                engine->drop_offset = block->offset;
+            }
+            // Reuse the buffer for the block after the ones in flight
+            engine->block_pos = 0;
+            io_reader_fill(engine, engine->head);
+            io_submit(engine);
+            engine->head = (engine->head + 1) % IO_QUEUE_DEPTH;
+        }
+    }
+    return copied;
+}
+
+void io_reader_close(io_engine_t *engine)
+{
+    // The buffers may not be reused while the kernel still writes into them
+    if (engine->ring_fd != -1)
+        io_wait_all(engine);
+    if (engine->drop_behind && engine->end > engine->drop_offset)
+        posix_fadvise(engine->fd, engine->drop_offset, engine->end - engine->drop_offset, POSIX_FADV_DONTNEED);
+    io_unregister_file(engine);
+}
+
+// Records the outcome of a finished write and frees its block
+static void io_writer_check(io_engine_t *engine, int index)
+{
+    io_block_t *block = &engine->blocks[index];
+    io_wait(engine, index);
+    if (block->state == IO_BLOCK_DONE && engine->error == 0)
+    {
+        if (block->result < 0)
+            engine->error = -block->result;
+        // The rest of a short write was written again, only a write of nothing stops short
+        else if ((size_t)block->result < block->length)
+            engine->error = ENOSPC;
+    }
+    if (block->state == IO_BLOCK_DONE)
+    {
+        block->state = IO_BLOCK_FREE;
+        block->length = 0;
+    }
+}
+
+void io_writer_open(io_engine_t *engine, int fd, off_t offset)
+{
+    io_register_file(engine, fd);
+    engine->is_writer = 1;
+    engine->is_direct = 0;
+    engine->drop_behind = 0;
+    engine->next_offset = offset;
+}
+
+int io_writer_write(io_engine_t *engine, const void *buf, size_t len)
+{
+    const char *in = buf;
+    while (len > 0)
+    {
+        io_block_t *block = &engine->blocks[engine->head];
+        io_writer_check(engine, engine->head);
+        if (engine->error != 0)
+        {
+            errno = engine->error;
+            return -1;
+        }
+        if (block->length == 0)
+            block->offset = engine->next_offset;
+        size_t length = IO_BLOCK_SIZE - block->length < len ? IO_BLOCK_SIZE - block->length : len;
+        memcpy(block_data(engine, engine->head) + block->length, in, length);
+        block->length += length;
+        engine->next_offset += length;
+        in += length;
+        len -= length;
+        if (block->length == IO_BLOCK_SIZE)
+        {
+            io_queue(engine, engine->head);
+            if (engine->ring_fd != -1)
+                io_submit(engine);
+            engine->head = (engine->head + 1) % IO_QUEUE_DEPTH;
+        }
+    }
+    return 0;
+}
+
+int io_writer_close(io_engine_t *engine)
+{
+    int i;
+    io_block_t *block = &engine->blocks[engine->head];
+    if (block->state == IO_BLOCK_FREE && block->length > 0)
+    {
+        io_queue(engine, engine->head);
+        if (engine->ring_fd != -1)
+            io_submit(engine);
+    }
+    for (i = 0; i < IO_QUEUE_DEPTH; i++)
+        io_writer_check(engine, i);
+    io_unregister_file(engine);
+    if (engine->error != 0)
+    {
+        errno = engine->error;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,420 @@
+#include "../include/journal.h"
+#include "../include/checksum.h"
+#include "../include/logger.h"
+#include "../include/shard.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define RECORD_SUMMED_FROM offsetof(journal_record_t, reserved)
+
+// A file as it was when a record was made, see journal_record_t
+typedef struct
+{
+    char file[MAX_FILENAME_LENGTH];
+    uint64_t inode;
+    int64_t birth;
+} file_identity_t;
+
+static void identify(int fd, uint64_t *inode, int64_t *birth)
+{
+    struct statx stx;
+    *inode = 0;
+    *birth = 0;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_INO | STATX_BTIME, &stx) == -1)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+            *inode = st.st_ino;
+        return;
+    }
+    *inode = stx.stx_ino;
+    if (stx.stx_mask & STATX_BTIME)
+        *birth = (int64_t)stx.stx_btime.tv_sec * 1000000000 + stx.stx_btime.tv_nsec;
+}
+
+static uint32_t record_checksum(const journal_record_t *record, const void *data)
+{
+    uint32_t crc = crc32c(0, (const char *)record + RECORD_SUMMED_FROM, sizeof(*record) - RECORD_SUMMED_FROM);
+    return crc32c(crc, data, record->length);
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t bytes_written = pwrite(fd, p, len, offset);
+        if (bytes_written == -1)
+            return -1;
+        p += bytes_written;
+        len -= bytes_written;
+        offset += bytes_written;
+    }
+    return 0;
+}
+
+/*
+ Opens the file a record was made for, or returns -1 when the file there
+ now is a different one. A file whose creation did not survive the crash
+ is created again and remembered, later records for it go there too.
+*/
+static int open_target(const char *dirname, journal_record_t *record, file_identity_t **created, long long *count)
+{
+    char path[MAX_PATH_LENGTH];
+    uint64_t inode;
+    int64_t birth;
+    long long i;
+    shard_path(dirname, record->file, path, sizeof(path));
+    int fd = open(path, O_WRONLY);
+    if (fd == -1 && errno == ENOENT)
+    {
+        fd = open(path, O_WRONLY | O_CREAT, 0777);
+        file_identity_t *grown = realloc(*created, (*count + 1) * sizeof(file_identity_t));
+        if (fd == -1 || grown == NULL)
+            return -1;
+        *created = grown;
+        strcpy((*created)[*count].file, record->file);
+        (*created)[*count].inode = record->inode;
+        (*created)[*count].birth = record->birth;
+        (*count)++;
+        return fd;
+    }
+    if (fd == -1)
+        return -1;
+    identify(fd, &inode, &birth);
+    if (inode == record->inode && birth == record->birth)
+        return fd;
+    for (i = 0; i < *count; i++)
+    {
+        if (strcmp((*created)[i].file, record->file) == 0 && (*created)[i].inode == record->inode &&
+            (*created)[i].birth == record->birth)
+            return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+void journal_replay(const char *dirname, int log_fd)
+{
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", dirname, JOURNAL_FILE_NAME);
+    int fd = open(path, O_RDWR);
+    if (fd == -1)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+
+    // Records end at the first one that is torn or does not add up
+    journal_record_t record;
+    file_identity_t *created = NULL;
+    long long created_count = 0, applied = 0, skipped = 0;
+    off_t pos = 0;
+    while (pos + (off_t)sizeof(record) <= st.st_size &&
+           pread(fd, &record, sizeof(record), pos) == (ssize_t)sizeof(record))
+    {
+        if (record.magic != JOURNAL_MAGIC || pos + (off_t)sizeof(record) + record.length > st.st_size ||
+            memchr(record.file, '\0', sizeof(record.file)) == NULL || strchr(record.file, '/') != NULL ||
+            record.file[0] == '\0' || record.file[0] == '.')
+            break;
+        char *data = malloc(record.length + 1);
+        if (data == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        if (pread(fd, data, record.length, pos + sizeof(record)) != (ssize_t)record.length ||
+            record_checksum(&record, data) != record.checksum)
+        {
+            free(data);
+            break;
+        }
+        int target_fd = open_target(dirname, &record, &created, &created_count);
+        if (target_fd != -1 && pwrite_full(target_fd, data, record.length, record.offset) == 0)
+            applied++;
+        else
+            skipped++;
+        if (target_fd != -1)
+            close(target_fd);
+        free(data);
+        pos += sizeof(record) + record.length;
+    }
+    free(created);
+
+    // Only once the files hold the records may they go
+    syncfs(fd);
+    if (ftruncate(fd, 0) == -1)
+        perror("Error truncating journal");
+    fsync(fd);
+    close(fd);
+    if (applied > 0 || skipped > 0 || pos < st.st_size)
+        my_log(log_fd, ">> Replayed %lld journal records, %lld were superseded, %lld torn bytes dropped\n", applied,
+               skipped, (long long)(st.st_size - pos));
+}
+
+journal_t *journal_open(const char *dirname, int commit_ms)
+{
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/%s", dirname, JOURNAL_FILE_NAME);
+    journal_t *journal = mmap(NULL, sizeof(journal_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (journal == MAP_FAILED)
+    {
+        perror("Error mapping shared memory");
+        exit(EXIT_FAILURE);
+    }
+    memset(journal, 0, sizeof(*journal));
+    journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (journal->fd == -1)
+    {
+        perror("Error opening journal");
+        exit(EXIT_FAILURE);
+    }
+    journal->size = lseek(journal->fd, 0, SEEK_END);
+    journal->commit_ms = commit_ms;
+    snprintf(journal->dirname, sizeof(journal->dirname), "%s", dirname);
+
+    // A child killed while holding the lock must not take the others with it
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&journal->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal->changed, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    return journal;
+}
+
+static void journal_lock(journal_t *journal)
+{
+    if (pthread_mutex_lock(&journal->lock) == EOWNERDEAD)
+        pthread_mutex_consistent(&journal->lock);
+}
+
+static void deadline_after(struct timespec *deadline, int ms)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ms / 1000;
+    deadline->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline->tv_nsec >= 1000000000)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static int journal_wait(journal_t *journal, const struct timespec *deadline)
+{
+    int status = pthread_cond_timedwait(&journal->changed, &journal->lock, deadline);
+    if (status == EOWNERDEAD)
+        pthread_mutex_consistent(&journal->lock);
+    return status;
+}
+
+/*
+ Called with the lock held, returns 0 with it held once lsn is durable.
+ After a failed fdatasync nothing says what reached the disk, the records
+ that were not yet durable are dropped and the journal takes no more.
+*/
+static int wait_durable(journal_t *journal, uint64_t lsn)
+{
+    struct timespec deadline;
+    while (journal->durable_lsn < lsn)
+    {
+        if (journal->is_failed)
+        {
+            errno = EIO;
+            return -1;
+        }
+        if (journal->has_leader)
+        {
+            deadline_after(&deadline, JOURNAL_LEADER_TIMEOUT_MS);
+            if (journal_wait(journal, &deadline) == ETIMEDOUT && journal->has_leader &&
+                kill(journal->leader, 0) == -1 && errno == ESRCH)
+                journal->has_leader = 0;
+            continue;
+        }
+
+        // Lead this group: give others a moment to join, then sync for all
+        journal->has_leader = 1;
+        journal->leader = getpid();
+        deadline_after(&deadline, journal->commit_ms);
+        while (journal->commit_ms > 0 && journal->records - journal->durable_records < JOURNAL_COMMIT_RECORDS &&
+               journal_wait(journal, &deadline) != ETIMEDOUT)
+            ;
+        uint64_t target = journal->appended_lsn;
+        long long target_records = journal->records;
+        pthread_mutex_unlock(&journal->lock);
+        int status = fdatasync(journal->fd);
+        journal_lock(journal);
+        if (status == -1)
+        {
+            perror("Error syncing journal");
+            journal->is_failed = 1;
+            off_t durable_size = journal->size - (off_t)(journal->appended_lsn - journal->durable_lsn);
+            if (ftruncate(journal->fd, durable_size) == -1)
+                perror("Error truncating journal");
+            journal->size = durable_size;
+        }
+        else if (target > journal->durable_lsn)
+        {
+            journal->durable_lsn = target;
+            journal->durable_records = target_records;
+        }
+        journal->has_leader = 0;
+        pthread_cond_broadcast(&journal->changed);
+    }
+    return 0;
+}
+
+/*
+ Every record has reached its file, make sure those writes are durable
+ before dropping the records. The record of a child that dies between
+ it and its write is redone by journal_abandon before it stops counting.
+*/
+static void checkpoint(journal_t *journal)
+{
+    if (journal->size < JOURNAL_CHECKPOINT_SIZE || journal->unapplied > 0 || journal->has_leader)
+        return;
+    if (syncfs(journal->fd) == -1 || ftruncate(journal->fd, 0) == -1)
+    {
+        perror("Error checkpointing journal");
+        return;
+    }
+    journal->size = 0;
+}
+
+int journal_write(journal_t *journal, const char *file, int fd, off_t offset, const void *data, size_t length,
+                  long long *held)
+{
+    size_t total = sizeof(journal_record_t) + length;
+    char *buf = malloc(total);
+    if (buf == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    journal_record_t *record = (journal_record_t *)buf;
+    memset(record, 0, sizeof(*record));
+    record->magic = JOURNAL_MAGIC;
+    record->length = length;
+    record->offset = offset;
+    strncpy(record->file, file, sizeof(record->file) - 1);
+    identify(fd, &record->inode, &record->birth);
+    memcpy(buf + sizeof(*record), data, length);
+    record->checksum = record_checksum(record, data);
+
+    journal_lock(journal);
+    if (journal->is_failed)
+    {
+        pthread_mutex_unlock(&journal->lock);
+        free(buf);
+        errno = EIO;
+        return -1;
+    }
+    ssize_t bytes_written = write(journal->fd, buf, total);
+    free(buf);
+    if (bytes_written != (ssize_t)total)
+    {
+        int write_errno = bytes_written == -1 ? errno : ENOSPC;
+        // Leave no torn record behind for the next one to follow
+        if (bytes_written > 0 && ftruncate(journal->fd, journal->size) == -1)
+            perror("Error truncating journal");
+        pthread_mutex_unlock(&journal->lock);
+        errno = write_errno;
+        return -1;
+    }
+    *held = journal->size;
+    journal->size += total;
+    journal->appended_lsn += total;
+    journal->records++;
+    journal->unapplied++;
+    uint64_t lsn = journal->appended_lsn;
+    pthread_cond_broadcast(&journal->changed);
+    int status = wait_durable(journal, lsn);
+    if (status == -1)
+    {
+        int sync_errno = errno;
+        *held = -1;
+        journal->unapplied--;
+        pthread_mutex_unlock(&journal->lock);
+        errno = sync_errno;
+        return -1;
+    }
+    pthread_mutex_unlock(&journal->lock);
+
+    status = pwrite_full(fd, data, length, offset);
+    int write_errno = errno;
+    journal_lock(journal);
+    *held = -1;
+    journal->unapplied--;
+    checkpoint(journal);
+    pthread_mutex_unlock(&journal->lock);
+    errno = write_errno;
+    return status;
+}
+
+void journal_abandon(journal_t *journal, long long *held)
+{
+    journal_record_t record;
+    journal_lock(journal);
+    if (*held == -1)
+    {
+        pthread_mutex_unlock(&journal->lock);
+        return;
+    }
+    // The record is redone like a replay would, it may have been durable and acknowledged
+    off_t pos = *held;
+    *held = -1;
+    journal->unapplied--;
+    if (!journal->is_failed && pos + (off_t)sizeof(record) <= journal->size &&
+        pread(journal->fd, &record, sizeof(record), pos) == (ssize_t)sizeof(record) &&
+        record.magic == JOURNAL_MAGIC && pos + (off_t)sizeof(record) + record.length <= journal->size)
+    {
+        char *data = malloc(record.length + 1);
+        if (data != NULL && pread(journal->fd, data, record.length, pos + sizeof(record)) == (ssize_t)record.length &&
+            record_checksum(&record, data) == record.checksum)
+        {
+            char path[MAX_PATH_LENGTH];
+            uint64_t inode;
+            int64_t birth;
+            shard_path(journal->dirname, record.file, path, sizeof(path));
+            int fd = open(path, O_WRONLY);
+            if (fd != -1)
+            {
+                identify(fd, &inode, &birth);
+                if (inode == record.inode && birth == record.birth &&
+                    pwrite_full(fd, data, record.length, record.offset) == -1)
+                    perror("Error redoing journal record");
+                close(fd);
+            }
+        }
+        free(data);
+    }
+    checkpoint(journal);
+    pthread_mutex_unlock(&journal->lock);
+}
+
+void journal_close(journal_t *journal)
+{
+    journal_lock(journal);
+    if (journal->unapplied == 0 && !journal->is_failed &&
+        (syncfs(journal->fd) == -1 || ftruncate(journal->fd, 0) == -1))
+        perror("Error checkpointing journal");
+    pthread_mutex_unlock(&journal->lock);
+    close(journal->fd);
+}
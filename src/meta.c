@@ -0,0 +1,281 @@
+#include "../include/meta.h"
+#include "../include/checksum.h"
+#include "../include/logger.h"
+#include "../include/shard.h"
+#include "../include/storage.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#define META_WATCH_EVENTS (IN_CREATE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB)
+
+meta_cache_t *meta_init()
+{
+    meta_cache_t *cache = mmap(NULL, sizeof(meta_cache_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (cache == MAP_FAILED)
+    {
+        perror("Error mapping shared memory");
+        exit(EXIT_FAILURE);
+    }
+    // Fresh anonymous pages are zero, every entry starts out META_EMPTY
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    int i;
+    for (i = 0; i < META_LOCKS; i++)
+        pthread_mutex_init(&cache->locks[i], &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    return cache;
+}
+
+static void meta_lock(meta_cache_t *cache, int lock)
+{
+    if (pthread_mutex_lock(&cache->locks[lock]) == EOWNERDEAD)
+        pthread_mutex_consistent(&cache->locks[lock]);
+}
+
+static void hash_name(const char *file, uint32_t *h1, uint32_t *h2)
+{
+    size_t length = strlen(file);
+    *h1 = crc32c(0, file, length);
+    *h2 = crc32c(0x9e3779b9u, file, length) | 1;
+}
+
+static void bloom_add(uint64_t *bloom, uint32_t h1, uint32_t h2)
+{
+    int i;
+    for (i = 0; i < META_BLOOM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % META_BLOOM_BITS;
+        __atomic_fetch_or(&bloom[bit / 64], 1ull << (bit % 64), __ATOMIC_RELAXED);
+    }
+}
+
+static int bloom_test(const uint64_t *bloom, uint32_t h1, uint32_t h2)
+{
+    int i;
+    for (i = 0; i < META_BLOOM_HASHES; i++)
+    {
+        uint32_t bit = (h1 + i * h2) % META_BLOOM_BITS;
+        if (!(__atomic_load_n(&bloom[bit / 64], __ATOMIC_RELAXED) & (1ull << (bit % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+static meta_entry_t *find_way(meta_cache_t *cache, uint32_t set, const char *file)
+{
+    int way;
+    for (way = 0; way < META_WAYS; way++)
+    {
+        meta_entry_t *entry = &cache->entries[set][way];
+        if (entry->state != META_EMPTY && strcmp(entry->file, file) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// What the file system says, the way a reader would see the file
+static int lookup_file(const char *dirname, const char *file, meta_entry_t *entry)
+{
+    char path[MAX_PATH_LENGTH];
+    stored_file_t stored;
+    struct stat st;
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->file, sizeof(entry->file), "%s", file);
+    entry->lines = -1;
+    entry->state = META_ABSENT;
+    shard_path(dirname, file, path, sizeof(path));
+    if (storage_open(&stored, dirname, path) == -1)
+        return 0;
+    if (fstat(stored.fd, &st) == 0)
+    {
+        entry->state = META_PRESENT;
+        entry->inode = st.st_ino;
+        entry->size = stored.size;
+        entry->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+    storage_close(&stored);
+    return entry->state == META_PRESENT;
+}
+
+int meta_lookup(meta_cache_t *cache, const char *dirname, const char *file, meta_entry_t *entry)
+{
+    uint32_t h1, h2;
+    if (!__atomic_load_n(&cache->is_ready, __ATOMIC_ACQUIRE) || strlen(file) >= MAX_FILENAME_LENGTH)
+        return lookup_file(dirname, file, entry);
+    hash_name(file, &h1, &h2);
+    if (!bloom_test(cache->bloom[__atomic_load_n(&cache->active_bloom, __ATOMIC_ACQUIRE)], h1, h2))
+    {
+        memset(entry, 0, sizeof(*entry));
+        entry->state = META_ABSENT;
+        return 0;
+    }
+
+    uint32_t set = h1 % META_SETS;
+    int lock = set % META_LOCKS;
+    meta_lock(cache, lock);
+    meta_entry_t *cached = find_way(cache, set, file);
+    if (cached != NULL)
+    {
+        cached->used = ++cache->tick;
+        *entry = *cached;
+        pthread_mutex_unlock(&cache->locks[lock]);
+        return entry->state == META_PRESENT;
+    }
+    uint64_t changes = cache->changes[lock];
+    pthread_mutex_unlock(&cache->locks[lock]);
+
+    int is_present = lookup_file(dirname, file, entry);
+    meta_lock(cache, lock);
+    // A change while the file system was asked may have made the answer stale
+    if (cache->changes[lock] == changes && find_way(cache, set, file) == NULL)
+    {
+        meta_entry_t *victim = &cache->entries[set][0];
+        int way;
+        for (way = 1; way < META_WAYS && victim->state != META_EMPTY; way++)
+        {
+            meta_entry_t *candidate = &cache->entries[set][way];
+            if (candidate->state == META_EMPTY || candidate->used < victim->used)
+                victim = candidate;
+        }
+        *victim = *entry;
+        victim->used = ++cache->tick;
+    }
+    pthread_mutex_unlock(&cache->locks[lock]);
+    return is_present;
+}
+
+void meta_changed(meta_cache_t *cache, const char *file)
+{
+    uint32_t h1, h2;
+    if (strlen(file) >= MAX_FILENAME_LENGTH)
+        return;
+    hash_name(file, &h1, &h2);
+    // Into both filters, the one being rebuilt must not miss it either
+    bloom_add(cache->bloom[0], h1, h2);
+    bloom_add(cache->bloom[1], h1, h2);
+    uint32_t set = h1 % META_SETS;
+    int lock = set % META_LOCKS;
+    meta_lock(cache, lock);
+    meta_entry_t *cached = find_way(cache, set, file);
+    if (cached != NULL)
+        cached->state = META_EMPTY;
+    cache->changes[lock]++;
+    pthread_mutex_unlock(&cache->locks[lock]);
+}
+
+void meta_set_lines(meta_cache_t *cache, const meta_entry_t *entry, long long lines)
+{
+    uint32_t h1, h2;
+    if (entry->state != META_PRESENT)
+        return;
+    hash_name(entry->file, &h1, &h2);
+    uint32_t set = h1 % META_SETS;
+    int lock = set % META_LOCKS;
+    meta_lock(cache, lock);
+    meta_entry_t *cached = find_way(cache, set, entry->file);
+    if (cached != NULL && cached->state == META_PRESENT && cached->inode == entry->inode &&
+        cached->size == entry->size && cached->mtime == entry->mtime)
+        cached->lines = lines;
+    pthread_mutex_unlock(&cache->locks[lock]);
+}
+
+// Fills the filter not in use with every name there is now and puts it in use
+static void rebuild(meta_cache_t *cache, const char *dirname)
+{
+    char **names;
+    uint32_t h1, h2;
+    int next = !cache->active_bloom, lock;
+    long long count, i;
+    memset(cache->bloom[next], 0, sizeof(cache->bloom[next]));
+    count = shard_list(dirname, &names);
+    for (i = 0; i < count; i++)
+    {
+        hash_name(names[i], &h1, &h2);
+        bloom_add(cache->bloom[next], h1, h2);
+    }
+    shard_free_names(names, count);
+    __atomic_store_n(&cache->active_bloom, next, __ATOMIC_RELEASE);
+    // Whatever the table says may be from before the events that were lost
+    for (lock = 0; lock < META_LOCKS; lock++)
+    {
+        uint32_t set;
+        int way;
+        meta_lock(cache, lock);
+        for (set = lock; set < META_SETS; set += META_LOCKS)
+        {
+            for (way = 0; way < META_WAYS; way++)
+                cache->entries[set][way].state = META_EMPTY;
+        }
+        cache->changes[lock]++;
+        pthread_mutex_unlock(&cache->locks[lock]);
+    }
+}
+
+void meta_run(meta_cache_t *cache, const char *dirname, int log_fd)
+{
+    char watch_path[MAX_PATH_LENGTH];
+    int i;
+    setpriority(PRIO_PROCESS, 0, 5);
+    // Watch before filling the filter so no name falls in between
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd != -1 && inotify_add_watch(inotify_fd, dirname, META_WATCH_EVENTS) == -1)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    for (i = 0; inotify_fd != -1 && shard_is_enabled() && i < SHARD_COUNT; i++)
+    {
+        snprintf(watch_path, sizeof(watch_path), "%s/%s/%02x", dirname, SHARD_DIR, i);
+        if (inotify_add_watch(inotify_fd, watch_path, META_WATCH_EVENTS) == -1)
+        {
+            close(inotify_fd);
+            inotify_fd = -1;
+        }
+    }
+    if (inotify_fd == -1)
+    {
+        my_log(log_fd, ">> Metadata cache off, can not follow changes: %s\n", strerror(errno));
+        return;
+    }
+    rebuild(cache, dirname);
+    __atomic_store_n(&cache->is_ready, 1, __ATOMIC_RELEASE);
+
+    while (1)
+    {
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t length = read(inotify_fd, events, sizeof(events));
+        ssize_t offset = 0;
+        int is_overflow = 0;
+        if (length == -1)
+        {
+            if (errno != EINTR)
+                perror("inotify");
+            break;
+        }
+        while (offset < length)
+        {
+            struct inotify_event *event = (struct inotify_event *)(events + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+                is_overflow = 1;
+            // Hidden names are temporaries and the server's own files
+            if (event->len == 0 || event->name[0] == '.' || (event->mask & IN_ISDIR))
+                continue;
+            meta_changed(cache, event->name);
+        }
+        if (is_overflow)
+            rebuild(cache, dirname);
+    }
+    // Nobody keeps the cache coherent any more
+    __atomic_store_n(&cache->is_ready, 0, __ATOMIC_RELEASE);
+    close(inotify_fd);
+}
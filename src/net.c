@@ -0,0 +1,116 @@
+#include "../include/net.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ Splits "[host:]port" at the last colon. host is left empty when the
+ address is just a port.
+*/
+static int split_address(const char *address, char *host, size_t host_size, const char **port)
+{
+    const char *colon = strrchr(address, ':');
+    host[0] = '\0';
+    *port = address;
+    if (colon == NULL)
+        return 0;
+    *port = colon + 1;
+    size_t length = colon - address;
+    if (length >= 2 && address[0] == '[' && address[length - 1] == ']')
+    {
+        address++;
+        length -= 2;
+    }
+    if (length >= host_size)
+        return -1;
+    memcpy(host, address, length);
+    host[length] = '\0';
+    return 0;
+}
+
+void tcp_set_nodelay(int sock_fd)
+{
+    int one = 1;
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int tcp_listen(const char *address)
+{
+    char host[MAX_HOST_LENGTH];
+    const char *port;
+    struct addrinfo hints, *result, *ai;
+    int listen_fd = -1, one = 1;
+    if (split_address(address, host, sizeof(host), &port) == -1)
+    {
+        fprintf(stderr, "Invalid listen address %s\n", address);
+        exit(EXIT_FAILURE);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    // Every interface has to be asked for, the clients dial either loopback
+    int status = getaddrinfo(host[0] != '\0' ? host : "127.0.0.1", port, &hints, &result);
+    if (status != 0)
+    {
+        fprintf(stderr, "Invalid listen address %s: %s\n", address, gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+    for (ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        listen_fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+        if (listen_fd == -1)
+            continue;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(listen_fd, TCP_LISTEN_BACKLOG) == 0)
+            break;
+        close(listen_fd);
+        listen_fd = -1;
+    }
+    freeaddrinfo(result);
+    if (listen_fd == -1)
+    {
+        perror("Error while binding TCP listener");
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
+int tcp_connect(const char *address)
+{
+    char host[MAX_HOST_LENGTH];
+    const char *port;
+    struct addrinfo hints, *result, *ai;
+    int sock_fd = -1;
+    if (split_address(address, host, sizeof(host), &port) == -1)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &result) != 0)
+    {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (ai = result; ai != NULL; ai = ai->ai_next)
+    {
+        sock_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock_fd == -1)
+            continue;
+        if (connect(sock_fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(sock_fd);
+        sock_fd = -1;
+    }
+    freeaddrinfo(result);
+    if (sock_fd != -1)
+        tcp_set_nodelay(sock_fd);
+    return sock_fd;
+}
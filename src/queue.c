@@ -1,56 +1,157 @@
 #include "../include/queue.h"
 
-queue_t *queue_create()
+void queue_init(queue_t *queue)
 {
-    queue_t *queue = malloc(sizeof(queue_t));
-    queue->data = malloc(sizeof(void *) * 1);
-    queue->front = 0;
-    queue->rear = -1;
-    queue->capacity = 1;
-    queue->size = 0;
-    return queue;
+    unsigned long i;
+    for (i = 0; i < QUEUE_CAPACITY; i++)
+        __atomic_store_n(&queue->slots[i].sequence, i, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->enqueue_pos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->dequeue_pos, 0, __ATOMIC_RELEASE);
 }
 
-void queue_destroy(queue_t *queue)
+int queue_enqueue(queue_t *queue, const client_info_t *client)
 {
-    free(queue->data);
-    free(queue);
+    unsigned long pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    queue_slot_t *slot;
+    while (1)
+    {
+        slot = &queue->slots[pos & (QUEUE_CAPACITY - 1)];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - pos);
+        if (diff == 0)
+        {
+            // The slot is free on this lap, try to claim the position
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1; // still holds an entry from the previous lap
+        else
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    }
+    slot->client = *client;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
 }
 
-void queue_enqueue(queue_t *queue, void *item)
+int queue_dequeue(queue_t *queue, client_info_t *client)
 {
-    if (queue->size == queue->capacity)
+    unsigned long pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    queue_slot_t *slot;
+    while (1)
     {
-        queue->capacity *= 2;
-        queue->data = realloc(queue->data, sizeof(void *) * queue->capacity);
+        slot = &queue->slots[pos & (QUEUE_CAPACITY - 1)];
+        unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        long diff = (long)(sequence - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1; // empty, or the producer has not finished writing yet
+        else
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
     }
-    queue->rear = (queue->rear + 1) % queue->capacity;
-    queue->data[queue->rear] = item;
-    queue->size++;
+    *client = slot->client;
+    // Free the slot for the producer one lap ahead
+    __atomic_store_n(&slot->sequence, pos + QUEUE_CAPACITY, __ATOMIC_RELEASE);
+    return 0;
 }
 
-void *queue_dequeue(queue_t *queue)
+int queue_size(queue_t *queue)
 {
-    if (queue->size == 0)
+    unsigned long dequeue_pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_ACQUIRE);
+    unsigned long enqueue_pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_ACQUIRE);
+    long size = (long)(enqueue_pos - dequeue_pos);
+    return size < 0 ? 0 : (int)size;
+}
+
+void admission_queue_init(admission_queue_t *queue)
+{
+    int i;
+    for (i = 0; i < PRIORITY_CLASSES; i++)
+        queue_init(&queue->classes[i]);
+    for (i = 0; i < ADMISSION_WAITERS; i++)
     {
-        return NULL;
+        sem_init(&queue->waiters[i].wakeup, 1, 0);
+        queue->waiters[i].in_use = 0;
     }
-    void *item = queue->data[queue->front];
-    queue->front = (queue->front + 1) % queue->capacity;
-    queue->size--;
-    return item;
+    __atomic_store_n(&queue->active, 0, __ATOMIC_RELEASE);
+}
+
+int admission_enqueue(admission_queue_t *queue, const client_info_t *client)
+{
+    int priority = client->priority;
+    if (priority < 0 || priority >= PRIORITY_CLASSES)
+        priority = PRIORITY_NORMAL;
+    return queue_enqueue(&queue->classes[priority], client);
 }
 
-void *queue_peek(queue_t *queue)
+int admission_dequeue(admission_queue_t *queue, client_info_t *client)
 {
-    if (queue->size == 0)
+    int i;
+    for (i = 0; i < PRIORITY_CLASSES; i++)
     {
-        return NULL;
+        if (queue_dequeue(&queue->classes[i], client) == 0)
+            return 0;
     }
-    return queue->data[queue->front];
+    return -1;
 }
 
-int queue_size(queue_t *queue)
+int admission_waiting(admission_queue_t *queue)
 {
-    return queue->size;
-}
\ No newline at end of file
+    int i, waiting = 0;
+    for (i = 0; i < PRIORITY_CLASSES; i++)
+        waiting += queue_size(&queue->classes[i]);
+    return waiting;
+}
+
+int admission_waiter_claim(admission_queue_t *queue)
+{
+    int i;
+    for (i = 0; i < ADMISSION_WAITERS; i++)
+    {
+        int expected = ADMISSION_WAITER_FREE;
+        if (__atomic_compare_exchange_n(&queue->waiters[i].in_use, &expected, ADMISSION_WAITER_QUEUED, 0, __ATOMIC_ACQ_REL,
+                                        __ATOMIC_RELAXED))
+            return i;
+    }
+    return -1;
+}
+
+void admission_waiter_release(admission_queue_t *queue, int waiter)
+{
+    __atomic_store_n(&queue->waiters[waiter].in_use, ADMISSION_WAITER_FREE, __ATOMIC_RELEASE);
+}
+
+// The waker and the supervisor of a dead child race for the waiter, the state says who won
+int admission_waiter_wake(admission_queue_t *queue, int waiter)
+{
+    int expected = ADMISSION_WAITER_QUEUED;
+    if (__atomic_compare_exchange_n(&queue->waiters[waiter].in_use, &expected, ADMISSION_WAITER_ADMITTED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        sem_post(&queue->waiters[waiter].wakeup);
+        return 1;
+    }
+    admission_waiter_release(queue, waiter);
+    return 0;
+}
+
+int admission_waiter_abandon(admission_queue_t *queue, int waiter)
+{
+    int expected = ADMISSION_WAITER_QUEUED;
+    // Still in the ring, whoever takes it out frees it
+    if (__atomic_compare_exchange_n(&queue->waiters[waiter].in_use, &expected, ADMISSION_WAITER_ABANDONED, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return 0;
+    if (expected != ADMISSION_WAITER_ADMITTED)
+        return 0;
+    while (sem_trywait(&queue->waiters[waiter].wakeup) == 0)
+        ;
+    admission_waiter_release(queue, waiter);
+    return 1;
+}
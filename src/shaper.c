@@ -0,0 +1,126 @@
+#include "../include/shaper.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Not exported by glibc, see ioprio_set(2)
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_VALUE(class, level) (((class) << IOPRIO_CLASS_SHIFT) | (level))
+
+#define BURST_SECONDS 0.25
+
+static const int priority_weights[PRIORITY_CLASSES] = {4, 2, 1};
+// Best effort levels 0-7, lower runs first, indexed by priority then traffic
+static const int priority_levels[PRIORITY_CLASSES][2] = {{0, 4}, {2, 6}, {4, 7}};
+
+// Weight this process holds in the fair share, given back at exit
+static bandwidth_t *joined_bandwidth;
+static int joined_weight;
+static int is_exit_registered;
+
+static double elapsed(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+static void bucket_init(token_bucket_t *bucket, double rate)
+{
+    bucket->rate = rate;
+    bucket->burst = rate * BURST_SECONDS;
+    if (bucket->burst < CHUNK_SIZE)
+        bucket->burst = CHUNK_SIZE;
+    bucket->tokens = bucket->burst;
+    clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/*
+ Takes bytes out of the bucket refilled at rate and returns how long to
+ wait before the debt is paid back. A transfer may overdraw by one chunk
+ so it never has to split a frame.
+*/
+static double bucket_take(token_bucket_t *bucket, double rate, size_t bytes)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bucket->tokens += elapsed(&bucket->last, &now) * rate;
+    if (bucket->tokens > bucket->burst)
+        bucket->tokens = bucket->burst;
+    bucket->last = now;
+    bucket->tokens -= bytes;
+    return bucket->tokens < 0 ? -bucket->tokens / rate : 0;
+}
+
+static void shaper_exit()
+{
+    if (joined_bandwidth != NULL)
+        __atomic_sub_fetch(&joined_bandwidth->total_weight, joined_weight, __ATOMIC_ACQ_REL);
+    joined_bandwidth = NULL;
+}
+
+void shaper_init(shaper_t *shaper, bandwidth_t *shared, const server_config_t *config, priority_t priority)
+{
+    memset(shaper, 0, sizeof(*shaper));
+    if (priority < 0 || priority >= PRIORITY_CLASSES)
+        priority = PRIORITY_NORMAL;
+    bucket_init(&shaper->buckets[TRAFFIC_INTERACTIVE], config->interactive_rate);
+    bucket_init(&shaper->buckets[TRAFFIC_BULK], config->client_rate);
+    shaper->shared = shared;
+    shaper->shared_rate = config->bulk_rate;
+    shaper->weight = priority_weights[priority];
+    shaper->priority = priority;
+    // A child that exits in the middle of a transfer still gives its share back
+    if (!is_exit_registered)
+        atexit(shaper_exit);
+    is_exit_registered = 1;
+}
+
+void shaper_begin(shaper_t *shaper, traffic_class_t traffic)
+{
+    // Only schedulers with I/O priorities (BFQ) honour this, failure is harmless
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+            IOPRIO_VALUE(IOPRIO_CLASS_BE, priority_levels[shaper->priority][traffic]));
+    if (traffic == TRAFFIC_BULK && !shaper->in_bulk && shaper->shared != NULL)
+    {
+        __atomic_add_fetch(&shaper->shared->total_weight, shaper->weight, __ATOMIC_ACQ_REL);
+        shaper->in_bulk = 1;
+        joined_bandwidth = shaper->shared;
+        joined_weight = shaper->weight;
+    }
+}
+
+void shaper_throttle(shaper_t *shaper, traffic_class_t traffic, size_t bytes)
+{
+    token_bucket_t *bucket = &shaper->buckets[traffic];
+    double rate = bucket->rate;
+    if (traffic == TRAFFIC_BULK && shaper->shared_rate > 0 && shaper->in_bulk)
+    {
+        int total_weight = __atomic_load_n(&shaper->shared->total_weight, __ATOMIC_ACQUIRE);
+        double share = shaper->shared_rate * shaper->weight / (total_weight > 0 ? total_weight : shaper->weight);
+        if (rate == 0 || share < rate)
+            rate = share;
+    }
+    if (rate <= 0)
+        return;
+
+    double wait = bucket_take(bucket, rate, bytes);
+    if (wait > 0)
+    {
+        struct timespec delay;
+        delay.tv_sec = (time_t)wait;
+        delay.tv_nsec = (long)((wait - delay.tv_sec) * 1e9);
+        // A signal cuts the wait short so the child can wind down
+        nanosleep(&delay, NULL);
+    }
+}
+
+void shaper_end(shaper_t *shaper)
+{
+    if (shaper->in_bulk)
+    {
+        shaper_exit();
+        shaper->in_bulk = 0;
+    }
+}
@@ -0,0 +1,300 @@
+#include "../include/shard.h"
+#include "../include/checksum.h"
+#include "../include/logger.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+static int is_sharded = 0;
+static volatile int *flat_left; // shared, cleared once nothing lies flat any more
+
+// Names found by one lister, sorted before they are merged
+typedef struct
+{
+    const char *dirname;
+    int first;
+    char **names;
+    long long count;
+    long long capacity;
+} shard_scan_t;
+
+static unsigned int shard_of(const char *file)
+{
+    return crc32c(0, file, strlen(file)) & (SHARD_COUNT - 1);
+}
+
+void shard_setup(const char *dirname, int is_wanted)
+{
+    char path[MAX_PATH_LENGTH];
+    struct stat st;
+    int i;
+    snprintf(path, sizeof(path), "%s/%s", dirname, SHARD_DIR);
+    if (!is_wanted && stat(path, &st) == -1)
+        return;
+    if (mkdir(path, 0777) == -1 && errno != EEXIST)
+    {
+        perror("Error creating shards");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < SHARD_COUNT; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s/%02x", dirname, SHARD_DIR, i);
+        if (mkdir(path, 0777) == -1 && errno != EEXIST)
+        {
+            perror("Error creating shards");
+            exit(EXIT_FAILURE);
+        }
+    }
+    flat_left = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flat_left == MAP_FAILED)
+    {
+        perror("Error mapping shared memory");
+        exit(EXIT_FAILURE);
+    }
+    *flat_left = 1;
+    is_sharded = 1;
+}
+
+int shard_is_enabled()
+{
+    return is_sharded;
+}
+
+void shard_path(const char *dirname, const char *file, char *path, size_t size)
+{
+    char flat_path[MAX_PATH_LENGTH];
+    if (!is_sharded)
+    {
+        snprintf(path, size, "%s/%s", dirname, file);
+        return;
+    }
+    snprintf(path, size, "%s/%s/%02x/%s", dirname, SHARD_DIR, shard_of(file), file);
+    if (!*flat_left || access(path, F_OK) == 0)
+        return;
+    // Not moved yet, callers that open or change it hold shard_lock so it stays put
+    snprintf(flat_path, sizeof(flat_path), "%s/%s", dirname, file);
+    if (access(flat_path, F_OK) == 0)
+        snprintf(path, size, "%s", flat_path);
+}
+
+void shard_dir(const char *dirname, const char *file, char *path, size_t size)
+{
+    if (is_sharded)
+        snprintf(path, size, "%s/%s/%02x", dirname, SHARD_DIR, shard_of(file));
+    else
+        snprintf(path, size, "%s", dirname);
+}
+
+// flock on the shard directory of file, -1 when nothing is left to move into it
+static int lock_shard(const char *dirname, const char *file, int operation)
+{
+    char path[MAX_PATH_LENGTH];
+    if (!is_sharded || !*flat_left)
+        return -1;
+    shard_dir(dirname, file, path, sizeof(path));
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd != -1 && flock(fd, operation) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int shard_lock(const char *dirname, const char *file)
+{
+    return lock_shard(dirname, file, LOCK_SH);
+}
+
+void shard_unlock(int lock_fd)
+{
+    // Closing the directory drops its flock
+    if (lock_fd != -1)
+        close(lock_fd);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void scan_dir(shard_scan_t *scan, const char *path)
+{
+    DIR *dir;
+    struct dirent *ent;
+    if ((dir = opendir(path)) == NULL)
+        return;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char file_path[MAX_PATH_LENGTH];
+        struct stat st;
+        // Hidden files are temporaries, the chunk store, the shards themselves
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) >= MAX_FILENAME_LENGTH)
+            continue;
+        if (ent->d_type == DT_UNKNOWN)
+        {
+            snprintf(file_path, sizeof(file_path), "%s/%s", path, ent->d_name);
+            if (stat(file_path, &st) == -1 || !S_ISREG(st.st_mode))
+                continue;
+        }
+        else if (ent->d_type != DT_REG)
+            continue;
+        if (scan->count == scan->capacity)
+        {
+            scan->capacity = scan->capacity == 0 ? 256 : scan->capacity * 2;
+            scan->names = realloc(scan->names, scan->capacity * sizeof(char *));
+            if (scan->names == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        scan->names[scan->count++] = strdup(ent->d_name);
+    }
+    closedir(dir);
+}
+
+static void *scan_shards(void *arg)
+{
+    shard_scan_t *scan = arg;
+    char path[MAX_PATH_LENGTH];
+    int i;
+    for (i = scan->first; i < SHARD_COUNT; i += SHARD_SCAN_THREADS)
+    {
+        snprintf(path, sizeof(path), "%s/%s/%02x", scan->dirname, SHARD_DIR, i);
+        scan_dir(scan, path);
+    }
+    if (scan->count > 1)
+        qsort(scan->names, scan->count, sizeof(char *), compare_names);
+    return NULL;
+}
+
+long long shard_list(const char *dirname, char ***names)
+{
+    shard_scan_t scans[SHARD_SCAN_THREADS + 1];
+    pthread_t threads[SHARD_SCAN_THREADS];
+    int started[SHARD_SCAN_THREADS];
+    long long total = 0, result = 0;
+    int i;
+    memset(scans, 0, sizeof(scans));
+    memset(started, 0, sizeof(started));
+
+    // Each lister takes every SHARD_SCAN_THREADS-th shard, the signals stay with the caller
+    if (is_sharded)
+    {
+        sigset_t all, orig;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &orig);
+        for (i = 0; i < SHARD_SCAN_THREADS; i++)
+        {
+            scans[i].dirname = dirname;
+            scans[i].first = i;
+            started[i] = pthread_create(&threads[i], NULL, scan_shards, &scans[i]) == 0;
+        }
+        pthread_sigmask(SIG_SETMASK, &orig, NULL);
+    }
+    // Files not moved into their shard yet, or all of them without shards
+    shard_scan_t *flat = &scans[SHARD_SCAN_THREADS];
+    if (!is_sharded || *flat_left)
+    {
+        scan_dir(flat, dirname);
+        if (flat->count > 1)
+            qsort(flat->names, flat->count, sizeof(char *), compare_names);
+    }
+    for (i = 0; is_sharded && i < SHARD_SCAN_THREADS; i++)
+    {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            scan_shards(&scans[i]);
+    }
+
+    // Merge the sorted lists, a name moved during the scan may show up twice
+    for (i = 0; i <= SHARD_SCAN_THREADS; i++)
+        total += scans[i].count;
+    *names = malloc((total + 1) * sizeof(char *));
+    if (*names == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    long long next[SHARD_SCAN_THREADS + 1];
+    memset(next, 0, sizeof(next));
+    while (1)
+    {
+        int smallest = -1;
+        for (i = 0; i <= SHARD_SCAN_THREADS; i++)
+        {
+            if (next[i] < scans[i].count &&
+                (smallest == -1 || strcmp(scans[i].names[next[i]], scans[smallest].names[next[smallest]]) < 0))
+                smallest = i;
+        }
+        if (smallest == -1)
+            break;
+        char *name = scans[smallest].names[next[smallest]++];
+        if (result > 0 && strcmp((*names)[result - 1], name) == 0)
+            free(name);
+        else
+            (*names)[result++] = name;
+    }
+    for (i = 0; i <= SHARD_SCAN_THREADS; i++)
+        free(scans[i].names);
+    return result;
+}
+
+void shard_free_names(char **names, long long count)
+{
+    long long i;
+    for (i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+void shard_migrate(const char *dirname, int log_fd, volatile sig_atomic_t *stop)
+{
+    char path[MAX_PATH_LENGTH], target[MAX_PATH_LENGTH];
+    long long moved = 0, left = 0;
+    DIR *dir;
+    struct dirent *ent;
+    if (!is_sharded || (dir = opendir(dirname)) == NULL)
+        return;
+    // Clients come first
+    setpriority(PRIO_PROCESS, 0, 10);
+    while (!*stop && (ent = readdir(dir)) != NULL)
+    {
+        struct stat st;
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) >= MAX_FILENAME_LENGTH)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dirname, ent->d_name);
+        if (lstat(path, &st) == -1 || !S_ISREG(st.st_mode))
+            continue;
+        snprintf(target, sizeof(target), "%s/%s/%02x/%s", dirname, SHARD_DIR, shard_of(ent->d_name), ent->d_name);
+        // Writers hold the shard shared from finding the path to their last change of it
+        int lock_fd = lock_shard(dirname, ent->d_name, LOCK_EX);
+        if (lock_fd == -1)
+        {
+            left++;
+            continue;
+        }
+        if (renameat2(AT_FDCWD, path, AT_FDCWD, target, RENAME_NOREPLACE) == 0)
+            moved++;
+        else if (errno != ENOENT)
+        {
+            my_log(log_fd, ">> Can not move '%s' into its shard: %s\n", ent->d_name, strerror(errno));
+            left++;
+        }
+        shard_unlock(lock_fd);
+    }
+    closedir(dir);
+    if (!*stop && left == 0)
+        *flat_left = 0;
+    if (moved > 0 || left > 0)
+        my_log(log_fd, ">> Moved %lld files into shards, %lld left where they were\n", moved, left);
+}
@@ -0,0 +1,814 @@
+#include "../include/storage.h"
+#include "../include/logger.h"
+#include "../include/version.h"
+#include "../include/shard.h"
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#define CHUNK_HEADER_SIZE ((off_t)sizeof(unsigned long long))
+#define CHUNK_NAME_LENGTH 32
+#define CDC_CUT_MASK ((((unsigned long long)1 << CDC_AVG_BITS) - 1) << (64 - CDC_AVG_BITS))
+#define STORAGE_BUFFER_SIZE (64 * 1024)
+
+static const unsigned long long hash_seeds[2] = {0, 0x9E3779B97F4A7C15ULL};
+static unsigned long long gear[256];
+static int gear_ready = 0;
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t bytes_written = write(fd, p, len);
+        if (bytes_written == -1)
+            return -1;
+        p += bytes_written;
+        len -= bytes_written;
+    }
+    return 0;
+}
+
+/*
+ The gear table only has to be the same on every run so that boundaries
+ found today match the ones found yesterday, splitmix64 gives us that.
+*/
+static void gear_init(void)
+{
+    unsigned long long x = 0x6269626f63617321ULL;
+    int i;
+    for (i = 0; i < 256; i++)
+    {
+        unsigned long long z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_ready = 1;
+}
+
+/*
+ Length of the next chunk of data. The gear hash only looks at the last
+ 64 bytes, so an edit moves the boundaries around it and no others.
+*/
+static size_t cdc_cut(const unsigned char *data, size_t len)
+{
+    unsigned long long h = 0;
+    size_t i, max = len < CDC_MAX_CHUNK ? len : CDC_MAX_CHUNK;
+    if (len <= CDC_MIN_CHUNK)
+        return len;
+    for (i = CDC_MIN_CHUNK; i < max; i++)
+    {
+        h = (h << 1) + gear[data[i]];
+        if ((h & CDC_CUT_MASK) == 0)
+            return i + 1;
+    }
+    return max;
+}
+
+static void chunk_dir(const char *dirname, const unsigned long long hash[2], char *path, size_t size)
+{
+    snprintf(path, size, "%s/%s/%02x", dirname, CHUNK_STORE_DIR, (unsigned int)(hash[0] >> 56));
+}
+
+// Returns -1 with errno set if the path does not fit in size
+static int chunk_path(const char *dirname, const unsigned long long hash[2], char *path, size_t size)
+{
+    if (snprintf(path, size, "%s/%s/%02x/%016llx%016llx", dirname, CHUNK_STORE_DIR, (unsigned int)(hash[0] >> 56),
+                 hash[0], hash[1]) >= (int)size)
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// A chunk at count zero is dead, whoever finds it still under its name removes it
+static void chunk_drop_dead(int fd, const char *path)
+{
+    struct stat st, path_st;
+    if (fstat(fd, &st) == 0 && stat(path, &path_st) == 0 && st.st_ino == path_st.st_ino && st.st_dev == path_st.st_dev)
+        unlink(path);
+}
+
+static int chunk_matches(int fd, const unsigned char *data, size_t len)
+{
+    unsigned char buffer[STORAGE_BUFFER_SIZE];
+    struct stat st;
+    size_t done = 0;
+    if (fstat(fd, &st) == -1 || st.st_size != CHUNK_HEADER_SIZE + (off_t)len)
+        return 0;
+    while (done < len)
+    {
+        size_t want = len - done < sizeof(buffer) ? len - done : sizeof(buffer);
+        if (pread(fd, buffer, want, CHUNK_HEADER_SIZE + done) != (ssize_t)want || memcmp(buffer, data + done, want) != 0)
+            return 0;
+        done += want;
+    }
+    return 1;
+}
+
+/*
+ Takes a reference on the chunk holding data, storing it first if it is
+ new. A count of zero seen under the lock means the chunk was unlinked
+ after we opened it, or a crash left it behind, so it is removed if still
+ there and we start over with whatever is at the path now.
+*/
+static int chunk_ref(const char *dirname, const manifest_entry_t *entry, const unsigned char *data)
+{
+    char path[MAX_PATH_LENGTH], temp_path[MAX_PATH_LENGTH];
+    unsigned long long count;
+    if (chunk_path(dirname, entry->hash, path, sizeof(path)) == -1)
+        return -1;
+    while (1)
+    {
+        int fd = open(path, O_RDWR);
+        if (fd == -1)
+        {
+            if (errno != ENOENT)
+                return -1;
+            // Write new chunks aside and link them in so nobody sees half of one
+            snprintf(temp_path, sizeof(temp_path), "%s/%s", dirname, CHUNK_STORE_DIR);
+            mkdir(temp_path, 0777);
+            chunk_dir(dirname, entry->hash, temp_path, sizeof(temp_path));
+            mkdir(temp_path, 0777);
+            if (snprintf(temp_path, sizeof(temp_path), "%s.%ld", path, (long)getpid()) >= (int)sizeof(temp_path))
+            {
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+            count = 1;
+            fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd == -1)
+                return -1;
+            if (write_full(fd, &count, sizeof(count)) == -1 || write_full(fd, data, entry->length) == -1)
+            {
+                close(fd);
+                unlink(temp_path);
+                return -1;
+            }
+            close(fd);
+            int status = link(temp_path, path);
+            int saved_errno = errno;
+            unlink(temp_path);
+            if (status == 0)
+                return 0;
+            if (saved_errno != EEXIST)
+            {
+                errno = saved_errno;
+                return -1;
+            }
+            continue;
+        }
+        flock(fd, LOCK_EX);
+        if (pread(fd, &count, sizeof(count), 0) != sizeof(count))
+        {
+            close(fd);
+            errno = EIO;
+            return -1;
+        }
+        if (count == 0)
+        {
+            chunk_drop_dead(fd, path);
+            close(fd);
+            continue;
+        }
+        // Two different chunks with one name would corrupt both files
+        if (!chunk_matches(fd, data, entry->length))
+        {
+            close(fd);
+            errno = EEXIST;
+            return -1;
+        }
+        count++;
+        pwrite(fd, &count, sizeof(count), 0);
+        close(fd);
+        return 0;
+    }
+}
+
+static void chunk_unref(const char *dirname, const unsigned long long hash[2])
+{
+    char path[MAX_PATH_LENGTH];
+    unsigned long long count;
+    if (chunk_path(dirname, hash, path, sizeof(path)) == -1)
+        return;
+    while (1)
+    {
+        int fd = open(path, O_RDWR);
+        if (fd == -1)
+            return;
+        flock(fd, LOCK_EX);
+        if (pread(fd, &count, sizeof(count), 0) != sizeof(count))
+        {
+            close(fd);
+            return;
+        }
+        if (count == 0)
+        {
+            chunk_drop_dead(fd, path);
+            close(fd);
+            continue;
+        }
+        count--;
+        pwrite(fd, &count, sizeof(count), 0);
+        if (count == 0)
+            unlink(path);
+        close(fd);
+        return;
+    }
+}
+
+/*
+ Reads the manifest header of fd and, if entries is not NULL, its entries.
+ Returns 1 for a manifest, 0 for a plain file and -1 on read errors.
+*/
+static int manifest_load(int fd, manifest_header_t *header, manifest_entry_t **entries)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return -1;
+    if (!(st.st_mode & S_ISVTX) || st.st_size < (off_t)sizeof(*header))
+        return 0;
+    if (pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+        return -1;
+    if (memcmp(header->magic, MANIFEST_MAGIC, sizeof(header->magic)) != 0 || header->count < 0 ||
+        st.st_size != (off_t)(sizeof(*header) + header->count * sizeof(manifest_entry_t)))
+        return 0;
+    if (entries == NULL)
+        return 1;
+    size_t length = header->count * sizeof(manifest_entry_t);
+    *entries = malloc(length + sizeof(manifest_entry_t));
+    if (*entries == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (pread(fd, *entries, length, sizeof(*header)) != (ssize_t)length || crc32c(0, *entries, length) != header->checksum)
+    {
+        free(*entries);
+        *entries = NULL;
+        errno = EIO;
+        return -1;
+    }
+    return 1;
+}
+
+int storage_is_manifest(int fd)
+{
+    manifest_header_t header;
+    return manifest_load(fd, &header, NULL) == 1;
+}
+
+int storage_open(stored_file_t *file, const char *dirname, const char *path)
+{
+    manifest_header_t header;
+    struct stat st;
+    long long i;
+    memset(file, 0, sizeof(*file));
+    file->chunk_fd = -1;
+    file->chunk_index = -1;
+    snprintf(file->dirname, sizeof(file->dirname), "%s", dirname);
+    while (1)
+    {
+        if ((file->fd = open(path, O_RDONLY)) == -1 || fstat(file->fd, &st) == -1)
+            break;
+        if (st.st_mode & S_ISVTX)
+        {
+            // A manifest keeps its chunks while anyone holds it
+            flock(file->fd, LOCK_SH);
+        }
+        else
+        {
+            // Writers that find the read lock leave this inode as it is, see storage_has_readers.
+            // Taking flock once waits out a write that began before the lock was there.
+            struct flock lock = {.l_type = F_RDLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1};
+            fcntl(file->fd, F_OFD_SETLK, &lock);
+            flock(file->fd, LOCK_SH);
+            flock(file->fd, LOCK_UN);
+        }
+        // Replaced between the open and the lock, the name now holds something else
+        if (fstat(file->fd, &st) == -1 || st.st_nlink > 0)
+            break;
+        if (st.st_mode & S_ISVTX)
+            storage_release(dirname, file->fd);
+        close(file->fd);
+    }
+    if (file->fd == -1)
+        return -1;
+    int status = manifest_load(file->fd, &header, &file->entries);
+    if (status == 0)
+    {
+        fstat(file->fd, &st);
+        file->size = st.st_size;
+        return 0;
+    }
+    if (status == -1)
+    {
+        close(file->fd);
+        return -1;
+    }
+
+    file->is_manifest = 1;
+    file->size = header.size;
+    file->count = header.count;
+    file->offsets = malloc((file->count + 1) * sizeof(long long));
+    if (file->offsets == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    file->offsets[0] = 0;
+    for (i = 0; i < file->count; i++)
+        file->offsets[i + 1] = file->offsets[i] + file->entries[i].length;
+    if (file->offsets[file->count] != file->size)
+    {
+        storage_close(file);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+static long long storage_find_chunk(stored_file_t *file, off_t offset)
+{
+    long long low = 0, high = file->count - 1;
+    // Sequential readers stay in the same chunk or step to the next one
+    if (file->chunk_index >= 0 && offset >= file->offsets[file->chunk_index])
+    {
+        if (offset < file->offsets[file->chunk_index + 1])
+            return file->chunk_index;
+        if (file->chunk_index + 1 < file->count && offset < file->offsets[file->chunk_index + 2])
+            return file->chunk_index + 1;
+    }
+    while (low < high)
+    {
+        long long mid = low + (high - low + 1) / 2;
+        if (file->offsets[mid] <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+ssize_t storage_pread(stored_file_t *file, void *buf, size_t len, off_t offset)
+{
+    char *p = buf;
+    size_t done = 0;
+    while (done < len && offset < file->size)
+    {
+        ssize_t bytes_read;
+        if (!file->is_manifest)
+            bytes_read = pread(file->fd, p + done, len - done, offset);
+        else
+        {
+            long long i = storage_find_chunk(file, offset);
+            if (i != file->chunk_index)
+            {
+                char path[MAX_PATH_LENGTH];
+                if (file->chunk_fd != -1)
+                    close(file->chunk_fd);
+                file->chunk_fd = chunk_path(file->dirname, file->entries[i].hash, path, sizeof(path)) == -1
+                                     ? -1
+                                     : open(path, O_RDONLY);
+                file->chunk_index = file->chunk_fd == -1 ? -1 : i;
+                if (file->chunk_fd == -1)
+                    return done > 0 ? (ssize_t)done : -1;
+            }
+            size_t want = len - done;
+            if ((off_t)want > file->offsets[i + 1] - offset)
+                want = file->offsets[i + 1] - offset;
+            bytes_read = pread(file->chunk_fd, p + done, want, CHUNK_HEADER_SIZE + offset - file->offsets[i]);
+            if (bytes_read == 0)
+            {
+                // A chunk shorter than its manifest entry says
+                errno = EIO;
+                bytes_read = -1;
+            }
+        }
+        if (bytes_read == -1)
+            return done > 0 ? (ssize_t)done : -1;
+        if (bytes_read == 0)
+            break;
+        done += bytes_read;
+        offset += bytes_read;
+    }
+    return done;
+}
+
+ssize_t storage_read(stored_file_t *file, void *buf, size_t len)
+{
+    ssize_t bytes_read = storage_pread(file, buf, len, file->pos);
+    if (bytes_read > 0)
+        file->pos += bytes_read;
+    return bytes_read;
+}
+
+off_t storage_seek(stored_file_t *file, off_t offset)
+{
+    if (offset < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    file->pos = offset;
+    return offset;
+}
+
+uint32_t storage_crc32c(stored_file_t *file, off_t start, off_t end)
+{
+    char buffer[STORAGE_BUFFER_SIZE];
+    uint32_t crc = 0;
+    if (!file->is_manifest)
+        return crc32c_file_range(file->fd, start, end);
+    while (start < end)
+    {
+        size_t want = end - start < (off_t)sizeof(buffer) ? (size_t)(end - start) : sizeof(buffer);
+        ssize_t bytes_read = storage_pread(file, buffer, want, start);
+        if (bytes_read <= 0)
+            break;
+        crc = crc32c(crc, buffer, bytes_read);
+        start += bytes_read;
+    }
+    return crc;
+}
+
+void storage_close(stored_file_t *file)
+{
+    // The last reader of a manifest that was replaced meanwhile gives its chunks back
+    if (file->fd != -1 && file->is_manifest)
+        storage_release(file->dirname, file->fd);
+    if (file->fd != -1)
+        close(file->fd);
+    if (file->chunk_fd != -1)
+        close(file->chunk_fd);
+    free(file->entries);
+    free(file->offsets);
+    file->fd = -1;
+    file->chunk_fd = -1;
+    file->entries = NULL;
+    file->offsets = NULL;
+}
+
+int storage_ingest(const char *dirname, int src_fd, const char *manifest_path)
+{
+    manifest_header_t header;
+    struct stat st;
+    unsigned char *data = NULL;
+    size_t pos = 0;
+    long long i;
+    int status = 0;
+    if (fstat(src_fd, &st) == -1)
+        return -1;
+    if (st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src_fd, 0)) == MAP_FAILED)
+        return -1;
+    if (!gear_ready)
+        gear_init();
+
+    // Every chunk but the last is at least CDC_MIN_CHUNK long
+    manifest_entry_t *entries = malloc((st.st_size / CDC_MIN_CHUNK + 1) * sizeof(manifest_entry_t));
+    if (entries == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+    header.size = st.st_size;
+    while (pos < (size_t)st.st_size && status == 0)
+    {
+        manifest_entry_t *entry = &entries[header.count];
+        size_t length = cdc_cut(data + pos, st.st_size - pos);
+        memset(entry, 0, sizeof(*entry));
+        entry->hash[0] = hash64(data + pos, length, hash_seeds[0]);
+        entry->hash[1] = hash64(data + pos, length, hash_seeds[1]);
+        entry->length = length;
+        if (chunk_ref(dirname, entry, data + pos) == -1)
+            status = -1;
+        else
+            header.count++;
+        pos += length;
+    }
+
+    if (status == 0)
+    {
+        header.checksum = crc32c(0, entries, header.count * sizeof(manifest_entry_t));
+        int fd = open(manifest_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+        if (fd == -1 || write_full(fd, &header, sizeof(header)) == -1 ||
+            write_full(fd, entries, header.count * sizeof(manifest_entry_t)) == -1 ||
+            fchmod(fd, (st.st_mode & 0777) | S_ISVTX) == -1)
+        {
+            status = -1;
+            unlink(manifest_path);
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    if (status == -1)
+    {
+        for (i = 0; i < header.count; i++)
+            chunk_unref(dirname, entries[i].hash);
+    }
+    if (data != NULL)
+        munmap(data, st.st_size);
+    free(entries);
+    return status;
+}
+
+void storage_release(const char *dirname, int manifest_fd)
+{
+    manifest_header_t header;
+    manifest_entry_t *entries;
+    struct stat st;
+    char proc_path[64];
+    long long i;
+    // A manifest still linked elsewhere, e.g. kept as a version, keeps its references,
+    // one still being read keeps them until its last reader closes it
+    if (fstat(manifest_fd, &st) == 0 && st.st_nlink > 0)
+        return;
+    if (flock(manifest_fd, LOCK_EX | LOCK_NB) == -1)
+        return;
+    if (manifest_load(manifest_fd, &header, &entries) != 1)
+        return;
+    for (i = 0; i < header.count; i++)
+        chunk_unref(dirname, entries[i].hash);
+    free(entries);
+    // Emptied so nobody who opened it before it lost its name releases it again
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", manifest_fd);
+    int fd = open(proc_path, O_WRONLY);
+    if (fd == -1 || ftruncate(fd, 0) == -1)
+        perror("Error emptying released manifest");
+    if (fd != -1)
+        close(fd);
+}
+
+int storage_has_readers(int fd)
+{
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1};
+    if (fcntl(fd, F_OFD_GETLK, &lock) == -1)
+        return 0;
+    return lock.l_type != F_UNLCK;
+}
+
+void storage_discard(const char *dirname, const char *manifest_path)
+{
+    int fd = open(manifest_path, O_RDONLY);
+    unlink(manifest_path);
+    if (fd != -1)
+    {
+        storage_release(dirname, fd);
+        close(fd);
+    }
+}
+
+int storage_materialize(const char *dirname, const char *file)
+{
+    char path[MAX_PATH_LENGTH], temp_name[STORAGE_TEMP_NAME_LEN], temp_path[MAX_PATH_LENGTH];
+    char buffer[STORAGE_BUFFER_SIZE];
+    stored_file_t stored;
+    struct stat st;
+    ssize_t bytes_read;
+    int status = 0;
+    shard_path(dirname, file, path, sizeof(path));
+    if (storage_open(&stored, dirname, path) == -1)
+        return errno == ENOENT ? 0 : -1;
+    if (!stored.is_manifest)
+    {
+        storage_close(&stored);
+        return 0;
+    }
+
+    snprintf(temp_name, sizeof(temp_name), MATERIALIZE_FILE_TEMPLATE, file, (long)getpid());
+    snprintf(temp_path, sizeof(temp_path), "%s/%s", dirname, temp_name);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (fd == -1)
+    {
+        storage_close(&stored);
+        return -1;
+    }
+    while ((bytes_read = storage_read(&stored, buffer, sizeof(buffer))) > 0)
+    {
+        if (write_full(fd, buffer, bytes_read) == -1)
+            break;
+    }
+    if (bytes_read != 0 || stored.pos != stored.size)
+        status = -1;
+    fstat(stored.fd, &st);
+    fchmod(fd, st.st_mode & 0777);
+    close(fd);
+    if (status == 0 && rename(temp_path, path) == 0)
+        storage_release(dirname, stored.fd);
+    else
+    {
+        status = -1;
+        unlink(temp_path);
+    }
+    storage_close(&stored);
+    return status;
+}
+
+static int compare_hash(const void *a, const void *b)
+{
+    const unsigned long long *x = a, *y = b;
+    if (x[0] != y[0])
+        return x[0] < y[0] ? -1 : 1;
+    if (x[1] != y[1])
+        return x[1] < y[1] ? -1 : 1;
+    return 0;
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t name_length = strlen(name), suffix_length = strlen(suffix);
+    return name_length >= suffix_length && strcmp(name + name_length - suffix_length, suffix) == 0;
+}
+
+// References held by the manifests seen so far, each inode counted once however many names it has
+typedef struct
+{
+    unsigned long long (*refs)[2];
+    long long count, capacity;
+    ino_t *inodes;
+    long long inode_count, inode_capacity;
+} ref_list_t;
+
+static void count_manifest(const char *path, ref_list_t *list)
+{
+    manifest_header_t header;
+    manifest_entry_t *entries;
+    struct stat st;
+    long long i;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return;
+    if (fstat(fd, &st) == -1 || manifest_load(fd, &header, &entries) != 1)
+    {
+        close(fd);
+        return;
+    }
+    close(fd);
+    for (i = 0; st.st_nlink > 1 && i < list->inode_count; i++)
+    {
+        if (list->inodes[i] == st.st_ino)
+        {
+            free(entries);
+            return;
+        }
+    }
+    if (st.st_nlink > 1)
+    {
+        if (list->inode_count == list->inode_capacity)
+        {
+            list->inode_capacity = list->inode_capacity == 0 ? 64 : list->inode_capacity * 2;
+            list->inodes = realloc(list->inodes, list->inode_capacity * sizeof(ino_t));
+            if (list->inodes == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        list->inodes[list->inode_count++] = st.st_ino;
+    }
+    if (list->count + header.count > list->capacity)
+    {
+        list->capacity = (list->count + header.count) * 2;
+        list->refs = realloc(list->refs, list->capacity * sizeof(*list->refs));
+        if (list->refs == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < header.count; i++, list->count++)
+        memcpy(list->refs[list->count], entries[i].hash, sizeof(list->refs[list->count]));
+    free(entries);
+}
+
+void storage_gc(const char *dirname, int log_fd)
+{
+    char path[MAX_PATH_LENGTH];
+    ref_list_t list;
+    long long kept = 0, removed = 0, fixed = 0, file_count, n;
+    char **names;
+    DIR *dir, *sub_dir;
+    struct dirent *ent, *sub_ent;
+    // Nothing was ever stored deduplicated, there is no manifest to look for
+    snprintf(path, sizeof(path), "%s/%s", dirname, CHUNK_STORE_DIR);
+    if (access(path, F_OK) == -1 || (dir = opendir(dirname)) == NULL)
+        return;
+    memset(&list, 0, sizeof(list));
+
+    // Drop temporaries a crash left behind, then count every reference held by a manifest
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (ent->d_type != DT_REG || ent->d_name[0] != '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dirname, ent->d_name);
+        if (has_suffix(ent->d_name, ".manifest") || has_suffix(ent->d_name, ".plain"))
+            unlink(path);
+    }
+    closedir(dir);
+    file_count = shard_list(dirname, &names);
+    for (n = 0; n < file_count; n++)
+    {
+        shard_path(dirname, names[n], path, sizeof(path));
+        count_manifest(path, &list);
+    }
+    shard_free_names(names, file_count);
+    // Old versions of files hold references too
+    snprintf(path, sizeof(path), "%s/%s", dirname, VERSION_DIR);
+    if ((dir = opendir(path)) != NULL)
+    {
+        while ((ent = readdir(dir)) != NULL)
+        {
+            char sub_path[MAX_PATH_LENGTH];
+            if (ent->d_name[0] == '.')
+                continue;
+            snprintf(sub_path, sizeof(sub_path), "%s/%s/%s", dirname, VERSION_DIR, ent->d_name);
+            if ((sub_dir = opendir(sub_path)) == NULL)
+                continue;
+            while ((sub_ent = readdir(sub_dir)) != NULL)
+            {
+                if (sub_ent->d_name[0] == '.')
+                    continue;
+                if (snprintf(path, sizeof(path), "%s/%s", sub_path, sub_ent->d_name) >= (int)sizeof(path))
+                    continue;
+                count_manifest(path, &list);
+            }
+            closedir(sub_dir);
+        }
+        closedir(dir);
+    }
+    free(list.inodes);
+    unsigned long long (*refs)[2] = list.refs;
+    long long ref_count = list.count;
+    if (ref_count > 0)
+        qsort(refs, ref_count, sizeof(*refs), compare_hash);
+
+    // Sweep the store, fixing counts and removing what nobody references
+    snprintf(path, sizeof(path), "%s/%s", dirname, CHUNK_STORE_DIR);
+    if ((dir = opendir(path)) == NULL)
+    {
+        free(refs);
+        return;
+    }
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char sub_path[MAX_PATH_LENGTH];
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(sub_path, sizeof(sub_path), "%s/%s/%s", dirname, CHUNK_STORE_DIR, ent->d_name);
+        if ((sub_dir = opendir(sub_path)) == NULL)
+            continue;
+        while ((sub_ent = readdir(sub_dir)) != NULL)
+        {
+            unsigned long long hash[2], count = 0, stored_count;
+            if (strcmp(sub_ent->d_name, ".") == 0 || strcmp(sub_ent->d_name, "..") == 0)
+                continue;
+            if (snprintf(path, sizeof(path), "%s/%s", sub_path, sub_ent->d_name) >= (int)sizeof(path))
+                continue;
+            if (strlen(sub_ent->d_name) != CHUNK_NAME_LENGTH ||
+                strspn(sub_ent->d_name, "0123456789abcdef") != CHUNK_NAME_LENGTH ||
+                sscanf(sub_ent->d_name, "%16llx%16llx", &hash[0], &hash[1]) != 2)
+            {
+                unlink(path);
+                continue;
+            }
+            unsigned long long (*found)[2] = ref_count > 0 ? bsearch(hash, refs, ref_count, sizeof(*refs), compare_hash) : NULL;
+            if (found != NULL)
+            {
+                long long first = found - refs, last = first;
+                while (first > 0 && compare_hash(refs[first - 1], hash) == 0)
+                    first--;
+                while (last + 1 < ref_count && compare_hash(refs[last + 1], hash) == 0)
+                    last++;
+                count = last - first + 1;
+            }
+            if (count == 0)
+            {
+                unlink(path);
+                removed++;
+                continue;
+            }
+            int fd = open(path, O_RDWR);
+            if (fd == -1)
+                continue;
+            if (pread(fd, &stored_count, sizeof(stored_count), 0) != sizeof(stored_count) || stored_count != count)
+            {
+                pwrite(fd, &count, sizeof(count), 0);
+                fixed++;
+            }
+            close(fd);
+            kept++;
+        }
+        closedir(sub_dir);
+    }
+    closedir(dir);
+    free(refs);
+    my_log(log_fd, ">> Chunk store: %lld chunks kept, %lld removed, %lld recounted\n", kept, removed, fixed);
+}
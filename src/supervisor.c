@@ -0,0 +1,237 @@
+#include "../include/supervisor.h"
+#include "../include/logger.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+static worker_report_t *self_report = NULL;
+
+static unsigned int pid_home(const supervisor_t *supervisor, pid_t pid)
+{
+    return ((unsigned int)pid * 2654435761u) & supervisor->pid_mask;
+}
+
+static void pid_insert(supervisor_t *supervisor, int slot)
+{
+    unsigned int i = pid_home(supervisor, supervisor->workers[slot].pid);
+    while (supervisor->pid_slots[i] != -1)
+        i = (i + 1) & supervisor->pid_mask;
+    supervisor->pid_slots[i] = slot;
+}
+
+// Slot of pid, taken out of the map, -1 for a pid that is not ours
+static int pid_remove(supervisor_t *supervisor, pid_t pid)
+{
+    unsigned int i = pid_home(supervisor, pid), j;
+    while (supervisor->pid_slots[i] != -1 && supervisor->workers[supervisor->pid_slots[i]].pid != pid)
+        i = (i + 1) & supervisor->pid_mask;
+    int slot = supervisor->pid_slots[i];
+    if (slot == -1)
+        return -1;
+    // Entries after the hole that probed past it move up into it
+    for (j = (i + 1) & supervisor->pid_mask; supervisor->pid_slots[j] != -1; j = (j + 1) & supervisor->pid_mask)
+    {
+        unsigned int home = pid_home(supervisor, supervisor->workers[supervisor->pid_slots[j]].pid);
+        if (((j - home) & supervisor->pid_mask) >= ((j - i) & supervisor->pid_mask))
+        {
+            supervisor->pid_slots[i] = supervisor->pid_slots[j];
+            i = j;
+        }
+    }
+    supervisor->pid_slots[i] = -1;
+    return slot;
+}
+
+void supervisor_init(supervisor_t *supervisor, int capacity, int log_fd, void (*exited)(const worker_t *worker))
+{
+    sigset_t chld;
+    int i;
+    memset(supervisor, 0, sizeof(*supervisor));
+    supervisor->capacity = capacity;
+    supervisor->log_fd = log_fd;
+    supervisor->exited = exited;
+    supervisor->workers = malloc(capacity * sizeof(worker_t));
+    supervisor->free_slots = malloc(capacity * sizeof(int));
+    supervisor->reports = mmap(NULL, capacity * sizeof(worker_report_t), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    // At most half full, so a probe ends soon
+    unsigned int pid_size = 1;
+    while (pid_size < 2 * (unsigned int)capacity)
+        pid_size *= 2;
+    supervisor->pid_mask = pid_size - 1;
+    supervisor->pid_slots = malloc(pid_size * sizeof(int));
+    if (supervisor->workers == NULL || supervisor->free_slots == NULL || supervisor->reports == MAP_FAILED ||
+        supervisor->pid_slots == NULL)
+    {
+        perror("Error allocating the process table");
+        exit(EXIT_FAILURE);
+    }
+    // The lowest slots are handed out first
+    for (i = 0; i < capacity; i++)
+    {
+        memset(&supervisor->workers[i], 0, sizeof(worker_t));
+        supervisor->workers[i].pid = -1;
+        supervisor->workers[i].report = &supervisor->reports[i];
+        supervisor->free_slots[i] = capacity - 1 - i;
+    }
+    supervisor->free_count = capacity;
+    for (i = 0; i <= (int)supervisor->pid_mask; i++)
+        supervisor->pid_slots[i] = -1;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &chld, &supervisor->orig_mask) == -1 ||
+        (supervisor->signal_fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+        perror("Error watching for child exits");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static pid_t start_worker(supervisor_t *supervisor, worker_t *worker)
+{
+    memset(worker->report, 0, sizeof(worker_report_t));
+    worker->report->waiter = -1;
+    worker->report->journal_record = -1;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(supervisor->signal_fd);
+        sigprocmask(SIG_SETMASK, &supervisor->orig_mask, NULL);
+        self_report = worker->report;
+        if (worker->run == NULL)
+            return 0;
+        worker->run(worker->arg);
+        exit(EXIT_SUCCESS);
+    }
+    if (pid == -1)
+        return -1;
+    worker->pid = pid;
+    pid_insert(supervisor, worker - supervisor->workers);
+    clock_gettime(CLOCK_MONOTONIC, &worker->started);
+    supervisor->live++;
+    return pid;
+}
+
+static void reaped(supervisor_t *supervisor, pid_t pid, int status, const struct rusage *usage)
+{
+    struct timespec now;
+    char who[64], how[32];
+    int slot = pid_remove(supervisor, pid);
+    if (slot == -1)
+        return;
+    worker_t *worker = &supervisor->workers[slot];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ran = (now.tv_sec - worker->started.tv_sec) + (now.tv_nsec - worker->started.tv_nsec) / 1e9;
+    if (worker->report->counter_id > 0)
+        snprintf(who, sizeof(who), "%s_%ld", worker->name, worker->report->counter_id);
+    else
+        snprintf(who, sizeof(who), "%s", worker->name);
+    int is_failed = WIFSIGNALED(status) || WEXITSTATUS(status) != 0;
+    if (WIFSIGNALED(status))
+        snprintf(how, sizeof(how), "killed by signal %d", WTERMSIG(status));
+    else
+        snprintf(how, sizeof(how), "exited with %d", WEXITSTATUS(status));
+    my_log(supervisor->log_fd,
+           ">> %s PID %d %s after %.1f s: %.2f s user, %.2f s system, %ld KiB peak RSS, %llu bytes sent, %llu received\n",
+           who, pid, how, ran, usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+           usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6, usage->ru_maxrss, worker->report->bytes_sent,
+           worker->report->bytes_received);
+    if (supervisor->exited != NULL)
+        supervisor->exited(worker);
+    worker->pid = -1;
+    supervisor->live--;
+
+    if (!supervisor->is_stopping && is_failed && worker->restart == WORKER_RESTART_ON_FAILURE && worker->run != NULL)
+    {
+        if (ran >= SUPERVISOR_STABLE_SECONDS)
+            worker->restarts = 0;
+        if (++worker->restarts > SUPERVISOR_MAX_RESTARTS)
+            my_log(supervisor->log_fd, ">> %s failed %d times in a row, left down\n", who, SUPERVISOR_MAX_RESTARTS);
+        else if (start_worker(supervisor, worker) > 0)
+        {
+            my_log(supervisor->log_fd, ">> %s restarted, PID %d\n", who, worker->pid);
+            return;
+        }
+    }
+    supervisor->free_slots[supervisor->free_count++] = slot;
+}
+
+pid_t supervisor_spawn(supervisor_t *supervisor, const char *name, worker_restart_t restart, void (*run)(void *),
+                       void *arg)
+{
+    // Exits not picked up yet may have freed a slot
+    if (supervisor->free_count == 0)
+        supervisor_reap(supervisor);
+    if (supervisor->free_count == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    int slot = supervisor->free_slots[--supervisor->free_count];
+    worker_t *worker = &supervisor->workers[slot];
+    worker->name = name;
+    worker->restart = restart;
+    worker->run = run;
+    worker->arg = arg;
+    worker->restarts = 0;
+    pid_t pid = start_worker(supervisor, worker);
+    if (pid == -1)
+        supervisor->free_slots[supervisor->free_count++] = slot;
+    return pid;
+}
+
+void supervisor_reap(supervisor_t *supervisor)
+{
+    struct signalfd_siginfo info;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+    // Exits at the same time may come as one signal, wait4 finds every one of them
+    while (read(supervisor->signal_fd, &info, sizeof(info)) > 0)
+        ;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+        reaped(supervisor, pid, status, &usage);
+}
+
+void supervisor_signal(supervisor_t *supervisor, int sig)
+{
+    int i;
+    if (self_report != NULL || supervisor->workers == NULL)
+        return;
+    for (i = 0; i < supervisor->capacity; i++)
+    {
+        if (supervisor->workers[i].pid != -1)
+            kill(supervisor->workers[i].pid, sig);
+    }
+}
+
+void supervisor_stop(supervisor_t *supervisor)
+{
+    struct rusage usage;
+    int status;
+    supervisor->is_stopping = 1;
+    while (supervisor->live > 0)
+    {
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error waiting for child process");
+            break;
+        }
+        printf("Child process with PID %d terminated\n", pid);
+        reaped(supervisor, pid, status, &usage);
+    }
+}
+
+worker_report_t *supervisor_self()
+{
+    return self_report;
+}
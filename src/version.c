@@ -0,0 +1,179 @@
+#include "../include/version.h"
+#include "../include/storage.h"
+#include "../include/shard.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+int version_clone(int src_fd, int dst_fd, off_t length)
+{
+    char buffer[64 * 1024];
+    off_t in = 0, out = 0;
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0)
+        return 0;
+    // Without shared blocks the kernel still copies them without a round trip through here
+    while (in < length)
+    {
+        ssize_t copied = copy_file_range(src_fd, &in, dst_fd, &out, length - in, 0);
+        if (copied == 0)
+            break;
+        if (copied > 0)
+            continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+            return -1;
+        ssize_t bytes_read = pread(src_fd, buffer, sizeof(buffer), in);
+        if (bytes_read <= 0)
+            return bytes_read == 0 ? 0 : -1;
+        if (pwrite(dst_fd, buffer, bytes_read, out) != bytes_read)
+            return -1;
+        in += bytes_read;
+        out += bytes_read;
+    }
+    return 0;
+}
+
+int version_can_clone(const char *dirname)
+{
+    int src_fd = open(dirname, O_TMPFILE | O_RDWR, 0600);
+    int dst_fd = open(dirname, O_TMPFILE | O_RDWR, 0600);
+    int can_clone = src_fd != -1 && dst_fd != -1 && ioctl(dst_fd, FICLONE, src_fd) == 0;
+    if (src_fd != -1)
+        close(src_fd);
+    if (dst_fd != -1)
+        close(dst_fd);
+    return can_clone;
+}
+
+static int compare_numbers(const void *a, const void *b)
+{
+    const long *x = a, *y = b;
+    return *x < *y ? -1 : *x > *y;
+}
+
+// Version numbers kept in dir, oldest first
+static int version_numbers(const char *dir_path, long **numbers)
+{
+    DIR *dir;
+    struct dirent *ent;
+    int count = 0, capacity = 0;
+    *numbers = NULL;
+    if ((dir = opendir(dir_path)) == NULL)
+        return 0;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        char *end;
+        long number = strtol(ent->d_name, &end, 10);
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9' || *end != '\0' || number <= 0)
+            continue;
+        if (count == capacity)
+        {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            *numbers = realloc(*numbers, capacity * sizeof(long));
+            if (*numbers == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*numbers)[count++] = number;
+    }
+    closedir(dir);
+    if (count > 0)
+        qsort(*numbers, count, sizeof(long), compare_numbers);
+    return count;
+}
+
+// A manifest gives its chunks back once the last of its names is gone
+static void drop_version(const char *dirname, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    unlink(path);
+    if (fd != -1)
+    {
+        storage_release(dirname, fd);
+        close(fd);
+    }
+}
+
+long version_save(const char *dirname, const char *file, int keep)
+{
+    char path[MAX_PATH_LENGTH], dir_path[MAX_PATH_LENGTH], kept_path[MAX_PATH_LENGTH + 24];
+    struct stat st;
+    long *numbers;
+    int count, i;
+    shard_path(dirname, file, path, sizeof(path));
+    if (stat(path, &st) == -1)
+        return errno == ENOENT ? 0 : -1;
+    // A file that was only just created has nothing worth going back to
+    if (st.st_size == 0)
+        return 0;
+    snprintf(dir_path, sizeof(dir_path), "%s/%s", dirname, VERSION_DIR);
+    if (mkdir(dir_path, 0777) == -1 && errno != EEXIST)
+        return -1;
+    snprintf(dir_path, sizeof(dir_path), "%s/%s/%s", dirname, VERSION_DIR, file);
+    if (mkdir(dir_path, 0777) == -1 && errno != EEXIST)
+        return -1;
+
+    count = version_numbers(dir_path, &numbers);
+    long number = count > 0 ? numbers[count - 1] + 1 : 1;
+    snprintf(kept_path, sizeof(kept_path), "%s/%ld", dir_path, number);
+    if (link(path, kept_path) == -1)
+    {
+        free(numbers);
+        return -1;
+    }
+    for (i = 0; i + keep < count + 1; i++)
+    {
+        snprintf(kept_path, sizeof(kept_path), "%s/%ld", dir_path, numbers[i]);
+        drop_version(dirname, kept_path);
+    }
+    free(numbers);
+    return number;
+}
+
+int version_path(const char *dirname, const char *name, char *path, size_t size)
+{
+    const char *at = strrchr(name, '@');
+    // Only a plain file name leads into VERSION_DIR
+    if (at != NULL && at > name && at[1] != '\0' && strspn(at + 1, "0123456789") == strlen(at + 1) &&
+        name[0] != '.' && memchr(name, '/', at - name) == NULL)
+    {
+        int length = snprintf(path, size, "%s/%s/%.*s/%s", dirname, VERSION_DIR, (int)(at - name), name, at + 1);
+        if (length >= 0 && (size_t)length < size && access(path, F_OK) == 0)
+            return 1;
+    }
+    shard_path(dirname, name, path, size);
+    return 0;
+}
+
+size_t version_list(const char *dirname, const char *file, char *buf, size_t size)
+{
+    char dir_path[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH + 24], date[32];
+    long *numbers;
+    size_t used = 0;
+    int count, i;
+    snprintf(dir_path, sizeof(dir_path), "%s/%s/%s", dirname, VERSION_DIR, file);
+    count = version_numbers(dir_path, &numbers);
+    buf[0] = '\0';
+    for (i = 0; i < count; i++)
+    {
+        stored_file_t stored;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%ld", dir_path, numbers[i]);
+        if (storage_open(&stored, dirname, path) == -1)
+            continue;
+        fstat(stored.fd, &st);
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&st.st_mtime));
+        used += snprintf(used < size ? buf + used : NULL, used < size ? size - used : 0, "%s@%ld %lld bytes %s\n", file,
+                         numbers[i], (long long)stored.size, date);
+        storage_close(&stored);
+    }
+    free(numbers);
+    return used;
+}
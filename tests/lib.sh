@@ -0,0 +1,99 @@
+# Helpers shared by the tests: a server on a scratch directory, clients
+# fed their commands on stdin, and checks that end the test on failure.
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d /tmp/bibo_test.XXXXXX)
+SRV=$WORK/srv
+CL=$WORK/cl
+SERVER_PID=
+mkdir -p "$SRV" "$CL"
+
+cleanup()
+{
+    if [ -n "$SERVER_PID" ]; then
+        kill -INT "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+        rm -f "/tmp/bibo_server.$SERVER_PID"
+    fi
+    [ -n "$KEEP" ] || rm -rf "$WORK"
+}
+# KEEP=1 leaves the scratch directory behind to look at after a failure
+trap cleanup EXIT
+
+fail()
+{
+    echo "FAIL $(basename "$0"): $*"
+    if [ -f "$WORK/server.out" ]; then
+        tail -n 20 "$WORK/server.out"
+    fi
+    exit 1
+}
+
+# check <description> <command...>
+check()
+{
+    description=$1
+    shift
+    "$@" || fail "$description"
+}
+
+# has_line <text> <pattern> succeeds when a line of text matches pattern
+has_line()
+{
+    printf '%s\n' "$1" | grep -q -- "$2"
+}
+
+lacks_line()
+{
+    ! has_line "$1" "$2"
+}
+
+# Waits up to 5 s for <path> to exist
+wait_for()
+{
+    tries=0
+    while [ ! -e "$1" ]; do
+        tries=$((tries + 1))
+        [ $tries -le 50 ] || return 1
+        sleep 0.1
+    done
+}
+
+# start_server <max. #ofClients> [flags...]
+start_server()
+{
+    "$ROOT/server" "$SRV" "$@" >> "$WORK/server.out" 2>&1 &
+    SERVER_PID=$!
+    wait_for "/tmp/bibo_server.$SERVER_PID.sock" || fail "server did not start"
+}
+
+# The server leaves its FIFO behind when it stops
+stop_server()
+{
+    kill -INT "$SERVER_PID"
+    wait "$SERVER_PID"
+    rm -f "/tmp/bibo_server.$SERVER_PID"
+    SERVER_PID=
+}
+
+# Kills the server and every child of it without letting it clean up
+crash_server()
+{
+    pkill -KILL -P "$SERVER_PID"
+    kill -KILL "$SERVER_PID"
+    wait "$SERVER_PID" 2>/dev/null
+    rm -f "/tmp/bibo_server.$SERVER_PID" "/tmp/bibo_server.$SERVER_PID.sock" "/dev/shm/que.$SERVER_PID"
+    SERVER_PID=
+}
+
+# client <command>... runs the commands in one session and prints what it got
+client()
+{
+    (cd "$CL" && printf '%s\n' "$@" quit | timeout 30 "$ROOT/client" connect "$SERVER_PID")
+}
+
+# server_log <pattern> succeeds when the server log has a line matching it
+server_log()
+{
+    grep -q -- "$1" "$SRV"/logs/*
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Runs every tests/test_*.sh against the server and client built in the
+# repository root, prints one line per test and fails if any did.
+cd "$(dirname "$0")" || exit 1
+failed=0
+for test in test_*.sh; do
+    sh "$test" || failed=$((failed + 1))
+done
+if [ $failed -ne 0 ]; then
+    echo "$failed test(s) failed"
+    exit 1
+fi
+echo "all tests passed"
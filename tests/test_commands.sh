@@ -0,0 +1,44 @@
+#!/bin/sh
+# readF ranges and tails, writeT inserts and appends, names that must not leave the directory
+. "$(dirname "$0")/lib.sh"
+
+seq 1 10 > "$SRV/a.txt"
+echo secret > "$WORK/outside.txt"
+start_server 2
+
+out=$(client "readF a.txt 2-4")
+check "readF of a range starts at its first line" has_line "$out" "^> 2$"
+check "readF of a range ends at its last line" lacks_line "$out" "^5$"
+out=$(client "readF -t 3 a.txt")
+check "readF -t reads the last lines" has_line "$out" "^> 8$"
+check "readF -t reads no more" lacks_line "$out" "^7$"
+# 0 lines is not "no tail", it must not read the whole file
+out=$(client "readF -t 0 a.txt")
+check "readF -t 0 is refused" lacks_line "$out" "^5$"
+
+out=$(client "readF ../outside.txt")
+check "readF of a name with .. is refused" lacks_line "$out" "secret"
+client "writeT ../outside.txt changed" > /dev/null
+check "writeT of a name with .. is refused" grep -qx secret "$WORK/outside.txt"
+echo internal > "$SRV/.hidden"
+out=$(client "readF .hidden")
+check "readF of a hidden name is refused" lacks_line "$out" "internal"
+client "writeT .hidden 2 changed" > /dev/null
+check "writeT of a hidden name is refused" test "$(cat "$SRV/.hidden")" = internal
+
+client "writeT a.txt 3 three" "writeT a.txt eleven" > /dev/null
+check "writeT inserts before line 3" has_line "$(sed -n 3p "$SRV/a.txt")" "^three$"
+check "writeT without a line appends" has_line "$(tail -n 1 "$SRV/a.txt")" "^eleven$"
+check "writeT keeps the other lines" test "$(wc -l < "$SRV/a.txt")" -eq 12
+seq 1 1000 > "$SRV/big.txt"
+client "writeT big.txt 2 inserted" > /dev/null
+check "writeT inserts into a large file" has_line "$(sed -n 2p "$SRV/big.txt")" "^inserted$"
+check "writeT shifts the whole rest of a large file" \
+    test "$(sed 2d "$SRV/big.txt" | cksum)" = "$(seq 1 1000 | cksum)"
+
+echo kept > "$SRV/v1..2.txt"
+out=$(client "readF v1..2.txt")
+check "a name with .. inside it is served" has_line "$out" "kept"
+
+stop_server
+echo "ok $(basename "$0")"
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Delta uploads send only what changed and rebuild the file exactly
+. "$(dirname "$0")/lib.sh"
+
+head -c 3000000 /dev/urandom > "$SRV/d.bin"
+cp "$SRV/d.bin" "$CL/d.bin"
+printf 'changed in the middle' | dd of="$CL/d.bin" bs=1 seek=1000000 conv=notrunc 2> /dev/null
+head -c 10000 /dev/urandom >> "$CL/d.bin"
+head -c 5000 /dev/urandom > "$CL/n.bin"
+start_server 2
+
+out=$(client "upload -d d.bin")
+check "a delta upload rebuilds the file" cmp -s "$CL/d.bin" "$SRV/d.bin"
+sent=$(printf '%s\n' "$out" | sed -n 's/.* \([0-9]*\) sent, .*/\1/p')
+reused=$(printf '%s\n' "$out" | sed -n 's/.* \([0-9]*\) reused).*/\1/p')
+check "a delta upload reports what it sent" test -n "$sent" -a -n "$reused"
+check "a delta upload reuses the unchanged blocks" test "$reused" -gt 2900000
+check "a delta upload sends only what changed" test "$sent" -lt 300000
+out=$(client "upload -d n.bin")
+check "a delta upload of a new file sends it whole" cmp -s "$CL/n.bin" "$SRV/n.bin"
+(printf 'prefix\n'; cat "$CL/n.bin") > "$CL/n.tmp" && mv "$CL/n.tmp" "$CL/n.bin"
+client "upload -d n.bin" > /dev/null
+check "a delta upload follows data that moved" cmp -s "$CL/n.bin" "$SRV/n.bin"
+check "no delta file is left" test -z "$(find "$SRV" -maxdepth 1 -name '.*.delta')"
+
+stop_server
+echo "ok $(basename "$0")"
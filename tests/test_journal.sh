@@ -0,0 +1,30 @@
+#!/bin/sh
+# Journaled writes survive the server being killed, a torn tail is dropped
+# and a clean stop leaves nothing to replay over later edits
+. "$(dirname "$0")/lib.sh"
+
+seq 1 5 > "$SRV/j.txt"
+start_server 2
+client "writeT j.txt six" "writeT j.txt 3 inserted" "writeT j.txt seven" > /dev/null
+crash_server
+
+start_server 2
+check "writes acknowledged before a crash are kept" test "$(wc -l < "$SRV/j.txt")" -eq 8
+check "an insert is kept in place" has_line "$(sed -n 3p "$SRV/j.txt")" "^inserted$"
+check "appends are kept in order" has_line "$(tail -n 2 "$SRV/j.txt" | tr '\n' ' ')" "^six seven $"
+stop_server
+check "a clean stop empties the journal" test ! -s "$SRV/.journal"
+
+# A file edited while the server is down must not be overwritten by old records
+echo edited > "$SRV/j.txt"
+start_server 2
+stop_server
+check "an edit made while the server was down is kept" grep -qx edited "$SRV/j.txt"
+
+head -c 100 /dev/urandom > "$SRV/.journal"
+start_server 2
+check "a torn journal is reported" server_log "torn bytes dropped"
+check "a torn journal is not applied" grep -qx edited "$SRV/j.txt"
+check "a replayed journal is emptied" test ! -s "$SRV/.journal"
+stop_server
+echo "ok $(basename "$0")"
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Interrupted uploads and downloads go on from where they stopped, and end up whole
+. "$(dirname "$0")/lib.sh"
+
+head -c 8000000 /dev/urandom > "$CL/up.bin"
+head -c 8000000 /dev/urandom > "$SRV/down.bin"
+# 2000 KiB/s per client leaves time to interrupt a transfer
+start_server 2 -r 2000
+
+# interrupt <command> starts a session with it and stops the client a second in
+interrupt()
+{
+    printf '%s\n' "$1" > "$WORK/commands"
+    (cd "$CL" && exec "$ROOT/client" connect "$SERVER_PID" < "$WORK/commands" > "$WORK/interrupted.out" 2>&1) &
+    client_pid=$!
+    sleep 1
+    kill -INT "$client_pid"
+    wait "$client_pid"
+}
+
+interrupt "upload up.bin"
+check "an interrupted upload says so" grep -q "Upload interrupted" "$WORK/interrupted.out"
+check "an interrupted upload is not published" test ! -e "$SRV/up.bin"
+out=$(client "upload up.bin")
+check "the upload resumes" has_line "$out" "Resuming upload at byte [1-9]"
+check "the resumed upload is whole" cmp -s "$CL/up.bin" "$SRV/up.bin"
+check "no part file is left" test -z "$(find "$SRV" -maxdepth 1 -name '.*.part')"
+
+interrupt "download down.bin"
+out=$(client "download down.bin")
+check "the download resumes" has_line "$out" "Resuming download at byte [1-9]"
+check "the resumed download is whole" cmp -s "$SRV/down.bin" "$CL/down.bin"
+
+# A server that goes away mid-download fails it instead of keeping the client waiting
+rm "$CL/down.bin"
+printf 'download down.bin\n' > "$WORK/commands"
+(cd "$CL" && exec timeout 10 "$ROOT/client" connect "$SERVER_PID" < "$WORK/commands" > "$WORK/lost.out" 2>&1) &
+client_pid=$!
+sleep 1
+crash_server
+wait "$client_pid"
+check "a client whose server died exits" test $? -ne 124
+check "a download cut off by the server says so" grep -q "Download of down.bin failed" "$WORK/lost.out"
+check "a download cut off by the server leaves no file" test ! -e "$CL/down.bin"
+echo "ok $(basename "$0")"
@@ -0,0 +1,49 @@
+#!/bin/sh
+# A flat directory is moved into shards while clients keep reading and
+# editing it, no file may go missing, no edit be lost and no file left behind
+. "$(dirname "$0")/lib.sh"
+
+(cd "$SRV" && seq 0 19999 | awk '{ name = "f" $1 ".txt"; print "file " $1 > name; close(name) }')
+start_server 4 -S
+
+writers=
+for c in 0 1 2; do
+    (
+        n=$c
+        set --
+        while [ $n -lt 20000 ]; do
+            set -- "$@" "writeT f$n.txt edited"
+            n=$((n + 500))
+        done
+        client "$@" > /dev/null
+    ) &
+    writers="$writers $!"
+done
+(
+    n=250
+    set --
+    while [ $n -lt 20000 ]; do
+        set -- "$@" "readF f$n.txt"
+        n=$((n + 500))
+    done
+    client "$@" > "$WORK/reads.out"
+) &
+wait $writers $!
+
+check "no file goes missing while it is moved" lacks_line "$(cat "$WORK/reads.out")" "no such a file"
+check "every read gets its file" test "$(grep -c '^> file [0-9]*$' "$WORK/reads.out")" -eq 40
+
+tries=0
+while [ -n "$(find "$SRV" -maxdepth 1 -name 'f*.txt' | head -n 1)" ]; do
+    tries=$((tries + 1))
+    [ $tries -le 300 ] || fail "files are still flat after 30 s"
+    sleep 0.1
+done
+check "every file is moved into a shard" test "$(find "$SRV/.shards" -name 'f*.txt' | wc -l)" -eq 20000
+check "no edit made during the move is lost" \
+    test "$(find "$SRV/.shards" -name 'f*.txt' -exec grep -l '^edited$' {} + | wc -l)" -eq 120
+out=$(client "readF f42.txt")
+check "a moved file is still served" has_line "$out" "file 42"
+
+stop_server
+echo "ok $(basename "$0")"
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Crashed helpers are started again and a crashed session gives its slot
+# to the next client in the queue
+. "$(dirname "$0")/lib.sh"
+
+# children <pid> lists the children of pid, one per line
+children()
+{
+    pgrep -P "$1" | sort
+}
+
+# session <seconds> <output> keeps a client connected for that long
+session()
+{
+    (cd "$CL" && (sleep "$1"; echo quit) | timeout 30 "$ROOT/client" connect "$SERVER_PID" > "$2" 2>&1) &
+}
+
+# wait_output <file> <pattern> waits up to 5 s for a line of file to match
+wait_output()
+{
+    tries=0
+    while ! grep -q -- "$2" "$1" 2>/dev/null; do
+        tries=$((tries + 1))
+        [ $tries -le 50 ] || return 1
+        sleep 0.1
+    done
+}
+
+echo "some text" > "$SRV/s.txt"
+start_server 1 -x
+wait_output "$SRV/logs/"* "Indexing the directory" || fail "the indexer did not start"
+indexer=$(sed -n 's/.*Indexing the directory for search, PID \([0-9]*\).*/\1/p' "$SRV/logs/"*)
+kill -KILL "$indexer"
+check "a crashed indexer is started again" wait_output "$SRV/logs/"* "indexer restarted"
+out=$(client "search text")
+check "the restarted indexer answers searches" has_line "$out" "s.txt"
+
+helpers=$(children "$SERVER_PID")
+session 10 "$WORK/first.out"
+first=$!
+check "the first client is served" wait_output "$WORK/first.out" "Connection established"
+serving=$(children "$SERVER_PID" | grep -vxF "$helpers")
+session 3 "$WORK/second.out"
+check "the second client waits in the queue" wait_output "$WORK/second.out" "Waiting for Que"
+kill -KILL $serving
+check "a crashed session lets the next client in" wait_output "$WORK/second.out" "Connection established"
+wait $first
+
+stop_server
+echo "ok $(basename "$0")"